@@ -93,6 +93,7 @@ static void gb_connection_kref_release(struct kref *kref)
 
 	connection = container_of(kref, struct gb_connection, kref);
 
+	kfree(connection->rx_segments);
 	kfree(connection);
 }
 
@@ -183,12 +184,17 @@ _gb_connection_create(struct gb_host_device *hd, int hd_cport_id,
 	connection->bundle = bundle;
 	connection->handler = handler;
 	connection->flags = flags;
+	if (intf && intf->segmentation)
+		connection->flags |= GB_CONNECTION_FLAG_SEGMENTATION;
 	connection->state = GB_CONNECTION_STATE_DISABLED;
 
 	atomic_set(&connection->op_cycle, 0);
 	mutex_init(&connection->mutex);
 	spin_lock_init(&connection->lock);
 	INIT_LIST_HEAD(&connection->operations);
+	INIT_LIST_HEAD(&connection->tx_queue);
+	INIT_LIST_HEAD(&connection->tx_links);
+	connection->tx_weight = GB_CONNECTION_TX_WEIGHT_DEFAULT;
 
 	connection->wq = alloc_workqueue("%s:%d", WQ_UNBOUND, 1,
 					 dev_name(&hd->dev), hd_cport_id);
@@ -664,6 +670,38 @@ void gb_connection_destroy(struct gb_connection *connection)
 }
 EXPORT_SYMBOL_GPL(gb_connection_destroy);
 
+/*
+ * Enable segmentation on a connection created before segmentation support
+ * was known. The caller must make sure no operation is in flight.
+ */
+void gb_connection_segmentation_enable(struct gb_connection *connection)
+{
+	spin_lock_irq(&connection->lock);
+	connection->flags |= GB_CONNECTION_FLAG_SEGMENTATION;
+	spin_unlock_irq(&connection->lock);
+}
+
+/*
+ * Set the share of the host device's transmit bandwidth the connection gets
+ * when several connections have messages queued, relative to the others.
+ */
+int gb_connection_set_tx_weight(struct gb_connection *connection,
+				unsigned int weight)
+{
+	struct gb_host_device *hd = connection->hd;
+	unsigned long flags;
+
+	if (weight == 0 || weight > GB_CONNECTION_TX_WEIGHT_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	connection->tx_weight = weight;
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gb_connection_set_tx_weight);
+
 void gb_connection_latency_tag_enable(struct gb_connection *connection)
 {
 	struct gb_host_device *hd = connection->hd;
@@ -14,6 +14,15 @@
 #include <linux/kfifo.h>
 
 #define GB_CONNECTION_FLAG_CSD		BIT(0)
+#define GB_CONNECTION_FLAG_SEGMENTATION	BIT(1)
+
+/* Bytes a connection of weight one may send per transmit scheduling round */
+#define GB_CONNECTION_TX_QUANTUM	2048
+#define GB_CONNECTION_TX_WEIGHT_DEFAULT	1
+#define GB_CONNECTION_TX_WEIGHT_MAX	64
+
+/* Weight for connections whose short messages users are waiting on */
+#define GB_CONNECTION_TX_WEIGHT_INTERACTIVE	4
 
 enum gb_connection_state {
 	GB_CONNECTION_STATE_INVALID	= 0,
@@ -54,6 +63,16 @@ struct gb_connection {
 
 	atomic_t			op_cycle;
 
+	/* Outgoing message scheduling, protected by hd->tx_lock */
+	struct list_head		tx_queue;
+	struct list_head		tx_links;	/* hd->tx_active */
+	unsigned int			tx_weight;
+	size_t				tx_deficit;
+
+	/* Segmented incoming request being reassembled, in RX context */
+	void				*rx_segments;
+	size_t				rx_segments_size;
+
 	void				*private;
 };
 
@@ -80,6 +99,11 @@ void gb_connection_disable(struct gb_connection *connection);
 void greybus_data_rcvd(struct gb_host_device *hd, u16 cport_id,
 			u8 *data, size_t length);
 
+void gb_connection_segmentation_enable(struct gb_connection *connection);
+
+int gb_connection_set_tx_weight(struct gb_connection *connection,
+				unsigned int weight);
+
 void gb_connection_latency_tag_enable(struct gb_connection *connection);
 void gb_connection_latency_tag_disable(struct gb_connection *connection);
 
@@ -88,6 +112,12 @@ static inline bool gb_connection_e2efc_enabled(struct gb_connection *connection)
 	return !(connection->flags & GB_CONNECTION_FLAG_CSD);
 }
 
+static inline bool
+gb_connection_segmentation_enabled(struct gb_connection *connection)
+{
+	return connection->flags & GB_CONNECTION_FLAG_SEGMENTATION;
+}
+
 static inline void *gb_connection_get_data(struct gb_connection *connection)
 {
 	return connection->private;
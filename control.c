@@ -54,6 +54,53 @@ static int gb_control_get_version(struct gb_control *control)
 	return 0;
 }
 
+/*
+ * Find out whether the interface accepts and sends segmented messages. This
+ * is done before any of its bundle connections exist, which get segmentation
+ * enabled from the start if so. Interfaces that do not know the request
+ * reject it.
+ */
+static int gb_control_get_segmentation(struct gb_control *control)
+{
+	struct gb_interface *intf = control->connection->intf;
+	struct gb_operation *operation;
+	int ret;
+
+	intf->segmentation = false;
+
+	operation = gb_operation_create(control->connection,
+					GB_CONTROL_TYPE_SEGMENTATION, 0, 0,
+					GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	ret = gb_operation_request_send_sync(operation);
+	gb_operation_put(operation);
+
+	switch (ret) {
+	case 0:
+		break;
+	case -EPROTONOSUPPORT:
+	case -EINVAL:
+		dev_dbg(&intf->dev, "segmentation not supported\n");
+		return 0;
+	default:
+		dev_err(&intf->dev, "failed to get segmentation support: %d\n",
+			ret);
+		return ret;
+	}
+
+	intf->segmentation = true;
+
+	/*
+	 * The control connection only carries the operations we send, and
+	 * none is in flight, so nothing received meanwhile is affected.
+	 */
+	gb_connection_segmentation_enable(control->connection);
+
+	return 0;
+}
+
 static int gb_control_get_bundle_version(struct gb_control *control,
 						struct gb_bundle *bundle)
 {
@@ -221,6 +268,10 @@ int gb_control_enable(struct gb_control *control)
 	if (control->protocol_major > 0 || control->protocol_minor > 1)
 		control->has_bundle_version = true;
 
+	ret = gb_control_get_segmentation(control);
+	if (ret)
+		goto err_disable_connection;
+
 	return 0;
 
 err_disable_connection:
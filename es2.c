@@ -6,11 +6,13 @@
  *
  * Released under the GPLv2 only.
  */
-#include <linux/kthread.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
 #include <linux/kfifo.h>
 #include <linux/debugfs.h>
+#include <linux/poll.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
 #include <asm/unaligned.h>
 
 #include "greybus.h"
@@ -21,6 +23,23 @@
 /* Memory sizes for the buffers sent to/from the ES2 controller */
 #define ES2_GBUF_MSG_SIZE_MAX	2048
 
+/* Largest aggregated bulk transfer we ask the ES2 controller to handle */
+#define ES2_AGG_BUF_SIZE	(2 * ES2_GBUF_MSG_SIZE_MAX)
+
+/* An aggregated transfer must be able to carry one maximum-sized message */
+#define ES2_AGG_SIZE_MIN	ALIGN(sizeof(struct gb_apb_aggregation_hdr) + \
+				      ES2_GBUF_MSG_SIZE_MAX, \
+				      GB_APB_AGGREGATION_ALIGN)
+
+/*
+ * GB_APB_REQUEST_AGGREGATION is not part of the vendor requests every bridge
+ * firmware implements, so it is only sent when asked for.
+ */
+static bool aggregation;
+module_param(aggregation, bool, 0444);
+MODULE_PARM_DESC(aggregation,
+		 "pack messages into bulk transfers, needs bridge support");
+
 static const struct usb_device_id id_table[] = {
 	{ USB_DEVICE(0x18d1, 0x1eaf) },
 	{ },
@@ -44,6 +63,13 @@ MODULE_DEVICE_TABLE(usb, id_table);
  */
 #define NUM_CPORT_OUT_URB	(8 * NUM_BULKS)
 
+/*
+ * Number of aggregated CPort OUT urbs in flight per bulk out endpoint.
+ * Messages sent while all of them are busy are queued and packed together
+ * into the next transfer.
+ */
+#define NUM_CPORT_OUT_AGG_URB	2
+
 /*
  * @endpoint: bulk in endpoint for CPort data
  * @urb: array of urbs for the CPort in messages
@@ -55,11 +81,78 @@ struct es2_cport_in {
 	u8 *buffer[NUM_CPORT_IN_URB];
 };
 
+/*
+ * Asynchronous control requests are sent using a pool of preallocated urbs and
+ * request buffers. Requests that find all urbs busy are queued until one
+ * completes; requests that find all buffers busy are rejected.
+ */
+#define NUM_OUTPUT_URB		8
+#define NUM_OUTPUT_BUF		32
+#define ES2_OUTPUT_SIZE_MAX	64
+
+/*
+ * @dr: setup packet for the request
+ * @data: request payload
+ * @links: entry in the free or pending buffer list
+ */
+struct es2_output_buf {
+	struct usb_ctrlrequest dr;
+	u8 data[ES2_OUTPUT_SIZE_MAX];
+	struct list_head links;
+};
+
+/*
+ * @submitted: requests handed to the USB core
+ * @queued: requests that had to wait for an urb
+ * @rejected: requests that found all buffers busy
+ * @errors: requests that failed to be submitted or transferred
+ * @unpooled: requests too large for the pool that were allocated dynamically
+ * @buf_in_use: number of buffers currently in use
+ * @buf_in_use_max: largest number of buffers in use at any time
+ * @pending: number of requests currently waiting for an urb
+ * @pending_max: largest number of requests waiting for an urb at any time
+ */
+struct es2_output_stats {
+	unsigned long submitted;
+	unsigned long queued;
+	unsigned long rejected;
+	unsigned long errors;
+	unsigned long unpooled;
+	unsigned int buf_in_use;
+	unsigned int buf_in_use_max;
+	unsigned int pending;
+	unsigned int pending_max;
+};
+
+struct es2_ap_dev;
+struct es2_cport_out;
+
+/*
+ * @es2: the ES2 device this urb belongs to
+ * @cport_out: the bulk out endpoint this urb is used for
+ * @urb: urb for the aggregated transfer
+ * @buffer: DMA-coherent transfer buffer for @urb
+ * @messages: list of messages packed into @buffer
+ * @busy: whether @urb is in flight
+ */
+struct es2_agg_urb {
+	struct es2_ap_dev *es2;
+	struct es2_cport_out *cport_out;
+	struct urb *urb;
+	u8 *buffer;
+	struct list_head messages;
+	bool busy;
+};
+
 /*
  * @endpoint: bulk out endpoint for CPort data
+ * @agg_urb: array of urbs for aggregated transfers
+ * @agg_queue: list of messages waiting for an aggregated transfer
  */
 struct es2_cport_out {
 	__u8 endpoint;
+	struct es2_agg_urb agg_urb[NUM_CPORT_OUT_AGG_URB];
+	struct list_head agg_queue;
 };
 
 /**
@@ -75,9 +168,25 @@ struct es2_cport_out {
  *			not.
  * @cport_out_urb_cancelled: array of flags indicating whether the
  *			corresponding @cport_out_urb is being cancelled
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_out_urb_lock: locks the @cport_out_urb_busy "list", as well as the
+ *			aggregation urbs and queues of @cport_out
+ * @agg_size: negotiated size of aggregated bulk transfers, or zero if every
+ *	      transfer carries a single message
+ *
+ * @output_urb: array of urbs for asynchronous control requests
+ * @output_urb_busy: array of flags to see if the @output_urb is busy or not
+ * @output_buf: array of buffers for asynchronous control requests
+ * @output_free: list of unused @output_buf entries
+ * @output_pending: list of @output_buf entries waiting for an @output_urb
+ * @output_lock: protects the output urbs, buffers, lists and statistics
+ * @output_stats: usage statistics of the asynchronous control request pool
+ * @output_stats_dentry: file system entry for @output_stats
  *
- * @apb_log_task: task pointer for logging thread
+ * @apb_log_urb: control urb used to stream the log, NULL if disabled
+ * @apb_log_work: work used to (re)submit @apb_log_urb after a delay
+ * @apb_log_delay: current delay between log requests in milliseconds
+ * @apb_log_mutex: serialises enabling and disabling of logging
+ * @apb_log_wait: wait queue for readers polling the log file
  * @apb_log_dentry: file system entry for the log file interface
  * @apb_log_enable_dentry: file system entry for enabling logging
  * @apb_log_fifo: kernel FIFO to carry logged data
@@ -93,10 +202,24 @@ struct es2_ap_dev {
 	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
 	bool cport_out_urb_cancelled[NUM_CPORT_OUT_URB];
 	spinlock_t cport_out_urb_lock;
+	size_t agg_size;
 
 	int *cport_to_ep;
 
-	struct task_struct *apb_log_task;
+	struct urb *output_urb[NUM_OUTPUT_URB];
+	bool output_urb_busy[NUM_OUTPUT_URB];
+	struct es2_output_buf *output_buf[NUM_OUTPUT_BUF];
+	struct list_head output_free;
+	struct list_head output_pending;
+	spinlock_t output_lock;
+	struct es2_output_stats output_stats;
+	struct dentry *output_stats_dentry;
+
+	struct urb *apb_log_urb;
+	struct delayed_work apb_log_work;
+	unsigned int apb_log_delay;
+	struct mutex apb_log_mutex;
+	wait_queue_head_t apb_log_wait;
 	struct dentry *apb_log_dentry;
 	struct dentry *apb_log_enable_dentry;
 	DECLARE_KFIFO(apb_log_fifo, char, APB1_LOG_SIZE);
@@ -120,6 +243,7 @@ static inline struct es2_ap_dev *hd_to_es2(struct gb_host_device *hd)
 }
 
 static void cport_out_callback(struct urb *urb);
+static void cport_out_agg_callback(struct urb *urb);
 static void usb_log_enable(struct es2_ap_dev *es2);
 static void usb_log_disable(struct es2_ap_dev *es2);
 
@@ -225,7 +349,9 @@ static void ap_urb_complete(struct urb *urb)
 	usb_free_urb(urb);
 }
 
-static int output_async(struct es2_ap_dev *es2, void *req, u16 size, u8 cmd)
+/* Send a request too large for the pool with a dynamically allocated urb */
+static int output_async_unpooled(struct es2_ap_dev *es2, void *req, u16 size,
+				 u8 cmd)
 {
 	struct usb_device *udev = es2->usb_dev;
 	struct urb *urb;
@@ -263,6 +389,186 @@ static int output_async(struct es2_ap_dev *es2, void *req, u16 size, u8 cmd)
 	return retval;
 }
 
+static void output_async_callback(struct urb *urb);
+
+/* Called with the output_lock held. */
+static int output_async_submit(struct es2_ap_dev *es2, struct urb *urb,
+			       struct es2_output_buf *buf)
+{
+	struct usb_device *udev = es2->usb_dev;
+	int retval;
+
+	usb_fill_control_urb(urb, udev, usb_sndctrlpipe(udev, 0),
+			     (unsigned char *)&buf->dr, buf->data,
+			     le16_to_cpu(buf->dr.wLength),
+			     output_async_callback, es2);
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval) {
+		es2->output_stats.errors++;
+		return retval;
+	}
+
+	es2->output_stats.submitted++;
+
+	return 0;
+}
+
+/* Called with the output_lock held. */
+static void output_buf_put(struct es2_ap_dev *es2, struct es2_output_buf *buf)
+{
+	list_add(&buf->links, &es2->output_free);
+	es2->output_stats.buf_in_use--;
+}
+
+static void output_async_callback(struct urb *urb)
+{
+	struct es2_ap_dev *es2 = urb->context;
+	struct es2_output_stats *stats = &es2->output_stats;
+	struct es2_output_buf *buf;
+	unsigned long flags;
+	int i;
+
+	buf = container_of((struct usb_ctrlrequest *)urb->setup_packet,
+			   struct es2_output_buf, dr);
+
+	spin_lock_irqsave(&es2->output_lock, flags);
+
+	if (urb->status)
+		stats->errors++;
+	output_buf_put(es2, buf);
+
+	/* Hand the urb to the next request waiting for one. */
+	while (!list_empty(&es2->output_pending)) {
+		buf = list_first_entry(&es2->output_pending,
+				       struct es2_output_buf, links);
+		list_del(&buf->links);
+		stats->pending--;
+
+		if (!output_async_submit(es2, urb, buf))
+			goto out_unlock;
+
+		output_buf_put(es2, buf);
+	}
+
+	for (i = 0; i < NUM_OUTPUT_URB; ++i) {
+		if (es2->output_urb[i] == urb) {
+			es2->output_urb_busy[i] = false;
+			break;
+		}
+	}
+out_unlock:
+	spin_unlock_irqrestore(&es2->output_lock, flags);
+}
+
+/*
+ * Send a control request without sleeping or allocating memory. The request
+ * is copied into a preallocated buffer and either submitted right away or
+ * queued until one of the pooled urbs completes.
+ */
+static int output_async(struct es2_ap_dev *es2, void *req, u16 size, u8 cmd)
+{
+	struct es2_output_stats *stats = &es2->output_stats;
+	struct es2_output_buf *buf;
+	struct urb *urb = NULL;
+	unsigned long flags;
+	int retval = 0;
+	int i;
+
+	if (size > ES2_OUTPUT_SIZE_MAX) {
+		spin_lock_irqsave(&es2->output_lock, flags);
+		stats->unpooled++;
+		spin_unlock_irqrestore(&es2->output_lock, flags);
+
+		return output_async_unpooled(es2, req, size, cmd);
+	}
+
+	spin_lock_irqsave(&es2->output_lock, flags);
+
+	buf = list_first_entry_or_null(&es2->output_free,
+				       struct es2_output_buf, links);
+	if (!buf) {
+		stats->rejected++;
+		retval = -EBUSY;
+		goto out_unlock;
+	}
+	list_del(&buf->links);
+	stats->buf_in_use++;
+	stats->buf_in_use_max = max(stats->buf_in_use_max, stats->buf_in_use);
+
+	memcpy(buf->data, req, size);
+	buf->dr.bRequest = cmd;
+	buf->dr.bRequestType = USB_DIR_OUT | USB_TYPE_VENDOR |
+			       USB_RECIP_INTERFACE;
+	buf->dr.wValue = 0;
+	buf->dr.wIndex = 0;
+	buf->dr.wLength = cpu_to_le16(size);
+
+	/* Don't overtake requests that are already waiting. */
+	if (list_empty(&es2->output_pending)) {
+		for (i = 0; i < NUM_OUTPUT_URB; ++i) {
+			if (!es2->output_urb_busy[i]) {
+				es2->output_urb_busy[i] = true;
+				urb = es2->output_urb[i];
+				break;
+			}
+		}
+	}
+
+	if (!urb) {
+		list_add_tail(&buf->links, &es2->output_pending);
+		stats->queued++;
+		stats->pending++;
+		stats->pending_max = max(stats->pending_max, stats->pending);
+		goto out_unlock;
+	}
+
+	retval = output_async_submit(es2, urb, buf);
+	if (retval) {
+		es2->output_urb_busy[i] = false;
+		output_buf_put(es2, buf);
+	}
+
+out_unlock:
+	spin_unlock_irqrestore(&es2->output_lock, flags);
+
+	return retval;
+}
+
+static int output_stats_show(struct seq_file *s, void *unused)
+{
+	struct es2_ap_dev *es2 = s->private;
+	struct es2_output_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&es2->output_lock, flags);
+	stats = es2->output_stats;
+	spin_unlock_irqrestore(&es2->output_lock, flags);
+
+	seq_printf(s, "submitted: %lu\n", stats.submitted);
+	seq_printf(s, "queued: %lu\n", stats.queued);
+	seq_printf(s, "rejected: %lu\n", stats.rejected);
+	seq_printf(s, "errors: %lu\n", stats.errors);
+	seq_printf(s, "unpooled: %lu\n", stats.unpooled);
+	seq_printf(s, "buffers: %u/%u (max %u)\n", stats.buf_in_use,
+		   NUM_OUTPUT_BUF, stats.buf_in_use_max);
+	seq_printf(s, "pending: %u (max %u)\n", stats.pending,
+		   stats.pending_max);
+
+	return 0;
+}
+
+static int output_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, output_stats_show, inode->i_private);
+}
+
+static const struct file_operations output_stats_fops = {
+	.open		= output_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int output(struct gb_host_device *hd, void *req, u16 size, u8 cmd,
 		     bool async)
 {
@@ -393,6 +699,146 @@ static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
 	return cport_id;
 }
 
+static struct es2_agg_urb *next_free_agg_urb(struct es2_cport_out *cport_out)
+{
+	struct es2_agg_urb *agg;
+	int i;
+
+	for (i = 0; i < NUM_CPORT_OUT_AGG_URB; ++i) {
+		agg = &cport_out->agg_urb[i];
+		if (!agg->busy) {
+			agg->busy = true;
+			return agg;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Pack as many queued messages as fit into the buffer of an aggregation urb.
+ *
+ * Called with the cport_out_urb_lock held.
+ */
+static void es2_agg_fill(struct es2_ap_dev *es2,
+			 struct es2_cport_out *cport_out,
+			 struct es2_agg_urb *agg)
+{
+	struct gb_apb_aggregation_hdr *hdr;
+	struct gb_message *message, *next;
+	size_t offset = sizeof(*hdr);
+	size_t size;
+	u8 count = 0;
+
+	list_for_each_entry_safe(message, next, &cport_out->agg_queue,
+				 hc_links) {
+		size = sizeof(*message->header) + message->payload_size;
+		if (offset + size > es2->agg_size || count == U8_MAX)
+			break;
+
+		memcpy(agg->buffer + offset, message->buffer, size);
+		trace_gb_host_device_send(es2->hd, message->header->pad[0],
+					  size);
+		offset = ALIGN(offset + size, GB_APB_AGGREGATION_ALIGN);
+
+		message->hcpriv = agg;
+		list_move_tail(&message->hc_links, &agg->messages);
+		count++;
+	}
+
+	hdr = (struct gb_apb_aggregation_hdr *)agg->buffer;
+	hdr->size = cpu_to_le16(offset);
+	hdr->count = count;
+	hdr->pad = 0;
+
+	agg->urb->transfer_buffer_length = offset;
+}
+
+/*
+ * Move the messages of an aggregation urb to @list and mark the urb free.
+ *
+ * Called with the cport_out_urb_lock held.
+ */
+static void es2_agg_detach(struct es2_agg_urb *agg, struct list_head *list)
+{
+	struct gb_message *message;
+
+	list_for_each_entry(message, &agg->messages, hc_links)
+		message->hcpriv = NULL;
+	list_splice_tail_init(&agg->messages, list);
+	agg->busy = false;
+}
+
+/* Report the send status of detached messages to the core */
+static void es2_agg_complete(struct es2_ap_dev *es2, struct list_head *list,
+			     int status)
+{
+	struct gb_message *message, *next;
+
+	list_for_each_entry_safe(message, next, list, hc_links) {
+		list_del_init(&message->hc_links);
+		gb_message_cport_clear(message->header);
+		greybus_message_sent(es2->hd, message, status);
+	}
+}
+
+/*
+ * Submit aggregated transfers for the messages queued on @cport_out for as
+ * long as there are idle aggregation urbs.
+ */
+static void es2_agg_flush(struct es2_ap_dev *es2,
+			  struct es2_cport_out *cport_out)
+{
+	struct es2_agg_urb *agg;
+	unsigned long flags;
+	LIST_HEAD(failed);
+	int retval = 0;
+
+	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
+	while (!list_empty(&cport_out->agg_queue)) {
+		agg = next_free_agg_urb(cport_out);
+		if (!agg)
+			break;
+
+		es2_agg_fill(es2, cport_out, agg);
+
+		/* Submit with the lock held to preserve the message order. */
+		retval = usb_submit_urb(agg->urb, GFP_ATOMIC);
+		if (retval) {
+			dev_err(&es2->usb_dev->dev,
+				"failed to submit aggregated out-urb: %d\n",
+				retval);
+			es2_agg_detach(agg, &failed);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+
+	if (retval)
+		es2_agg_complete(es2, &failed, retval);
+}
+
+static int message_send_aggregated(struct es2_ap_dev *es2, u16 cport_id,
+				   struct gb_message *message)
+{
+	struct es2_cport_out *cport_out;
+	unsigned long flags;
+
+	cport_out = &es2->cport_out[cport_to_ep_pair(es2, cport_id)];
+
+	/* Pack the cport id into the message header */
+	gb_message_cport_pack(message->header, cport_id);
+
+	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
+	message->hcpriv = cport_out;
+	list_add_tail(&message->hc_links, &cport_out->agg_queue);
+	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+
+	es2_agg_flush(es2, cport_out);
+
+	return 0;
+}
+
 /*
  * Returns zero if the message was successfully queued, or a negative errno
  * otherwise.
@@ -418,6 +864,9 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 		return -EINVAL;
 	}
 
+	if (es2->agg_size)
+		return message_send_aggregated(es2, cport_id, message);
+
 	/* Find a free urb */
 	urb = next_free_urb(es2, gfp_mask);
 	if (!urb)
@@ -438,7 +887,13 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 					  es2->cport_out[ep_pair].endpoint),
 			  message->buffer, buffer_size,
 			  cport_out_callback, message);
-	urb->transfer_flags |= URB_ZERO_PACKET;
+
+	/* Outbound buffers come from message_buffer_alloc() already mapped. */
+	urb->transfer_flags = URB_ZERO_PACKET;
+	if (message->hd_buffer) {
+		urb->transfer_dma = message->buffer_dma;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
 	trace_gb_host_device_send(hd, cport_id, buffer_size);
 	retval = usb_submit_urb(urb, gfp_mask);
 	if (retval) {
@@ -457,6 +912,36 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 	return 0;
 }
 
+static void message_cancel_aggregated(struct es2_ap_dev *es2,
+				      struct gb_message *message)
+{
+	struct gb_connection *connection = message->operation->connection;
+	struct es2_cport_out *cport_out;
+	bool dequeued = false;
+
+	cport_out = &es2->cport_out[cport_to_ep_pair(es2,
+						     connection->hd_cport_id)];
+
+	/*
+	 * Only messages that have not been packed yet can be cancelled. A
+	 * packed message shares its urb with other messages, so it is left
+	 * for the completion handler to report rather than failing the whole
+	 * transfer.
+	 */
+	spin_lock_irq(&es2->cport_out_urb_lock);
+	if (message->hcpriv == cport_out) {
+		message->hcpriv = NULL;
+		list_del_init(&message->hc_links);
+		dequeued = true;
+	}
+	spin_unlock_irq(&es2->cport_out_urb_lock);
+
+	if (dequeued) {
+		gb_message_cport_clear(message->header);
+		greybus_message_sent(es2->hd, message, -ECANCELED);
+	}
+}
+
 /*
  * Can not be called in atomic context.
  */
@@ -469,6 +954,11 @@ static void message_cancel(struct gb_message *message)
 
 	might_sleep();
 
+	if (es2->agg_size) {
+		message_cancel_aggregated(es2, message);
+		return;
+	}
+
 	spin_lock_irq(&es2->cport_out_urb_lock);
 	urb = message->hcpriv;
 
@@ -609,6 +1099,43 @@ static int cport_features_disable(struct gb_host_device *hd, u16 cport_id)
 	return retval;
 }
 
+/*
+ * Outbound message buffers are allocated from DMA-coherent memory so that
+ * messages can be sent without being mapped. The core never asks for inbound
+ * buffers here, as those are parsed by the CPU and coherent memory may be
+ * uncached. Aggregated transfers are copied into buffers of their own, so in
+ * that case regular memory is all we need.
+ */
+static int message_buffer_alloc(struct gb_host_device *hd,
+				struct gb_message *message, size_t size,
+				gfp_t gfp_mask)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+
+	if (es2->agg_size)
+		message->buffer = kmalloc(size, gfp_mask);
+	else
+		message->buffer = usb_alloc_coherent(es2->usb_dev, size,
+						     gfp_mask,
+						     &message->buffer_dma);
+	if (!message->buffer)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void message_buffer_free(struct gb_host_device *hd,
+				struct gb_message *message)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+
+	if (es2->agg_size)
+		kfree(message->buffer);
+	else
+		usb_free_coherent(es2->usb_dev, message->buffer_size,
+				  message->buffer, message->buffer_dma);
+}
+
 static struct gb_hd_driver es2_driver = {
 	.hd_priv_size		= sizeof(struct es2_ap_dev),
 	.message_send		= message_send,
@@ -619,6 +1146,8 @@ static struct gb_hd_driver es2_driver = {
 	.output			= output,
 	.cport_features_enable	= cport_features_enable,
 	.cport_features_disable	= cport_features_disable,
+	.message_buffer_alloc	= message_buffer_alloc,
+	.message_buffer_free	= message_buffer_free,
 };
 
 /* Common function to report consistent warnings based on URB status */
@@ -650,12 +1179,26 @@ static int check_urb_status(struct urb *urb)
 static void es2_destroy(struct es2_ap_dev *es2)
 {
 	struct usb_device *udev;
+	int bulk_out;
 	int bulk_in;
 	int i;
 
 	debugfs_remove(es2->apb_log_enable_dentry);
 	usb_log_disable(es2);
 
+	debugfs_remove(es2->output_stats_dentry);
+	for (i = 0; i < NUM_OUTPUT_URB; ++i) {
+		if (!es2->output_urb[i])
+			break;
+		usb_poison_urb(es2->output_urb[i]);
+		usb_free_urb(es2->output_urb[i]);
+		es2->output_urb[i] = NULL;
+	}
+	for (i = 0; i < NUM_OUTPUT_BUF; ++i) {
+		kfree(es2->output_buf[i]);
+		es2->output_buf[i] = NULL;
+	}
+
 	/* Tear down everything! */
 	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
 		struct urb *urb = es2->cport_out_urb[i];
@@ -668,6 +1211,23 @@ static void es2_destroy(struct es2_ap_dev *es2)
 		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
 	}
 
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		struct es2_cport_out *cport_out = &es2->cport_out[bulk_out];
+
+		for (i = 0; i < NUM_CPORT_OUT_AGG_URB; ++i) {
+			struct es2_agg_urb *agg = &cport_out->agg_urb[i];
+
+			if (!agg->urb)
+				break;
+			usb_kill_urb(agg->urb);
+			usb_free_coherent(es2->usb_dev, es2->agg_size,
+					  agg->buffer, agg->urb->transfer_dma);
+			usb_free_urb(agg->urb);
+			agg->urb = NULL;
+			agg->buffer = NULL;
+		}
+	}
+
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
 
@@ -703,14 +1263,81 @@ static void ap_disconnect(struct usb_interface *interface)
 	es2_destroy(es2);
 }
 
+static void cport_in_rcvd(struct gb_host_device *hd, struct device *dev,
+			  u8 *data, size_t size)
+{
+	struct gb_operation_msg_hdr *header;
+	u16 cport_id;
+
+	if (size < sizeof(*header)) {
+		dev_err(dev, "short message received\n");
+		return;
+	}
+
+	/* Extract the CPort id, which is packed in the message header */
+	header = (struct gb_operation_msg_hdr *)data;
+	cport_id = gb_message_cport_unpack(header);
+
+	if (cport_id_valid(hd, cport_id)) {
+		trace_gb_host_device_recv(hd, cport_id, size);
+		greybus_data_rcvd(hd, cport_id, data, size);
+	} else {
+		dev_err(dev, "invalid cport id %u received\n", cport_id);
+	}
+}
+
+/* Split an aggregated transfer into the messages it carries */
+static void cport_in_deaggregate(struct gb_host_device *hd,
+				 struct device *dev, u8 *data, size_t size)
+{
+	struct gb_apb_aggregation_hdr *hdr;
+	struct gb_operation_msg_hdr *header;
+	size_t offset = sizeof(*hdr);
+	size_t msg_size;
+	size_t agg_size;
+	int i;
+
+	if (size < sizeof(*hdr)) {
+		dev_err(dev, "short aggregated transfer received\n");
+		return;
+	}
+
+	hdr = (struct gb_apb_aggregation_hdr *)data;
+	agg_size = le16_to_cpu(hdr->size);
+	if (agg_size > size) {
+		dev_err(dev, "incomplete aggregated transfer received (%zu < %zu)\n",
+			size, agg_size);
+		return;
+	}
+
+	for (i = 0; i < hdr->count; i++) {
+		if (offset + sizeof(*header) > agg_size)
+			goto err_malformed;
+
+		header = (struct gb_operation_msg_hdr *)(data + offset);
+		msg_size = get_unaligned_le16(&header->size);
+		if (msg_size < sizeof(*header) || offset + msg_size > agg_size)
+			goto err_malformed;
+
+		cport_in_rcvd(hd, dev, data + offset, msg_size);
+
+		offset = ALIGN(offset + msg_size, GB_APB_AGGREGATION_ALIGN);
+	}
+
+	return;
+
+err_malformed:
+	dev_err(dev, "malformed aggregated transfer received (message %d of %u)\n",
+		i, hdr->count);
+}
+
 static void cport_in_callback(struct urb *urb)
 {
 	struct gb_host_device *hd = urb->context;
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
 	struct device *dev = &urb->dev->dev;
-	struct gb_operation_msg_hdr *header;
 	int status = check_urb_status(urb);
 	int retval;
-	u16 cport_id;
 
 	if (status) {
 		if ((status == -EAGAIN) || (status == -EPROTO))
@@ -719,21 +1346,12 @@ static void cport_in_callback(struct urb *urb)
 		return;
 	}
 
-	if (urb->actual_length < sizeof(*header)) {
-		dev_err(dev, "short message received\n");
-		goto exit;
-	}
-
-	/* Extract the CPort id, which is packed in the message header */
-	header = urb->transfer_buffer;
-	cport_id = gb_message_cport_unpack(header);
-
-	if (cport_id_valid(hd, cport_id)) {
-		trace_gb_host_device_recv(hd, cport_id, urb->actual_length);
-		greybus_data_rcvd(hd, cport_id, urb->transfer_buffer,
-							urb->actual_length);
+	if (es2->agg_size) {
+		cport_in_deaggregate(hd, dev, urb->transfer_buffer,
+				     urb->actual_length);
 	} else {
-		dev_err(dev, "invalid cport id %u received\n", cport_id);
+		cport_in_rcvd(hd, dev, urb->transfer_buffer,
+			      urb->actual_length);
 	}
 exit:
 	/* put our urb back in the request pool */
@@ -765,104 +1383,203 @@ static void cport_out_callback(struct urb *urb)
 	free_urb(es2, urb);
 }
 
-#define APB1_LOG_MSG_SIZE	64
-static void apb_log_get(struct es2_ap_dev *es2, char *buf)
+static void cport_out_agg_callback(struct urb *urb)
 {
-	int retval;
+	struct es2_agg_urb *agg = urb->context;
+	struct es2_ap_dev *es2 = agg->es2;
+	int status = check_urb_status(urb);
+	unsigned long flags;
+	LIST_HEAD(sent);
 
-	/* SVC messages go down our control pipe */
-	do {
-		retval = usb_control_msg(es2->usb_dev,
-					usb_rcvctrlpipe(es2->usb_dev, 0),
-					GB_APB_REQUEST_LOG,
-					USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
-					0x00, 0x00,
-					buf,
-					APB1_LOG_MSG_SIZE,
-					ES2_TIMEOUT);
-		if (retval > 0)
-			kfifo_in(&es2->apb_log_fifo, buf, retval);
-	} while (retval > 0);
+	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
+	es2_agg_detach(agg, &sent);
+	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
+
+	es2_agg_complete(es2, &sent, status);
+
+	/* Send whatever queued up while this transfer was in flight. */
+	es2_agg_flush(es2, agg->cport_out);
 }
 
-static int apb_log_poll(void *data)
+#define APB1_LOG_MSG_SIZE	64
+
+/*
+ * The log is streamed with a single control urb that is resubmitted as soon
+ * as it completes for as long as the bridge has data. Once the log has been
+ * drained, the next request is delayed, backing off from
+ * APB1_LOG_DELAY_MIN to APB1_LOG_DELAY_MAX milliseconds.
+ */
+#define APB1_LOG_DELAY_MIN	10
+#define APB1_LOG_DELAY_MAX	1000
+
+static void apb_log_callback(struct urb *urb)
 {
-	struct es2_ap_dev *es2 = data;
-	char *buf;
+	struct es2_ap_dev *es2 = urb->context;
+	int status = urb->status;
+	int retval;
 
-	buf = kmalloc(APB1_LOG_MSG_SIZE, GFP_KERNEL);
-	if (!buf)
-		return -ENOMEM;
+	switch (status) {
+	case 0:
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		/* urb killed, logging is being disabled */
+		return;
+	default:
+		dev_dbg(&urb->dev->dev, "apb log request failed: %d\n",
+			status);
+		break;
+	}
 
-	while (!kthread_should_stop()) {
-		msleep(1000);
-		apb_log_get(es2, buf);
+	if (!status && urb->actual_length > 0) {
+		kfifo_in(&es2->apb_log_fifo, urb->transfer_buffer,
+			 urb->actual_length);
+		wake_up_interruptible(&es2->apb_log_wait);
+
+		/* Keep draining the log while there is some. */
+		es2->apb_log_delay = APB1_LOG_DELAY_MIN;
+		retval = usb_submit_urb(urb, GFP_ATOMIC);
+		if (!retval || retval == -EPERM)
+			return;
+		dev_err(&urb->dev->dev, "failed to resubmit apb log urb: %d\n",
+			retval);
 	}
 
-	kfree(buf);
+	schedule_delayed_work(&es2->apb_log_work,
+			      msecs_to_jiffies(es2->apb_log_delay));
+	es2->apb_log_delay = min_t(unsigned int, 2 * es2->apb_log_delay,
+				   APB1_LOG_DELAY_MAX);
+}
 
-	return 0;
+static void apb_log_work(struct work_struct *work)
+{
+	struct es2_ap_dev *es2 = container_of(to_delayed_work(work),
+					      struct es2_ap_dev, apb_log_work);
+	int retval;
+
+	retval = usb_submit_urb(es2->apb_log_urb, GFP_KERNEL);
+	if (retval && retval != -EPERM)
+		dev_err(&es2->usb_dev->dev,
+			"failed to submit apb log urb: %d\n", retval);
 }
 
 static ssize_t apb_log_read(struct file *f, char __user *buf,
 				size_t count, loff_t *ppos)
 {
 	struct es2_ap_dev *es2 = f->f_inode->i_private;
-	ssize_t ret;
-	size_t copied;
-	char *tmp_buf;
+	unsigned int copied;
+	int ret;
 
-	if (count > APB1_LOG_SIZE)
-		count = APB1_LOG_SIZE;
+	ret = kfifo_to_user(&es2->apb_log_fifo, buf, count, &copied);
+	if (ret)
+		return ret;
 
-	tmp_buf = kmalloc(count, GFP_KERNEL);
-	if (!tmp_buf)
-		return -ENOMEM;
+	return copied;
+}
+
+static unsigned int apb_log_poll(struct file *f, poll_table *wait)
+{
+	struct es2_ap_dev *es2 = f->f_inode->i_private;
 
-	copied = kfifo_out(&es2->apb_log_fifo, tmp_buf, count);
-	ret = simple_read_from_buffer(buf, count, ppos, tmp_buf, copied);
+	poll_wait(f, &es2->apb_log_wait, wait);
 
-	kfree(tmp_buf);
+	if (!kfifo_is_empty(&es2->apb_log_fifo))
+		return POLLIN | POLLRDNORM;
 
-	return ret;
+	return 0;
 }
 
 static const struct file_operations apb_log_fops = {
 	.read	= apb_log_read,
+	.poll	= apb_log_poll,
+	.llseek	= no_llseek,
 };
 
 static void usb_log_enable(struct es2_ap_dev *es2)
 {
-	if (!IS_ERR_OR_NULL(es2->apb_log_task))
-		return;
+	struct usb_device *udev = es2->usb_dev;
+	struct usb_ctrlrequest *dr;
+	struct urb *urb;
+	u8 *buf;
+
+	mutex_lock(&es2->apb_log_mutex);
+
+	if (es2->apb_log_urb)
+		goto out_unlock;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		goto out_unlock;
+
+	dr = kmalloc(sizeof(*dr) + APB1_LOG_MSG_SIZE, GFP_KERNEL);
+	if (!dr) {
+		usb_free_urb(urb);
+		goto out_unlock;
+	}
+
+	buf = (u8 *)dr + sizeof(*dr);
+
+	/* SVC messages go down our control pipe */
+	dr->bRequest = GB_APB_REQUEST_LOG;
+	dr->bRequestType = USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE;
+	dr->wValue = 0;
+	dr->wIndex = 0;
+	dr->wLength = cpu_to_le16(APB1_LOG_MSG_SIZE);
+
+	usb_fill_control_urb(urb, udev, usb_rcvctrlpipe(udev, 0),
+			     (unsigned char *)dr, buf, APB1_LOG_MSG_SIZE,
+			     apb_log_callback, es2);
+
+	es2->apb_log_urb = urb;
+	es2->apb_log_delay = APB1_LOG_DELAY_MIN;
 
-	/* get log from APB1 */
-	es2->apb_log_task = kthread_run(apb_log_poll, es2, "apb_log");
-	if (IS_ERR(es2->apb_log_task))
-		return;
 	/* XXX We will need to rename this per APB */
 	es2->apb_log_dentry = debugfs_create_file("apb_log", S_IRUGO,
-						gb_debugfs_get(), NULL,
+						gb_debugfs_get(), es2,
 						&apb_log_fops);
+
+	/* get log from APB1 */
+	schedule_delayed_work(&es2->apb_log_work, 0);
+
+out_unlock:
+	mutex_unlock(&es2->apb_log_mutex);
 }
 
 static void usb_log_disable(struct es2_ap_dev *es2)
 {
-	if (IS_ERR_OR_NULL(es2->apb_log_task))
-		return;
+	struct urb *urb;
+
+	mutex_lock(&es2->apb_log_mutex);
+
+	urb = es2->apb_log_urb;
+	if (!urb)
+		goto out_unlock;
 
 	debugfs_remove(es2->apb_log_dentry);
 	es2->apb_log_dentry = NULL;
 
-	kthread_stop(es2->apb_log_task);
-	es2->apb_log_task = NULL;
+	/* Prevent the callback and work from resubmitting the urb. */
+	usb_poison_urb(urb);
+	cancel_delayed_work_sync(&es2->apb_log_work);
+
+	kfree(urb->setup_packet);
+	usb_free_urb(urb);
+	es2->apb_log_urb = NULL;
+
+	/* Let any poll()ers know that no more data is coming. */
+	wake_up_interruptible(&es2->apb_log_wait);
+
+out_unlock:
+	mutex_unlock(&es2->apb_log_mutex);
 }
 
 static ssize_t apb_log_enable_read(struct file *f, char __user *buf,
 				size_t count, loff_t *ppos)
 {
 	struct es2_ap_dev *es2 = f->f_inode->i_private;
-	int enable = !IS_ERR_OR_NULL(es2->apb_log_task);
+	int enable = !!es2->apb_log_urb;
 	char tmp_buf[3];
 
 	sprintf(tmp_buf, "%d\n", enable);
@@ -930,6 +1647,44 @@ out:
 	return retval;
 }
 
+/*
+ * Ask the bridge to pack multiple messages into bulk transfers of up to
+ * ES2_AGG_BUF_SIZE bytes in both directions, or to stop doing so if @enable
+ * is false.
+ *
+ * Returns the transfer size the bridge agreed to, or zero if every transfer
+ * carries a single message.
+ */
+static size_t apb_aggregation_negotiate(struct usb_device *udev, bool enable)
+{
+	__le16 *agg_size;
+	size_t size = 0;
+	int retval;
+
+	agg_size = kzalloc(sizeof(*agg_size), GFP_KERNEL);
+	if (!agg_size)
+		return 0;
+
+	retval = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+				 GB_APB_REQUEST_AGGREGATION,
+				 USB_DIR_IN | USB_TYPE_VENDOR |
+				 USB_RECIP_INTERFACE,
+				 enable ? ES2_AGG_BUF_SIZE : 0, 0,
+				 agg_size, sizeof(*agg_size), ES2_TIMEOUT);
+	if (retval != sizeof(*agg_size)) {
+		/* Bridge firmware without aggregation support stalls. */
+		dev_dbg(&udev->dev, "bulk aggregation not supported: %d\n",
+			retval);
+		goto out;
+	}
+
+	size = min_t(size_t, le16_to_cpu(*agg_size), ES2_AGG_BUF_SIZE);
+	size = round_down(size, GB_APB_AGGREGATION_ALIGN);
+out:
+	kfree(agg_size);
+	return size;
+}
+
 /*
  * The ES2 USB Bridge device has 15 endpoints
  * 1 Control - usual USB stuff + AP -> APBridgeA messages
@@ -944,6 +1699,7 @@ static int ap_probe(struct usb_interface *interface,
 	struct usb_device *udev;
 	struct usb_host_interface *iface_desc;
 	struct usb_endpoint_descriptor *endpoint;
+	size_t in_buffer_size;
 	int bulk_in = 0;
 	int bulk_out = 0;
 	int retval = -ENOMEM;
@@ -981,7 +1737,13 @@ static int ap_probe(struct usb_interface *interface,
 	es2->usb_intf = interface;
 	es2->usb_dev = udev;
 	spin_lock_init(&es2->cport_out_urb_lock);
+	spin_lock_init(&es2->output_lock);
+	INIT_LIST_HEAD(&es2->output_free);
+	INIT_LIST_HEAD(&es2->output_pending);
 	INIT_KFIFO(es2->apb_log_fifo);
+	INIT_DELAYED_WORK(&es2->apb_log_work, apb_log_work);
+	mutex_init(&es2->apb_log_mutex);
+	init_waitqueue_head(&es2->apb_log_wait);
 	usb_set_intfdata(interface, es2);
 
 	es2->cport_to_ep = kcalloc(hd->num_cports, sizeof(*es2->cport_to_ep),
@@ -1013,7 +1775,31 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		struct es2_cport_out *cport_out = &es2->cport_out[bulk_out];
+
+		INIT_LIST_HEAD(&cport_out->agg_queue);
+		for (i = 0; i < NUM_CPORT_OUT_AGG_URB; ++i) {
+			cport_out->agg_urb[i].es2 = es2;
+			cport_out->agg_urb[i].cport_out = cport_out;
+			INIT_LIST_HEAD(&cport_out->agg_urb[i].messages);
+		}
+	}
+
+	if (aggregation)
+		es2->agg_size = apb_aggregation_negotiate(udev, true);
+	if (es2->agg_size && es2->agg_size < ES2_AGG_SIZE_MIN) {
+		dev_warn(&udev->dev,
+			 "aggregated transfers too small (%zu < %zu), disabling\n",
+			 es2->agg_size, ES2_AGG_SIZE_MIN);
+		es2->agg_size = apb_aggregation_negotiate(udev, false);
+	}
+	if (es2->agg_size)
+		dev_dbg(&udev->dev, "aggregating bulk transfers of up to %zu bytes\n",
+			es2->agg_size);
+
 	/* Allocate buffers for our cport in messages */
+	in_buffer_size = es2->agg_size ? es2->agg_size : ES2_GBUF_MSG_SIZE_MAX;
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
 
@@ -1024,14 +1810,14 @@ static int ap_probe(struct usb_interface *interface,
 			urb = usb_alloc_urb(0, GFP_KERNEL);
 			if (!urb)
 				goto error;
-			buffer = kmalloc(ES2_GBUF_MSG_SIZE_MAX, GFP_KERNEL);
+			buffer = kmalloc(in_buffer_size, GFP_KERNEL);
 			if (!buffer)
 				goto error;
 
 			usb_fill_bulk_urb(urb, udev,
 					  usb_rcvbulkpipe(udev,
 							  cport_in->endpoint),
-					  buffer, ES2_GBUF_MSG_SIZE_MAX,
+					  buffer, in_buffer_size,
 					  cport_in_callback, hd);
 			cport_in->urb[i] = urb;
 			cport_in->buffer[i] = buffer;
@@ -1039,7 +1825,7 @@ static int ap_probe(struct usb_interface *interface,
 	}
 
 	/* Allocate urbs for our CPort OUT messages */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
+	for (i = 0; i < NUM_CPORT_OUT_URB && !es2->agg_size; ++i) {
 		struct urb *urb;
 
 		urb = usb_alloc_urb(0, GFP_KERNEL);
@@ -1050,6 +1836,59 @@ static int ap_probe(struct usb_interface *interface,
 		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
 	}
 
+	/* Allocate urbs and buffers for aggregated CPort OUT transfers */
+	for (bulk_out = 0; bulk_out < NUM_BULKS && es2->agg_size; bulk_out++) {
+		struct es2_cport_out *cport_out = &es2->cport_out[bulk_out];
+
+		for (i = 0; i < NUM_CPORT_OUT_AGG_URB; ++i) {
+			struct es2_agg_urb *agg = &cport_out->agg_urb[i];
+			struct urb *urb;
+			u8 *buffer;
+
+			urb = usb_alloc_urb(0, GFP_KERNEL);
+			if (!urb)
+				goto error;
+			buffer = usb_alloc_coherent(udev, es2->agg_size,
+						    GFP_KERNEL,
+						    &urb->transfer_dma);
+			if (!buffer) {
+				usb_free_urb(urb);
+				goto error;
+			}
+
+			usb_fill_bulk_urb(urb, udev,
+					  usb_sndbulkpipe(udev,
+							  cport_out->endpoint),
+					  buffer, es2->agg_size,
+					  cport_out_agg_callback, agg);
+			urb->transfer_flags |= URB_ZERO_PACKET |
+					       URB_NO_TRANSFER_DMA_MAP;
+			agg->urb = urb;
+			agg->buffer = buffer;
+		}
+	}
+
+	/* Allocate urbs and buffers for asynchronous control requests */
+	for (i = 0; i < NUM_OUTPUT_URB; ++i) {
+		es2->output_urb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!es2->output_urb[i])
+			goto error;
+	}
+
+	for (i = 0; i < NUM_OUTPUT_BUF; ++i) {
+		es2->output_buf[i] = kzalloc(sizeof(*es2->output_buf[i]),
+					     GFP_KERNEL);
+		if (!es2->output_buf[i])
+			goto error;
+		list_add_tail(&es2->output_buf[i]->links, &es2->output_free);
+	}
+
+	/* XXX We will need to rename this per APB */
+	es2->output_stats_dentry = debugfs_create_file("apb_output_stats",
+							S_IRUGO,
+							gb_debugfs_get(), es2,
+							&output_stats_fops);
+
 	/* XXX We will need to rename this per APB */
 	es2->apb_log_enable_dentry = debugfs_create_file("apb_log_enable",
 							(S_IWUSR | S_IRUGO),
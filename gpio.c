@@ -18,12 +18,18 @@
 #include "greybus.h"
 #include "gpbridge.h"
 
+static bool cache_values;
+module_param(cache_values, bool, 0644);
+MODULE_PARM_DESC(cache_values,
+		 "serve input values of lines with both-edge irqs from events");
+
 struct gb_gpio_line {
 	/* The following has to be an array of line_max entries */
 	/* --> make them just a flags field */
 	u8			active:    1,
-				direction: 1,	/* 0 = output, 1 = input */
-				value:     1;	/* 0 = low, 1 = high */
+				direction: 1;	/* 0 = output, 1 = input */
+	u8			value;		/* 0 = low, 1 = high */
+	bool			value_valid;	/* value may be cached */
 	u16			debounce_usec;
 
 	u8			irq_type;
@@ -45,11 +51,92 @@ struct gb_gpio_controller {
 	irq_flow_handler_t	irq_handler;
 	unsigned int		irq_default_type;
 	struct mutex		irq_lock;
+
+	bool			values_supported;	/* multi-line ops */
+
+	spinlock_t		value_lock;	/* serialises cache updates */
+	unsigned int		value_gen;	/* bumped by events */
 };
 #define gpio_chip_to_gb_gpio_controller(chip) \
 	container_of(chip, struct gb_gpio_controller, chip)
 #define irq_data_to_gpio_chip(d) (d->domain->host_data)
 
+/*
+ * With cache_values set, the value of an input line whose irq fires on both
+ * edges and is unmasked is kept up to date by irq events, and served without
+ * asking the module. Single-edge irqs would not report the other edge and are
+ * therefore never cached. Events without a value just drop the cached one.
+ *
+ * Every event, and anything else that drops cached values, bumps value_gen.
+ * A value fetched from the module is only cached if value_gen did not change
+ * since the fetch started, so that a response overtaken by an event does not
+ * replace the newer value.
+ */
+static bool gb_gpio_value_cached(struct gb_gpio_line *line)
+{
+	if (!cache_values || line->direction != 1 || line->masked ||
+	    line->irq_type != GB_GPIO_IRQ_TYPE_EDGE_BOTH || !line->value_valid)
+		return false;
+
+	smp_rmb();	/* pairs with gb_gpio_value_store() */
+
+	return true;
+}
+
+static void gb_gpio_value_store(struct gb_gpio_line *line, u8 value)
+{
+	line->value = value;
+	smp_wmb();
+	line->value_valid = true;
+}
+
+static void gb_gpio_value_event(struct gb_gpio_controller *ggc,
+				struct gb_gpio_line *line, u8 value)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ggc->value_lock, flags);
+	ggc->value_gen++;
+	gb_gpio_value_store(line, value);
+	spin_unlock_irqrestore(&ggc->value_lock, flags);
+}
+
+static void gb_gpio_value_invalidate(struct gb_gpio_controller *ggc,
+				     struct gb_gpio_line *line)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ggc->value_lock, flags);
+	ggc->value_gen++;
+	line->value_valid = false;
+	spin_unlock_irqrestore(&ggc->value_lock, flags);
+}
+
+/* Take a snapshot of value_gen before fetching values from the module */
+static unsigned int gb_gpio_value_gen(struct gb_gpio_controller *ggc)
+{
+	unsigned long flags;
+	unsigned int gen;
+
+	spin_lock_irqsave(&ggc->value_lock, flags);
+	gen = ggc->value_gen;
+	spin_unlock_irqrestore(&ggc->value_lock, flags);
+
+	return gen;
+}
+
+static void gb_gpio_value_fetched(struct gb_gpio_controller *ggc,
+				  struct gb_gpio_line *line, unsigned int gen,
+				  u8 value)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ggc->value_lock, flags);
+	if (ggc->value_gen == gen)
+		gb_gpio_value_store(line, value);
+	spin_unlock_irqrestore(&ggc->value_lock, flags);
+}
+
 static int gb_gpio_line_count_operation(struct gb_gpio_controller *ggc)
 {
 	struct gb_gpio_line_count_response response;
@@ -127,8 +214,10 @@ static int gb_gpio_direction_in_operation(struct gb_gpio_controller *ggc,
 	request.which = which;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_IN,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 1;
+		gb_gpio_value_invalidate(ggc, &ggc->lines[which]);
+	}
 	return ret;
 }
 
@@ -142,20 +231,26 @@ static int gb_gpio_direction_out_operation(struct gb_gpio_controller *ggc,
 	request.value = value_high ? 1 : 0;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_DIRECTION_OUT,
 				&request, sizeof(request), NULL, 0);
-	if (!ret)
+	if (!ret) {
 		ggc->lines[which].direction = 0;
+		gb_gpio_value_invalidate(ggc, &ggc->lines[which]);
+	}
 	return ret;
 }
 
+/* Returns the value of the line, or a negative errno */
 static int gb_gpio_get_value_operation(struct gb_gpio_controller *ggc,
 					u8 which)
 {
 	struct device *dev = &ggc->connection->bundle->dev;
 	struct gb_gpio_get_value_request request;
 	struct gb_gpio_get_value_response response;
+	unsigned int gen;
 	int ret;
 	u8 value;
 
+	gen = gb_gpio_value_gen(ggc);
+
 	request.which = which;
 	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_VALUE,
 				&request, sizeof(request),
@@ -170,8 +265,9 @@ static int gb_gpio_get_value_operation(struct gb_gpio_controller *ggc,
 		dev_warn(dev, "gpio %u value was %u (should be 0 or 1)\n",
 			 which, value);
 	}
-	ggc->lines[which].value = value ? 1 : 0;
-	return 0;
+	value = value ? 1 : 0;
+	gb_gpio_value_fetched(ggc, &ggc->lines[which], gen, value);
+	return value;
 }
 
 static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
@@ -199,6 +295,108 @@ static void gb_gpio_set_value_operation(struct gb_gpio_controller *ggc,
 	ggc->lines[which].value = request.value;
 }
 
+#if defined(GPIO_HAVE_GET_MULTIPLE) || defined(GPIO_HAVE_SET_MULTIPLE)
+static bool gb_gpio_bitmap_test(const u8 *bitmap, unsigned int which)
+{
+	return bitmap[which / 8] & BIT(which % 8);
+}
+
+static void gb_gpio_bitmap_set(u8 *bitmap, unsigned int which)
+{
+	bitmap[which / 8] |= BIT(which % 8);
+}
+
+#endif
+
+#ifdef GPIO_HAVE_GET_MULTIPLE
+static int gb_gpio_get_values_operation(struct gb_gpio_controller *ggc,
+					unsigned long *mask,
+					unsigned long *bits)
+{
+	struct device *dev = &ggc->connection->bundle->dev;
+	struct gb_gpio_get_values_request request = { {0} };
+	struct gb_gpio_get_values_response response;
+	unsigned int which;
+	unsigned int gen;
+	int ret;
+
+	for_each_set_bit(which, mask, ggc->line_max + 1)
+		gb_gpio_bitmap_set(request.mask, which);
+
+	gen = gb_gpio_value_gen(ggc);
+
+	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_GET_VALUES,
+				&request, sizeof(request),
+				&response, sizeof(response));
+	if (ret) {
+		dev_err(dev, "failed to get gpio values: %d\n", ret);
+		return ret;
+	}
+
+	for_each_set_bit(which, mask, ggc->line_max + 1) {
+		if (gb_gpio_bitmap_test(response.values, which)) {
+			gb_gpio_value_fetched(ggc, &ggc->lines[which], gen, 1);
+			__set_bit(which, bits);
+		} else {
+			gb_gpio_value_fetched(ggc, &ggc->lines[which], gen, 0);
+			__clear_bit(which, bits);
+		}
+	}
+
+	return 0;
+}
+
+#endif
+
+#ifdef GPIO_HAVE_SET_MULTIPLE
+static void gb_gpio_set_values_operation(struct gb_gpio_controller *ggc,
+					 unsigned long *mask,
+					 unsigned long *bits)
+{
+	struct device *dev = &ggc->connection->bundle->dev;
+	struct gb_gpio_set_values_request request = { {0} };
+	unsigned int which;
+	int ret;
+
+	for_each_set_bit(which, mask, ggc->line_max + 1) {
+		if (ggc->lines[which].direction == 1) {
+			dev_warn(dev, "refusing to set value of input gpio %u\n",
+				 which);
+			continue;
+		}
+		gb_gpio_bitmap_set(request.mask, which);
+		if (test_bit(which, bits))
+			gb_gpio_bitmap_set(request.values, which);
+	}
+
+	ret = gb_operation_sync(ggc->connection, GB_GPIO_TYPE_SET_VALUES,
+				&request, sizeof(request), NULL, 0);
+	if (ret) {
+		dev_err(dev, "failed to set gpio values: %d\n", ret);
+		return;
+	}
+
+	for_each_set_bit(which, mask, ggc->line_max + 1) {
+		if (gb_gpio_bitmap_test(request.mask, which))
+			ggc->lines[which].value =
+				gb_gpio_bitmap_test(request.values, which);
+	}
+}
+
+#endif
+
+/*
+ * Modules implement the multi-line value operations from version 0.2 of the
+ * protocol on. With older ones, lines are read and written one at a time.
+ */
+static bool gb_gpio_values_supported(struct gb_connection *connection)
+{
+	if (connection->module_major > GB_GPIO_VERSION_MAJOR)
+		return true;
+
+	return connection->module_minor >= GB_GPIO_VALUES_MINOR;
+}
+
 static int gb_gpio_set_debounce_operation(struct gb_gpio_controller *ggc,
 					u8 which, u16 debounce_usec)
 {
@@ -277,6 +475,7 @@ static void gb_gpio_irq_unmask(struct irq_data *d)
 
 	line->masked = false;
 	line->masked_pending = true;
+	gb_gpio_value_invalidate(ggc, line);	/* edges missed while masked */
 }
 
 static int gb_gpio_irq_set_type(struct irq_data *d, unsigned int type)
@@ -313,6 +512,7 @@ static int gb_gpio_irq_set_type(struct irq_data *d, unsigned int type)
 
 	line->irq_type = irq_type;
 	line->irq_type_pending = true;
+	gb_gpio_value_invalidate(ggc, line);
 
 	return 0;
 }
@@ -354,6 +554,7 @@ static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
 	struct gb_gpio_controller *ggc = gb_connection_get_data(connection);
 	struct gb_message *request;
 	struct gb_gpio_irq_event_request *event;
+	struct gb_gpio_line *line;
 	int irq;
 	struct irq_desc *desc;
 
@@ -364,9 +565,9 @@ static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
 
 	request = op->request;
 
-	if (request->payload_size < sizeof(*event)) {
+	if (request->payload_size < sizeof(event->which)) {
 		dev_err(dev, "short event received (%zu < %zu)\n",
-			request->payload_size, sizeof(*event));
+			request->payload_size, sizeof(event->which));
 		return -EINVAL;
 	}
 
@@ -376,6 +577,12 @@ static int gb_gpio_request_recv(u8 type, struct gb_operation *op)
 		return -EINVAL;
 	}
 
+	line = &ggc->lines[event->which];
+	if (request->payload_size >= sizeof(*event))
+		gb_gpio_value_event(ggc, line, event->value ? 1 : 0);
+	else
+		gb_gpio_value_invalidate(ggc, line);
+
 	irq = irq_find_mapping(ggc->irqdomain, event->which);
 	if (!irq) {
 		dev_err(dev, "failed to find IRQ\n");
@@ -445,14 +652,12 @@ static int gb_gpio_get(struct gpio_chip *chip, unsigned offset)
 {
 	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
 	u8 which;
-	int ret;
 
 	which = (u8)offset;
-	ret = gb_gpio_get_value_operation(ggc, which);
-	if (ret)
-		return ret;
+	if (gb_gpio_value_cached(&ggc->lines[which]))
+		return ggc->lines[which].value;
 
-	return ggc->lines[which].value;
+	return gb_gpio_get_value_operation(ggc, which);
 }
 
 static void gb_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
@@ -462,6 +667,66 @@ static void gb_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
 	gb_gpio_set_value_operation(ggc, (u8)offset, !!value);
 }
 
+#ifdef GPIO_HAVE_GET_MULTIPLE
+static int gb_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+				unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	DECLARE_BITMAP(fetch, GB_GPIO_LINES_BITMAP_SIZE * 8);
+	unsigned int which;
+	int ret;
+
+	/* Only ask the module for the lines that are not cached */
+	bitmap_copy(fetch, mask, chip->ngpio);
+	for_each_set_bit(which, mask, chip->ngpio) {
+		if (!gb_gpio_value_cached(&ggc->lines[which]))
+			continue;
+		__clear_bit(which, fetch);
+		if (ggc->lines[which].value)
+			__set_bit(which, bits);
+		else
+			__clear_bit(which, bits);
+	}
+
+	if (bitmap_empty(fetch, chip->ngpio))
+		return 0;
+
+	if (ggc->values_supported)
+		return gb_gpio_get_values_operation(ggc, fetch, bits);
+
+	for_each_set_bit(which, fetch, chip->ngpio) {
+		ret = gb_gpio_get_value_operation(ggc, (u8)which);
+		if (ret < 0)
+			return ret;
+
+		if (ret)
+			__set_bit(which, bits);
+		else
+			__clear_bit(which, bits);
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef GPIO_HAVE_SET_MULTIPLE
+static void gb_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+				 unsigned long *bits)
+{
+	struct gb_gpio_controller *ggc = gpio_chip_to_gb_gpio_controller(chip);
+	unsigned int which;
+
+	if (ggc->values_supported) {
+		gb_gpio_set_values_operation(ggc, mask, bits);
+		return;
+	}
+
+	for_each_set_bit(which, mask, chip->ngpio)
+		gb_gpio_set_value_operation(ggc, (u8)which,
+					    test_bit(which, bits));
+}
+#endif
+
 static int gb_gpio_set_debounce(struct gpio_chip *chip, unsigned offset,
 					unsigned debounce)
 {
@@ -489,6 +754,8 @@ static int gb_gpio_controller_setup(struct gb_gpio_controller *ggc)
 	if (!ggc->lines)
 		return -ENOMEM;
 
+	ggc->values_supported = gb_gpio_values_supported(ggc->connection);
+
 	return ret;
 }
 
@@ -633,6 +900,7 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	if (!ggc)
 		return -ENOMEM;
 	ggc->connection = connection;
+	spin_lock_init(&ggc->value_lock);
 	gb_connection_set_data(connection, ggc);
 
 	ret = gb_gpio_controller_setup(ggc);
@@ -666,6 +934,12 @@ static int gb_gpio_connection_init(struct gb_connection *connection)
 	gpio->direction_output = gb_gpio_direction_output;
 	gpio->get = gb_gpio_get;
 	gpio->set = gb_gpio_set;
+#ifdef GPIO_HAVE_GET_MULTIPLE
+	gpio->get_multiple = gb_gpio_get_multiple;
+#endif
+#ifdef GPIO_HAVE_SET_MULTIPLE
+	gpio->set_multiple = gb_gpio_set_multiple;
+#endif
 	gpio->set_debounce = gb_gpio_set_debounce;
 	gpio->to_irq = gb_gpio_to_irq;
 	gpio->base = -1;		/* Allocate base dynamically */
@@ -717,6 +991,7 @@ static struct gb_protocol gpio_protocol = {
 	.id			= GREYBUS_PROTOCOL_GPIO,
 	.major			= GB_GPIO_VERSION_MAJOR,
 	.minor			= GB_GPIO_VERSION_MINOR,
+	.tx_weight		= GB_CONNECTION_TX_WEIGHT_INTERACTIVE,
 	.connection_init	= gb_gpio_connection_init,
 	.connection_exit	= gb_gpio_connection_exit,
 	.request_recv		= gb_gpio_request_recv,
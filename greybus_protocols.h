@@ -98,6 +98,17 @@ struct gb_operation_msg_hdr {
 	__u8	pad[2];		/* must be zero (ignore when read) */
 } __packed;
 
+/*
+ * On connections that support segmentation, pad[1] of the header carries
+ * segmentation flags. A message larger than the host device can carry is sent
+ * as a sequence of segments, each with a complete header with the size of the
+ * segment, and all but the last one flagged with GB_OPERATION_SEGMENT_MORE.
+ *
+ * An interface accepting GB_CONTROL_TYPE_SEGMENTATION supports segmentation
+ * on all of its connections; pad[1] must be zero on any other connection.
+ */
+#define GB_OPERATION_SEGMENT_MORE		0x01
+
 
 /* Generic request numbers supported by all modules */
 #define GB_REQUEST_TYPE_INVALID			0x00
@@ -127,6 +138,7 @@ struct gb_protocol_version_response {
 #define GB_CONTROL_TYPE_TIMESYNC_AUTHORITATIVE	0x09
 #define GB_CONTROL_TYPE_INTERFACE_VERSION	0x0a
 #define GB_CONTROL_TYPE_BUNDLE_VERSION		0x0b
+#define GB_CONTROL_TYPE_SEGMENTATION		0x0c
 
 struct gb_control_version_request {
 	__u8	major;
@@ -216,6 +228,27 @@ struct gb_control_timesync_authoritative_request {
 #define GB_APB_REQUEST_CPORT_FEAT_EN	0x0b
 #define GB_APB_REQUEST_CPORT_FEAT_DIS	0x0c
 
+/*
+ * request to negotiate multi-message aggregation of bulk transfers, only
+ * sent to bridge firmware the user has enabled aggregation for: wValue is the
+ * largest transfer size the host handles (zero to disable), and the bridge
+ * answers with the __le16 size it agrees to.
+ */
+#define GB_APB_REQUEST_AGGREGATION	0x0d
+
+/*
+ * Aggregated bulk transfers start with this header, followed by @count
+ * Greybus messages.  Each message carries its CPort id in the header pad
+ * bytes and starts on a GB_APB_AGGREGATION_ALIGN boundary.
+ */
+#define GB_APB_AGGREGATION_ALIGN	4
+
+struct gb_apb_aggregation_hdr {
+	__le16	size;		/* transfer size, including this header */
+	__u8	count;		/* number of messages in the transfer */
+	__u8	pad;
+} __packed;
+
 /* Firmware Protocol */
 
 /* Version of the Greybus firmware protocol we support */
@@ -548,7 +581,10 @@ struct gb_i2c_transfer_response {
 
 /* Version of the Greybus GPIO protocol we support */
 #define GB_GPIO_VERSION_MAJOR		0x00
-#define GB_GPIO_VERSION_MINOR		0x01
+#define GB_GPIO_VERSION_MINOR		0x02
+
+/* GET_VALUES and SET_VALUES are understood by modules implementing 0.2 */
+#define GB_GPIO_VALUES_MINOR		0x02
 
 /* Greybus GPIO request types */
 #define GB_GPIO_TYPE_LINE_COUNT		0x02
@@ -564,6 +600,8 @@ struct gb_i2c_transfer_response {
 #define GB_GPIO_TYPE_IRQ_MASK		0x0c
 #define GB_GPIO_TYPE_IRQ_UNMASK		0x0d
 #define GB_GPIO_TYPE_IRQ_EVENT		0x0e
+#define GB_GPIO_TYPE_GET_VALUES		0x0f
+#define GB_GPIO_TYPE_SET_VALUES		0x10
 
 #define GB_GPIO_IRQ_TYPE_NONE		0x00
 #define GB_GPIO_IRQ_TYPE_EDGE_RISING	0x01
@@ -618,6 +656,25 @@ struct gb_gpio_set_value_request {
 } __packed;
 /* set value response has no payload */
 
+/*
+ * Line bitmaps of the multi-line value operations: line n is bit (n % 8) of
+ * byte (n / 8). Lines not set in mask are left alone, and read back as 0.
+ */
+#define GB_GPIO_LINES_BITMAP_SIZE	32
+
+struct gb_gpio_get_values_request {
+	__u8	mask[GB_GPIO_LINES_BITMAP_SIZE];
+} __packed;
+struct gb_gpio_get_values_response {
+	__u8	values[GB_GPIO_LINES_BITMAP_SIZE];
+} __packed;
+
+struct gb_gpio_set_values_request {
+	__u8	mask[GB_GPIO_LINES_BITMAP_SIZE];
+	__u8	values[GB_GPIO_LINES_BITMAP_SIZE];
+} __packed;
+/* set values response has no payload */
+
 struct gb_gpio_set_debounce_request {
 	__u8	which;
 	__le16	usec;
@@ -640,9 +697,14 @@ struct gb_gpio_irq_unmask_request {
 } __packed;
 /* irq unmask response has no payload */
 
-/* irq event requests originate on another module and are handled on the AP */
+/*
+ * irq event requests originate on another module and are handled on the AP.
+ * Firmware may append the value of the line after the event; older firmware
+ * only sends which.
+ */
 struct gb_gpio_irq_event_request {
 	__u8	which;
+	__u8	value;
 } __packed;
 /* irq event has no response */
 
@@ -698,7 +760,10 @@ struct gb_pwm_disable_request {
 
 /* Version of the Greybus spi protocol we support */
 #define GB_SPI_VERSION_MAJOR		0x00
-#define GB_SPI_VERSION_MINOR		0x01
+#define GB_SPI_VERSION_MINOR		0x02
+
+/* GB_SPI_XFER_INPROGRESS is understood by modules implementing 0.2 and up */
+#define GB_SPI_INPROGRESS_MINOR		0x02
 
 /* Should match up with modes in linux/spi/spi.h */
 #define GB_SPI_MODE_CPHA		0x01		/* clock phase */
@@ -760,6 +825,10 @@ struct gb_spi_device_config_response {
  * @cs_change: affects chipselect after this transfer completes
  * @bits_per_word: select a bits_per_word other than the device default for this
  *	transfer. If 0 the default (from @spi_device) is used.
+ * @rdwr: direction of the transfer. GB_SPI_XFER_INPROGRESS is set on the last
+ *	transfer of an operation when the spi_message continues in the next
+ *	operation, in which case the chipselect must be kept asserted. Only
+ *	used with modules implementing version 0.2 or later.
  */
 struct gb_spi_transfer {
 	__le32		speed_hz;
@@ -770,6 +839,7 @@ struct gb_spi_transfer {
 	__u8		rdwr;
 #define GB_SPI_XFER_READ	0x01
 #define GB_SPI_XFER_WRITE	0x02
+#define GB_SPI_XFER_INPROGRESS	0x04
 } __packed;
 
 struct gb_spi_transfer_request {
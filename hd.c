@@ -24,6 +24,169 @@ int gb_hd_output(struct gb_host_device *hd, void *req, u16 size, u8 cmd,
 }
 EXPORT_SYMBOL_GPL(gb_hd_output);
 
+/*
+ * Hand queued messages to the host driver for as long as the transmit window
+ * allows, using deficit round robin across connections so that a connection
+ * flooding the host device cannot starve the others. A connection may send
+ * up to tx_weight * GB_CONNECTION_TX_QUANTUM bytes per round.
+ *
+ * Only one context dispatches at a time, which keeps the messages of each
+ * connection in order. Anyone finding a dispatch in progress leaves their
+ * messages for it to pick up.
+ */
+static void gb_hd_tx_dispatch(struct gb_host_device *hd, gfp_t gfp_mask)
+{
+	struct gb_connection *connection;
+	struct gb_operation *operation;
+	struct gb_message *message;
+	unsigned long flags;
+	size_t size;
+	int ret;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	if (hd->tx_dispatching) {
+		spin_unlock_irqrestore(&hd->tx_lock, flags);
+		return;
+	}
+	hd->tx_dispatching = true;
+
+	while (hd->tx_inflight < hd->tx_window &&
+			!list_empty(&hd->tx_active)) {
+		connection = list_first_entry(&hd->tx_active,
+					      struct gb_connection, tx_links);
+		message = list_first_entry(&connection->tx_queue,
+					   struct gb_message, tx_links);
+
+		size = sizeof(*message->header) + message->payload_size;
+		if (size > connection->tx_deficit) {
+			/* Out of credit for this round, move to the back. */
+			connection->tx_deficit += connection->tx_weight *
+						  GB_CONNECTION_TX_QUANTUM;
+			list_move_tail(&connection->tx_links, &hd->tx_active);
+			continue;
+		}
+		connection->tx_deficit -= size;
+
+		list_del_init(&message->tx_links);
+		if (list_empty(&connection->tx_queue)) {
+			list_del_init(&connection->tx_links);
+			connection->tx_deficit = 0;
+		}
+		hd->tx_inflight++;
+
+		/*
+		 * Keep the operation around should it be cancelled meanwhile,
+		 * and have cancellation wait until the driver owns the
+		 * message.
+		 */
+		operation = message->operation;
+		gb_operation_get(operation);
+		hd->tx_handover = message;
+		spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+		ret = hd->driver->message_send(hd, connection->hd_cport_id,
+					       message, gfp_mask);
+		if (ret)
+			greybus_message_sent(hd, message, ret);
+
+		spin_lock_irqsave(&hd->tx_lock, flags);
+		hd->tx_handover = NULL;
+		spin_unlock_irqrestore(&hd->tx_lock, flags);
+		wake_up_all(&hd->tx_handover_wq);
+
+		gb_operation_put(operation);
+
+		spin_lock_irqsave(&hd->tx_lock, flags);
+	}
+
+	hd->tx_dispatching = false;
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+}
+
+/*
+ * Queue a message for transmission. The message is handed to the host driver
+ * once the transmit scheduler gets to it, and completion (including failure
+ * to send) is always reported through greybus_message_sent().
+ */
+void gb_hd_message_send(struct gb_connection *connection,
+			struct gb_message *message, gfp_t gfp_mask)
+{
+	struct gb_host_device *hd = connection->hd;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	if (list_empty(&connection->tx_queue)) {
+		/* Newly active connections get a full quantum right away. */
+		connection->tx_deficit = connection->tx_weight *
+					 GB_CONNECTION_TX_QUANTUM;
+		list_add_tail(&connection->tx_links, &hd->tx_active);
+	}
+	list_add_tail(&message->tx_links, &connection->tx_queue);
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	gb_hd_tx_dispatch(hd, gfp_mask);
+}
+
+static bool gb_hd_message_handover(struct gb_host_device *hd,
+				   struct gb_message *message)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	ret = hd->tx_handover == message;
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	return ret;
+}
+
+/*
+ * Remove a message that has not yet been handed to the host driver from its
+ * connection queue. Returns true if the message was dequeued.
+ *
+ * A message that is being handed to the driver is waited for, so that the
+ * driver can cancel it once this returns false. Can not be called in atomic
+ * context.
+ */
+bool gb_hd_message_dequeue(struct gb_connection *connection,
+			   struct gb_message *message)
+{
+	struct gb_host_device *hd = connection->hd;
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	while (hd->tx_handover == message) {
+		spin_unlock_irqrestore(&hd->tx_lock, flags);
+		wait_event(hd->tx_handover_wq,
+			   !gb_hd_message_handover(hd, message));
+		spin_lock_irqsave(&hd->tx_lock, flags);
+	}
+	queued = !list_empty(&message->tx_links);
+	if (queued) {
+		list_del_init(&message->tx_links);
+		if (list_empty(&connection->tx_queue)) {
+			list_del_init(&connection->tx_links);
+			connection->tx_deficit = 0;
+		}
+	}
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	return queued;
+}
+
+/* Called when the host driver is done with a message handed to it. */
+void gb_hd_message_sent(struct gb_host_device *hd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&hd->tx_lock, flags);
+	hd->tx_inflight--;
+	spin_unlock_irqrestore(&hd->tx_lock, flags);
+
+	gb_hd_tx_dispatch(hd, GFP_ATOMIC);
+}
+
 static void gb_hd_release(struct device *dev)
 {
 	struct gb_host_device *hd = to_gb_host_device(dev);
@@ -57,6 +220,11 @@ struct gb_host_device *gb_hd_create(struct gb_hd_driver *driver,
 		return ERR_PTR(-EINVAL);
 	}
 
+	if (!driver->message_buffer_alloc != !driver->message_buffer_free) {
+		dev_err(parent, "message-buffer hd-callbacks must come in pairs\n");
+		return ERR_PTR(-EINVAL);
+	}
+
 	if (buffer_size_max < GB_OPERATION_MESSAGE_SIZE_MIN) {
 		dev_err(parent, "greybus host-device buffers too small\n");
 		return ERR_PTR(-EINVAL);
@@ -92,6 +260,10 @@ struct gb_host_device *gb_hd_create(struct gb_hd_driver *driver,
 	INIT_LIST_HEAD(&hd->interfaces);
 	INIT_LIST_HEAD(&hd->connections);
 	ida_init(&hd->cport_id_map);
+	spin_lock_init(&hd->tx_lock);
+	INIT_LIST_HEAD(&hd->tx_active);
+	init_waitqueue_head(&hd->tx_handover_wq);
+	hd->tx_window = GB_HD_TX_WINDOW_DEFAULT;
 	hd->buffer_size_max = buffer_size_max;
 	hd->num_cports = num_cports;
 
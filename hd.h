@@ -11,8 +11,16 @@
 #define __HD_H
 
 struct gb_host_device;
+struct gb_connection;
 struct gb_message;
 
+/*
+ * Default number of messages the host driver is given to send at any one
+ * time. Messages beyond that are queued per connection and handed to the
+ * driver in deficit-round-robin order.
+ */
+#define GB_HD_TX_WINDOW_DEFAULT		16
+
 struct gb_hd_driver {
 	size_t	hd_priv_size;
 
@@ -27,6 +35,11 @@ struct gb_hd_driver {
 		      bool async);
 	int (*cport_features_enable)(struct gb_host_device *hd, u16 cport_id);
 	int (*cport_features_disable)(struct gb_host_device *hd, u16 cport_id);
+	int (*message_buffer_alloc)(struct gb_host_device *hd,
+				    struct gb_message *message, size_t size,
+				    gfp_t gfp_mask);
+	void (*message_buffer_free)(struct gb_host_device *hd,
+				    struct gb_message *message);
 };
 
 struct gb_host_device {
@@ -44,6 +57,15 @@ struct gb_host_device {
 	/* Host device buffer constraints */
 	size_t buffer_size_max;
 
+	/* Outgoing message scheduling */
+	spinlock_t tx_lock;
+	struct list_head tx_active;	/* connections with queued messages */
+	unsigned int tx_window;
+	unsigned int tx_inflight;
+	bool tx_dispatching;
+	struct gb_message *tx_handover;	/* being passed to the driver */
+	wait_queue_head_t tx_handover_wq;
+
 	struct gb_svc *svc;
 	/* Private data for the host driver */
 	unsigned long hd_priv[0] __aligned(sizeof(s64));
@@ -60,6 +82,12 @@ void gb_hd_put(struct gb_host_device *hd);
 int gb_hd_output(struct gb_host_device *hd, void *req, u16 size, u8 cmd,
 		 bool in_irq);
 
+void gb_hd_message_send(struct gb_connection *connection,
+			struct gb_message *message, gfp_t gfp_mask);
+bool gb_hd_message_dequeue(struct gb_connection *connection,
+			   struct gb_message *message);
+void gb_hd_message_sent(struct gb_host_device *hd);
+
 int gb_hd_init(void);
 void gb_hd_exit(void);
 
@@ -452,6 +452,12 @@ static int gb_hid_probe(struct gb_bundle *bundle,
 	gb_connection_set_data(connection, ghid);
 	ghid->connection = connection;
 
+	/* Keep report requests from queueing behind bulk traffic. */
+	ret = gb_connection_set_tx_weight(connection,
+					  GB_CONNECTION_TX_WEIGHT_INTERACTIVE);
+	if (ret)
+		goto err_connection_destroy;
+
 	hid = hid_allocate_device();
 	if (IS_ERR(hid)) {
 		ret = PTR_ERR(hid);
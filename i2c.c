@@ -15,11 +15,24 @@
 #include "greybus.h"
 #include "gpbridge.h"
 
+/* Number of transfer operations a transfer keeps in flight */
+#define GB_I2C_OPS_IN_FLIGHT	4
+
+/* Data of an operation carrying part of a transfer, from msgs[index] on */
+struct gb_i2c_chunk {
+	u32			index;
+	u16			offset;
+	bool			writes;
+	bool			reads_on;	/* continues a split read */
+};
+
 struct gb_i2c_device {
 	struct gb_connection	*connection;
 
 	u32			functionality;
 
+	struct gb_operation_window window;
+
 	struct i2c_adapter	adapter;
 };
 
@@ -67,90 +80,169 @@ gb_i2c_fill_transfer_op(struct gb_i2c_transfer_op *op, struct i2c_msg *msg)
 	op->size = cpu_to_le16(msg->len);
 }
 
+/*
+ * Build the operation carrying the part of msgs that starts at message
+ * *index, offset *offset, and move the cursor past it.
+ *
+ * As many messages as fit are packed into one operation, so that they are
+ * still separated by repeated starts. Operations are separate transactions
+ * on the bus, so a transfer is only split between two messages where the
+ * caller asked for a stop anyway, with I2C_M_STOP.
+ *
+ * A read that does not fit is split, the operations after the first one
+ * reading on from where the previous one stopped, as is done for EEPROMs and
+ * FIFOs. Such a read is only correct for devices that carry on across a stop
+ * and a new start. A write cannot be split without changing its meaning and
+ * must fit an operation whole.
+ */
 static struct gb_operation *
-gb_i2c_operation_create(struct gb_connection *connection,
-			struct i2c_msg *msgs, u32 msg_count)
+gb_i2c_chunk_create(struct gb_i2c_device *gb_i2c_dev, struct i2c_msg *msgs,
+		    u32 msg_count, u32 *index, u16 *offset)
 {
+	struct gb_connection *connection = gb_i2c_dev->connection;
 	struct gb_i2c_transfer_request *request;
 	struct gb_operation *operation;
+	struct gb_i2c_chunk *chunk;
 	struct gb_i2c_transfer_op *op;
 	struct i2c_msg *msg;
-	u32 data_out_size = 0;
-	u32 data_in_size = 0;
-	size_t request_size;
+	size_t request_size = sizeof(*request);
+	size_t data_in_size = 0;
+	size_t data_max;
+	u32 end_index = *index;
+	u16 end_offset = *offset;
+	u16 op_count = 0;
+	bool writes = false;
+	u16 left, len;
 	void *data;
-	u16 op_count;
 	u32 i;
 
-	if (msg_count > (u32)U16_MAX) {
-		dev_err(&connection->bundle->dev, "msg_count (%u) too big\n",
+	data_max = gb_operation_get_payload_size_max(connection);
+
+	/* Find how much, from the cursor on, fits */
+	while (end_index < msg_count) {
+		msg = &msgs[end_index];
+		left = msg->len - end_offset;
+
+		if (request_size + sizeof(*op) > data_max)
+			break;
+
+		if (msg->flags & I2C_M_RD) {
+			len = min_t(size_t, left, data_max - data_in_size);
+			if (len < left &&
+			    (!len || (msg->flags & I2C_M_RECV_LEN)))
+				break;
+			data_in_size += len;
+			request_size += sizeof(*op);
+		} else {
+			if (request_size + sizeof(*op) + left > data_max)
+				break;
+			len = left;
+			request_size += sizeof(*op) + len;
+			writes = true;
+		}
+		op_count++;
+
+		if (len < left) {
+			end_offset += len;
+			break;
+		}
+		end_index++;
+		end_offset = 0;
+	}
+
+	if (!op_count) {
+		dev_err(&connection->bundle->dev,
+			"message of %u bytes does not fit an operation\n",
+			msgs[end_index].len);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	if (end_index < msg_count && !end_offset &&
+	    !(msgs[end_index - 1].flags & I2C_M_STOP)) {
+		dev_err(&connection->bundle->dev,
+			"transfer of %u messages does not fit an operation\n",
 			msg_count);
-		return NULL;
+		return ERR_PTR(-EOPNOTSUPP);
 	}
-	op_count = (u16)msg_count;
-
-	/*
-	 * In addition to space for all message descriptors we need
-	 * to have enough to hold all outbound message data.
-	 */
-	msg = msgs;
-	for (i = 0; i < msg_count; i++, msg++)
-		if (msg->flags & I2C_M_RD)
-			data_in_size += (u32)msg->len;
-		else
-			data_out_size += (u32)msg->len;
-
-	request_size = sizeof(*request);
-	request_size += msg_count * sizeof(*op);
-	request_size += data_out_size;
+
+	chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return ERR_PTR(-ENOMEM);
 
 	/* Response consists only of incoming data */
 	operation = gb_operation_create(connection, GB_I2C_TYPE_TRANSFER,
 				request_size, data_in_size, GFP_KERNEL);
-	if (!operation)
-		return NULL;
+	if (!operation) {
+		kfree(chunk);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	request = operation->request->payload;
 	request->op_count = cpu_to_le16(op_count);
-	/* Fill in the ops array */
-	op = &request->ops[0];
-	msg = msgs;
-	for (i = 0; i < msg_count; i++)
-		gb_i2c_fill_transfer_op(op++, msg++);
 
-	if (!data_out_size)
-		return operation;
+	/* Fill in the ops array, outgoing data starts after the last op */
+	op = &request->ops[0];
+	data = op + op_count;
+	msg = &msgs[*index];
+	len = msg->len - *offset;
+	for (i = 0; i < op_count; i++, op++, msg++) {
+		if (i)
+			len = msg->len;
+		if (msg == &msgs[end_index])
+			len = end_offset - (i ? 0 : *offset);
+
+		gb_i2c_fill_transfer_op(op, msg);
+		op->size = cpu_to_le16(len);
 
-	/* Copy over the outgoing data; it starts after the last op */
-	data = op;
-	msg = msgs;
-	for (i = 0; i < msg_count; i++) {
 		if (!(msg->flags & I2C_M_RD)) {
-			memcpy(data, msg->buf, msg->len);
-			data += msg->len;
+			memcpy(data, msg->buf, len);
+			data += len;
 		}
-		msg++;
 	}
 
+	chunk->index = *index;
+	chunk->offset = *offset;
+	chunk->writes = writes;
+	chunk->reads_on = *offset != 0;
+	gb_operation_set_data(operation, chunk);
+
+	*index = end_index;
+	*offset = end_offset;
+
 	return operation;
 }
 
-static void gb_i2c_decode_response(struct i2c_msg *msgs, u32 msg_count,
-				struct gb_i2c_transfer_response *response)
+static void gb_i2c_chunk_put(struct gb_operation *operation)
 {
-	struct i2c_msg *msg = msgs;
+	kfree(gb_operation_get_data(operation));
+	gb_operation_put(operation);
+}
+
+static void gb_i2c_decode_response(struct i2c_msg *msgs,
+				   struct gb_operation *operation)
+{
+	struct gb_i2c_chunk *chunk = gb_operation_get_data(operation);
+	struct gb_i2c_transfer_request *request;
+	struct gb_i2c_transfer_op *op;
+	struct i2c_msg *msg = &msgs[chunk->index];
+	u16 offset = chunk->offset;
+	u16 op_count;
 	u8 *data;
-	u32 i;
+	u16 size;
+	u16 i;
+
+	request = operation->request->payload;
+	op_count = le16_to_cpu(request->op_count);
+	op = &request->ops[0];
+	data = operation->response->payload;
 
-	if (!response)
-		return;
-	data = response->data;
-	for (i = 0; i < msg_count; i++) {
+	for (i = 0; i < op_count; i++, op++, msg++) {
+		size = le16_to_cpu(op->size);
 		if (msg->flags & I2C_M_RD) {
-			memcpy(msg->buf, data, msg->len);
-			data += msg->len;
+			memcpy(msg->buf + offset, data, size);
+			data += size;
 		}
-		msg++;
+		offset = 0;
 	}
 }
 
@@ -162,34 +254,86 @@ static bool gb_i2c_expected_transfer_error(int errno)
 	return errno == -EAGAIN || errno == -ENODEV;
 }
 
-static int gb_i2c_transfer_operation(struct gb_i2c_device *gb_i2c_dev,
-					struct i2c_msg *msgs, u32 msg_count)
+static int gb_i2c_chunk_retire(struct gb_i2c_device *gb_i2c_dev,
+			       struct i2c_msg *msgs)
 {
-	struct gb_connection *connection = gb_i2c_dev->connection;
-	struct device *dev = &connection->bundle->dev;
+	struct device *dev = &gb_i2c_dev->connection->bundle->dev;
 	struct gb_operation *operation;
 	int ret;
 
-	operation = gb_i2c_operation_create(connection, msgs, msg_count);
-	if (!operation)
-		return -ENOMEM;
-
-	ret = gb_operation_request_send_sync(operation);
-	if (!ret) {
-		struct gb_i2c_transfer_response *response;
+	operation = gb_operation_window_retire(&gb_i2c_dev->window);
 
-		response = operation->response->payload;
-		gb_i2c_decode_response(msgs, msg_count, response);
-		ret = msg_count;
-	} else if (!gb_i2c_expected_transfer_error(ret)) {
+	ret = gb_operation_result(operation);
+	if (!ret)
+		gb_i2c_decode_response(msgs, operation);
+	else if (!gb_i2c_expected_transfer_error(ret))
 		dev_err(dev, "transfer operation failed (%d)\n", ret);
-	}
 
-	gb_operation_put(operation);
+	gb_i2c_chunk_put(operation);
 
 	return ret;
 }
 
+/*
+ * Transfers that need several operations keep up to GB_I2C_OPS_IN_FLIGHT of
+ * them outstanding. An operation carrying writes, or reading on from where a
+ * split read stopped, is held back until the ones before it have succeeded,
+ * so that a failure never leaves later writes behind it on the bus nor lets
+ * later reads consume data from the device.
+ */
+static int gb_i2c_transfer_operation(struct gb_i2c_device *gb_i2c_dev,
+					struct i2c_msg *msgs, u32 msg_count)
+{
+	struct gb_operation_window *window = &gb_i2c_dev->window;
+	struct gb_operation *operation = NULL;
+	struct gb_i2c_chunk *chunk;
+	u32 index = 0;
+	u16 offset = 0;
+	int ret = 0;
+	int err;
+
+	for (;;) {
+		while (!ret && !gb_operation_window_full(window)) {
+			if (!operation) {
+				if (index == msg_count)
+					break;
+				operation = gb_i2c_chunk_create(gb_i2c_dev,
+						msgs, msg_count, &index,
+						&offset);
+				if (IS_ERR(operation)) {
+					ret = PTR_ERR(operation);
+					operation = NULL;
+					break;
+				}
+			}
+
+			chunk = gb_operation_get_data(operation);
+			if ((chunk->writes || chunk->reads_on) &&
+			    !gb_operation_window_empty(window))
+				break;
+
+			ret = gb_operation_window_send(window, operation,
+						       GFP_KERNEL);
+			if (ret)
+				break;
+			operation = NULL;
+		}
+
+		if (gb_operation_window_empty(window))
+			break;
+
+		err = gb_i2c_chunk_retire(gb_i2c_dev, msgs);
+		if (err && !ret)
+			ret = err;
+	}
+
+	/* Drop an operation held back behind one that failed */
+	if (operation)
+		gb_i2c_chunk_put(operation);
+
+	return ret ? ret : msg_count;
+}
+
 static int gb_i2c_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
 		int msg_count)
 {
@@ -251,6 +395,8 @@ static int gb_i2c_connection_init(struct gb_connection *connection)
 		return -ENOMEM;
 
 	gb_i2c_dev->connection = connection;	/* refcount? */
+	gb_operation_window_init(&gb_i2c_dev->window, GB_I2C_OPS_IN_FLIGHT,
+				 GB_OPERATION_TIMEOUT_DEFAULT, NULL);
 	gb_connection_set_data(connection, gb_i2c_dev);
 
 	ret = gb_i2c_device_setup(gb_i2c_dev);
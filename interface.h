@@ -39,6 +39,9 @@ struct gb_interface {
 	/* The interface needs to boot over unipro */
 	bool boot_over_unipro;
 	bool disconnected;
+
+	/* Segmented messages are supported on all connections */
+	bool segmentation;
 };
 #define to_gb_interface(d) container_of(d, struct gb_interface, dev)
 
@@ -305,6 +305,16 @@ static inline bool led_sysfs_is_disabled(struct led_classdev *led_cdev)
 #define PSY_HAVE_PUT
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+/* gpio chips can set several lines at once */
+#define GPIO_HAVE_SET_MULTIPLE
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+/* and get several lines at once */
+#define GPIO_HAVE_GET_MULTIPLE
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
 #define SPI_DEV_MODALIAS "spidev"
 #define SPI_NOR_MODALIAS "spi-nor"
@@ -129,6 +129,13 @@ static int legacy_connection_create(struct legacy_connection *lc,
 		goto err_protocol_put;
 	}
 
+	if (protocol->tx_weight) {
+		ret = gb_connection_set_tx_weight(connection,
+						  protocol->tx_weight);
+		if (ret)
+			goto err_connection_destroy;
+	}
+
 	/*
 	 * NOTE: We need to keep a pointer to the protocol in the actual
 	 *       connection structure for now.
@@ -140,6 +147,8 @@ static int legacy_connection_create(struct legacy_connection *lc,
 
 	return 0;
 
+err_connection_destroy:
+	gb_connection_destroy(connection);
 err_protocol_put:
 	gb_protocol_put(protocol);
 
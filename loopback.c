@@ -25,14 +25,20 @@
 #include <linux/spinlock.h>
 #include <linux/workqueue.h>
 #include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/crc32c.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
 
 #include <asm/div64.h>
 
 #include "greybus.h"
 #include "connection.h"
 
-#define NSEC_PER_DAY 86400000000000ULL
-
 struct gb_loopback_stats {
 	u32 min;
 	u32 max;
@@ -40,6 +46,22 @@ struct gb_loopback_stats {
 	u32 count;
 };
 
+/*
+ * Log-linear latency histogram: values below GB_LOOPBACK_HIST_SUB_COUNT get
+ * a bucket each, every power of two above that is split into
+ * GB_LOOPBACK_HIST_SUB_COUNT linear buckets, giving a relative error of at
+ * most 1/16. Values are in nanoseconds and the last bucket (roughly half an
+ * hour) absorbs anything larger.
+ */
+#define GB_LOOPBACK_HIST_SUB_BITS	4
+#define GB_LOOPBACK_HIST_SUB_COUNT	(1 << GB_LOOPBACK_HIST_SUB_BITS)
+#define GB_LOOPBACK_HIST_BUCKETS	(GB_LOOPBACK_HIST_SUB_COUNT * 38)
+
+struct gb_loopback_histogram {
+	u32 count;
+	u32 buckets[GB_LOOPBACK_HIST_BUCKETS];
+};
+
 struct gb_loopback_device {
 	struct dentry *root;
 	u32 count;
@@ -48,67 +70,326 @@ struct gb_loopback_device {
 	/* We need to take a lock in atomic context */
 	spinlock_t lock;
 	struct list_head list;
-	struct list_head list_op_async;
 	wait_queue_head_t wq;
+
+	/* Held across the global start, which takes each device's mutex */
+	struct mutex list_mutex;
+	/* Time of the last global start, common to all the armed devices */
+	ktime_t epoch;
 };
 
 static struct gb_loopback_device gb_dev;
 
+/* A completed request, as accounted for by gb_loopback_calculate_stats() */
+struct gb_loopback_sample {
+	u64 elapsed_nsecs;
+	u32 apbridge_latency_ts;
+	u32 gpbridge_latency_ts;
+	int type;
+	u32 len;
+	unsigned int profile_class;
+	ktime_t ts;
+	ktime_t te;
+	u16 operation_id;
+	int result;
+};
+
+/*
+ * Raw samples are streamed to user-space through a ring mapped from the
+ * debugfs file samples_<device>. The first page holds this header, the
+ * records follow at offset. The kernel only ever moves head and the reader
+ * only ever moves tail, both are free running and wrap at 2^32. A record
+ * at index i is complete once its seq reads i + 1. Samples that find the
+ * ring full are counted in lost and dropped.
+ */
+struct gb_loopback_sample_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 lost;
+	__u32 nr;		/* number of records, a power of two */
+	__u32 offset;		/* of the first record */
+	__u32 record_size;
+	__u32 size;		/* of the whole mapping */
+};
+
+struct gb_loopback_sample_record {
+	__u32 seq;
+	__u16 operation_id;
+	__u8 type;
+	__u8 pad;
+	__s32 result;
+	__u32 size;
+	__u64 start_ns;
+	__u64 end_ns;
+};
+
+/*
+ * Asynchronous operations are kept in a per-device pool and recycled once
+ * they complete, so that submission neither allocates nor copies. The
+ * operation is rebuilt only when the test type or size changes.
+ */
 struct gb_loopback_async_operation {
 	struct gb_loopback *gb;
+	struct gb_loopback_thread *thread;
 	struct gb_operation *operation;
-	struct timeval ts;
+	int type;
+	u32 len;
+	bool warmup;
+	u32 verify;
+	u32 crc;
+	struct gb_loopback_sample sample;
+	ktime_t ts;
 	struct timer_list timer;
-	struct list_head entry;
+	struct list_head pool_entry;
 	struct work_struct work;
 	struct kref kref;
-	bool pending;
+	/* Cleared by whichever of completion and timeout accounts for it */
+	atomic_t pending;
 	int (*completion)(struct gb_loopback_async_operation *op_async);
 };
 
+#define GB_LOOPBACK_THREADS_MAX		16
+
+/* Workload profile classes, one per operation type */
+#define GB_LOOPBACK_PROFILE_PING	0
+#define GB_LOOPBACK_PROFILE_TRANSFER	1
+#define GB_LOOPBACK_PROFILE_SINK	2
+#define GB_LOOPBACK_PROFILE_CLASSES	3
+#define GB_LOOPBACK_PROFILE_WEIGHT_MAX	U16_MAX
+
+struct gb_loopback_profile_class {
+	u32 weight;
+	u32 size_min;
+	u32 size_max;
+};
+
+static const struct {
+	const char *name;
+	int type;
+} gb_loopback_profile_types[GB_LOOPBACK_PROFILE_CLASSES] = {
+	[GB_LOOPBACK_PROFILE_PING] = { "ping", GB_LOOPBACK_TYPE_PING },
+	[GB_LOOPBACK_PROFILE_TRANSFER] = { "transfer",
+					   GB_LOOPBACK_TYPE_TRANSFER },
+	[GB_LOOPBACK_PROFILE_SINK] = { "sink", GB_LOOPBACK_TYPE_SINK },
+};
+
+/*
+ * Latency stats, kept per CPU so that completions update them without
+ * taking a lock, and folded together when read. Updates are made with
+ * preemption disabled, from process context only.
+ */
+struct gb_loopback_cpu {
+	struct gb_loopback_stats latency;
+	struct gb_loopback_stats apbridge_unipro_latency;
+	struct gb_loopback_stats gpbridge_firmware_latency;
+
+	struct gb_loopback_histogram latency_hist;
+	struct gb_loopback_histogram apbridge_unipro_latency_hist;
+	struct gb_loopback_histogram gpbridge_firmware_latency_hist;
+
+	/* Latency of each class of a workload profile */
+	struct gb_loopback_stats class_latency[GB_LOOPBACK_PROFILE_CLASSES];
+	struct gb_loopback_histogram
+		class_latency_hist[GB_LOOPBACK_PROFILE_CLASSES];
+};
+
+/*
+ * Service of requests initiated by the module, or by the stand-in host
+ * device, all in microseconds. Queue latency runs from the arrival of a
+ * request to its handler, response latency from the return of the handler
+ * to the response being sent.
+ */
+struct gb_loopback_responder {
+	struct gb_loopback_stats responder_requests_per_second;
+	struct gb_loopback_stats responder_queue_latency;
+	struct gb_loopback_stats responder_handler_latency;
+	struct gb_loopback_stats responder_response_latency;
+};
+
+/* A sender thread */
+struct gb_loopback_thread {
+	struct gb_loopback *gb;
+	struct task_struct *task;
+
+	/* The synchronous request in flight */
+	struct gb_loopback_sample sample;
+
+	/* Arrival time handed out by the rate timer, or 0 in closed loop */
+	ktime_t scheduled;
+	bool warmup;
+	u32 verify;
+	unsigned int profile_class;
+};
+
+/* Arrivals that may be waiting for a sender thread in rate mode */
+#define GB_LOOPBACK_RATE_BACKLOG	256
+
+#define GB_LOOPBACK_RATE_CONSTANT	0
+#define GB_LOOPBACK_RATE_POISSON	1
+
+/*
+ * Checks on the payload echoed by transfer operations. All but none and
+ * full send a pseudo-random pattern with a fresh seed per request, so that
+ * reordered or stale data is caught as well as corrupted data.
+ */
+#define GB_LOOPBACK_VERIFY_NONE		0	/* no check */
+#define GB_LOOPBACK_VERIFY_FULL		1	/* constant pattern, memcmp */
+#define GB_LOOPBACK_VERIFY_SAMPLED	2	/* a few windows of the payload */
+#define GB_LOOPBACK_VERIFY_CRC32C	3	/* CRC32C of the payload */
+#define GB_LOOPBACK_VERIFY_PATTERN	4	/* full memcmp */
+
+#define GB_LOOPBACK_VERIFY_SAMPLES	8
+#define GB_LOOPBACK_VERIFY_SAMPLE_SIZE	16
+#define GB_LOOPBACK_FILL_CHUNK		256
+
+#define GB_LOOPBACK_SWEEP_LINEAR	0
+#define GB_LOOPBACK_SWEEP_GEOMETRIC	1
+
+#define GB_LOOPBACK_SWEEP_STEPS_MAX	64
+
+/*
+ * Results of one step of a size sweep. Latency min/avg/max are in
+ * microseconds like the sysfs stats, the percentiles in nanoseconds.
+ */
+struct gb_loopback_sweep_result {
+	u32 size;
+	u32 iterations;
+	u32 errors;
+	u64 requests_per_second;
+	u64 throughput;
+	u64 latency_min;
+	u64 latency_avg;
+	u64 latency_max;
+	u64 latency_p50;
+	u64 latency_p99;
+	u64 latency_p999;
+};
+
 struct gb_loopback {
 	struct gb_connection *connection;
 
 	struct dentry *file;
-	struct kfifo kfifo_lat;
-	struct kfifo kfifo_ts;
+	struct dentry *sweep_file;
+	struct dentry *profile_file;
+	struct dentry *samples_file;
+	/* Raw latencies, one ring per CPU filled without locking */
+	struct kfifo __percpu *kfifo_lat;
+	struct gb_loopback_cpu __percpu *stats;
 	struct mutex mutex;
-	struct task_struct *task;
 	struct list_head entry;
 	struct device *dev;
 	wait_queue_head_t wq;
 	wait_queue_head_t wq_completion;
 	atomic_t outstanding_operations;
 
-	/* Per connection stats */
-	struct timeval ts;
-	struct gb_loopback_stats latency;
+	/*
+	 * Sender threads. Thread structures are allocated on demand and kept
+	 * until disconnect, so that stats and in-flight operations survive
+	 * changes to the thread count.
+	 */
+	struct mutex thread_mutex;
+	struct gb_loopback_thread *threads[GB_LOOPBACK_THREADS_MAX];
+	u32 threads_allocated;
+	u32 nthreads;
+	u32 thread_pinning;
+
+	/*
+	 * Open-loop traffic: the rate timer schedules arrivals independently
+	 * of completions and sender threads pick them up in order.
+	 */
+	struct hrtimer rate_timer;
+	spinlock_t rate_lock;
+	DECLARE_KFIFO(rate_fifo, ktime_t, GB_LOOPBACK_RATE_BACKLOG);
+	u64 rate_interval;
+	int rate_poisson;
+
+	/* Idle asynchronous operations, protected by op_pool_lock */
+	spinlock_t op_pool_lock;
+	struct list_head op_pool;
+	u32 op_pool_count;
+
+	/*
+	 * Per connection stats, sampled over windows of about a second by
+	 * whichever completion first notices the window is over
+	 */
+	spinlock_t window_lock;
+	ktime_t ts;
 	struct gb_loopback_stats throughput;
 	struct gb_loopback_stats requests_per_second;
-	struct gb_loopback_stats apbridge_unipro_latency;
-	struct gb_loopback_stats gpbridge_firmware_latency;
 
 	int type;
 	int async;
 	int id;
 	u32 size;
 	u32 iteration_max;
-	u32 iteration_count;
+	atomic_t iteration_count;
 	int us_wait;
-	u32 error;
-	u32 requests_completed;
-	u32 requests_timedout;
+	atomic_t error;
+	atomic_t requests_completed;
+	atomic_t requests_timedout;
 	u32 timeout;
 	u32 jiffy_timeout;
 	u32 timeout_min;
 	u32 timeout_max;
 	u32 outstanding_operations_max;
+	u32 rate;
+	u32 rate_mode;
+	u32 rate_missed;
+	u32 warmup;
+	atomic_t warmup_left;
+	u32 verify;
+	u32 armed;
+	bool held;
+	atomic64_t bytes_completed;
 	u32 lbid;
-	u64 elapsed_nsecs;
-	u32 apbridge_latency_ts;
-	u32 gpbridge_latency_ts;
 
-	u32 send_count;
+	/* Weighted mix of operations used instead of type and size */
+	u32 profile;
+	u32 profile_weight;
+	struct gb_loopback_profile_class
+		profile_classes[GB_LOOPBACK_PROFILE_CLASSES];
+
+	/* Size sweep, enabled by a non-zero sweep_max */
+	u32 sweep_min;
+	u32 sweep_max;
+	u32 sweep_step;
+	u32 sweep_mode;
+	u32 sweep_error_base;
+	u32 sweep_count;
+	struct gb_loopback_sweep_result sweep_results[GB_LOOPBACK_SWEEP_STEPS_MAX];
+
+	/* Iterations claimed by the sender threads */
+	atomic_t send_count;
+
+	/* Raw sample stream, allocated on first open of samples_<device> */
+	struct gb_loopback_sample_ring *sample_ring;
+	bool sample_reader;
+	atomic_t samples_lost;
+	wait_queue_head_t sample_wq;
+
+	/* Requests served, the stats may be updated in atomic context */
+	spinlock_t responder_lock;
+	struct gb_loopback_responder responder;
+	ktime_t responder_ts;
+	u32 responder_window;
+	u32 responder_requests;
+
+	/*
+	 * Inbound load, injected through a software host device standing in
+	 * for the module. Each response handed to it is replaced by a new
+	 * request so that inbound_outstanding requests stay in flight.
+	 */
+	struct gb_host_device *inbound_hd;
+	struct gb_connection *inbound_connection;
+	struct gb_operation_msg_hdr *inbound_request;
+	spinlock_t inbound_lock;
+	struct list_head inbound_sent;
+	struct work_struct inbound_work;
+	atomic_t inbound_inflight;
+	u16 inbound_operation_id;
+	int inbound_type;
+	u32 inbound_size;
+	u32 inbound_outstanding;
 };
 
 static struct class loopback_class = {
@@ -123,9 +404,18 @@ static DEFINE_IDA(loopback_ida);
 
 #define GB_LOOPBACK_FIFO_DEFAULT			8192
 
+/* Asynchronous operations in flight when outstanding_operations_max is 0 */
+#define GB_LOOPBACK_ASYNC_POOL_DEFAULT			32
+
 static unsigned kfifo_depth = GB_LOOPBACK_FIFO_DEFAULT;
 module_param(kfifo_depth, uint, 0444);
 
+#define GB_LOOPBACK_SAMPLE_DEPTH_DEFAULT		65536
+
+/* Records in the raw sample ring, rounded up to a power of two */
+static unsigned sample_depth = GB_LOOPBACK_SAMPLE_DEPTH_DEFAULT;
+module_param(sample_depth, uint, 0444);
+
 /* Maximum size of any one send data buffer we support */
 #define MAX_PACKET_SIZE (PAGE_SIZE * 2)
 
@@ -142,32 +432,56 @@ static ssize_t field##_show(struct device *dev,			\
 }									\
 static DEVICE_ATTR_RO(field)
 
-#define gb_loopback_ro_stats_attr(name, field, type)		\
+#define gb_loopback_ro_atomic_attr(field)				\
+static ssize_t field##_show(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    char *buf)					\
+{									\
+	struct gb_loopback *gb = dev_get_drvdata(dev);			\
+	return sprintf(buf, "%u\n", atomic_read(&gb->field));		\
+}									\
+static DEVICE_ATTR_RO(field)
+
+static void gb_loopback_stats_get(struct gb_loopback *gb, size_t offset,
+				  struct gb_loopback_stats *stats);
+static void gb_loopback_cpu_stats_get(struct gb_loopback *gb, size_t offset,
+				      struct gb_loopback_stats *stats);
+static void gb_loopback_responder_stats_get(struct gb_loopback *gb,
+					    size_t offset,
+					    struct gb_loopback_stats *stats);
+
+/*
+ * src is the structure holding the stats: gb_loopback, gb_loopback_cpu or
+ * gb_loopback_responder
+ */
+#define gb_loopback_ro_stats_attr(name, field, type, src)		\
 static ssize_t name##_##field##_show(struct device *dev,	\
 			    struct device_attribute *attr,		\
 			    char *buf)					\
 {									\
 	struct gb_loopback *gb = dev_get_drvdata(dev);			\
+	struct gb_loopback_stats stats;					\
+	src##_stats_get(gb, offsetof(struct src, name), &stats);	\
 	/* Report 0 for min and max if no transfer successed */		\
-	if (!gb->requests_completed)					\
+	if (!stats.count)						\
 		return sprintf(buf, "0\n");				\
-	return sprintf(buf, "%"#type"\n", gb->name.field);	\
+	return sprintf(buf, "%"#type"\n", stats.field);		\
 }									\
 static DEVICE_ATTR_RO(name##_##field)
 
-#define gb_loopback_ro_avg_attr(name)			\
+#define gb_loopback_ro_avg_attr(name, src)			\
 static ssize_t name##_avg_show(struct device *dev,		\
 			    struct device_attribute *attr,		\
 			    char *buf)					\
 {									\
-	struct gb_loopback_stats *stats;				\
+	struct gb_loopback_stats stats;					\
 	struct gb_loopback *gb;						\
 	u64 avg, rem;							\
 	u32 count;							\
 	gb = dev_get_drvdata(dev);			\
-	stats = &gb->name;					\
-	count = stats->count ? stats->count : 1;			\
-	avg = stats->sum + count / 2000000; /* round closest */		\
+	src##_stats_get(gb, offsetof(struct src, name), &stats);	\
+	count = stats.count ? stats.count : 1;				\
+	avg = stats.sum + count / 2000000; /* round closest */		\
 	rem = do_div(avg, count);					\
 	rem *= 1000000;							\
 	do_div(rem, count);						\
@@ -175,10 +489,35 @@ static ssize_t name##_avg_show(struct device *dev,		\
 }									\
 static DEVICE_ATTR_RO(name##_avg)
 
-#define gb_loopback_stats_attrs(field)				\
-	gb_loopback_ro_stats_attr(field, min, u);		\
-	gb_loopback_ro_stats_attr(field, max, u);		\
-	gb_loopback_ro_avg_attr(field)
+static u64 gb_loopback_hist_percentile(struct gb_loopback *gb, size_t offset,
+				       unsigned int permille);
+
+/* Percentiles are reported in microseconds with nanosecond resolution */
+#define gb_loopback_ro_percentile_attr(name, pct, permille)		\
+static ssize_t name##_##pct##_show(struct device *dev,			\
+			    struct device_attribute *attr,		\
+			    char *buf)					\
+{									\
+	struct gb_loopback *gb = dev_get_drvdata(dev);			\
+	u64 val;							\
+	u32 rem;							\
+	val = gb_loopback_hist_percentile(gb,				\
+		offsetof(struct gb_loopback_cpu, name##_hist), permille); \
+	rem = do_div(val, NSEC_PER_USEC);				\
+	return sprintf(buf, "%llu.%03u\n", val, rem);			\
+}									\
+static DEVICE_ATTR_RO(name##_##pct)
+
+#define gb_loopback_stats_attrs(field, src)			\
+	gb_loopback_ro_stats_attr(field, min, u, src);		\
+	gb_loopback_ro_stats_attr(field, max, u, src);		\
+	gb_loopback_ro_avg_attr(field, src)
+
+#define gb_loopback_latency_attrs(field)			\
+	gb_loopback_stats_attrs(field, gb_loopback_cpu);	\
+	gb_loopback_ro_percentile_attr(field, p50, 500);	\
+	gb_loopback_ro_percentile_attr(field, p99, 990);	\
+	gb_loopback_ro_percentile_attr(field, p999, 999)
 
 #define gb_loopback_attr(field, type)					\
 static ssize_t field##_show(struct device *dev,				\
@@ -206,16 +545,6 @@ static ssize_t field##_store(struct device *dev,			\
 }									\
 static DEVICE_ATTR_RW(field)
 
-#define gb_dev_loopback_ro_attr(field, conn)				\
-static ssize_t field##_show(struct device *dev,		\
-			    struct device_attribute *attr,		\
-			    char *buf)					\
-{									\
-	struct gb_loopback *gb = dev_get_drvdata(dev);			\
-	return sprintf(buf, "%u\n", gb->field);				\
-}									\
-static DEVICE_ATTR_RO(field)
-
 #define gb_dev_loopback_rw_attr(field, type)				\
 static ssize_t field##_show(struct device *dev,				\
 			    struct device_attribute *attr,		\
@@ -243,25 +572,53 @@ static ssize_t field##_store(struct device *dev,			\
 static DEVICE_ATTR_RW(field)
 
 static void gb_loopback_reset_stats(struct gb_loopback *gb);
+static void gb_loopback_async_pool_fill(struct gb_loopback *gb);
+static void gb_loopback_rate_start(struct gb_loopback *gb, ktime_t start);
+static void gb_loopback_rate_stop(struct gb_loopback *gb);
+static int gb_loopback_threads_restart(struct gb_loopback *gb, u32 nthreads);
+
 static void gb_loopback_check_attr(struct gb_loopback *gb)
 {
+	unsigned int cpu;
+
 	if (gb->us_wait > GB_LOOPBACK_US_WAIT_MAX)
 		gb->us_wait = GB_LOOPBACK_US_WAIT_MAX;
 	if (gb->size > gb_dev.size_max)
 		gb->size = gb_dev.size_max;
-	gb->requests_timedout = 0;
-	gb->requests_completed = 0;
-	gb->iteration_count = 0;
-	gb->send_count = 0;
-	gb->error = 0;
+	atomic_set(&gb->requests_timedout, 0);
+	atomic_set(&gb->requests_completed, 0);
+	atomic64_set(&gb->bytes_completed, 0);
+	atomic_set(&gb->iteration_count, 0);
+	atomic_set(&gb->send_count, 0);
+	atomic_set(&gb->error, 0);
+	gb->rate_missed = 0;
+	if (gb->rate_mode > GB_LOOPBACK_RATE_POISSON)
+		gb->rate_mode = GB_LOOPBACK_RATE_CONSTANT;
+	if (gb->verify > GB_LOOPBACK_VERIFY_PATTERN)
+		gb->verify = GB_LOOPBACK_VERIFY_FULL;
+	if (gb->profile && !gb->profile_weight)
+		gb->profile = 0;
+	if (gb->sweep_max > gb_dev.size_max)
+		gb->sweep_max = gb_dev.size_max;
+	if (gb->inbound_size > gb_dev.size_max)
+		gb->inbound_size = gb_dev.size_max;
+	if (gb->sweep_min > gb->sweep_max)
+		gb->sweep_min = gb->sweep_max;
+	if (gb->sweep_mode > GB_LOOPBACK_SWEEP_GEOMETRIC)
+		gb->sweep_mode = GB_LOOPBACK_SWEEP_LINEAR;
+	if (gb->sweep_mode == GB_LOOPBACK_SWEEP_GEOMETRIC &&
+	    gb->sweep_step < 2)
+		gb->sweep_step = 2;
+	else if (!gb->sweep_step)
+		gb->sweep_step = 1;
 
 	if (kfifo_depth < gb->iteration_max) {
 		dev_warn(gb->dev,
 			 "cannot log bytes %u kfifo_depth %u\n",
 			 gb->iteration_max, kfifo_depth);
 	}
-	kfifo_reset_out(&gb->kfifo_lat);
-	kfifo_reset_out(&gb->kfifo_ts);
+	for_each_possible_cpu(cpu)
+		kfifo_reset_out(per_cpu_ptr(gb->kfifo_lat, cpu));
 
 	switch (gb->type) {
 	case GB_LOOPBACK_TYPE_PING:
@@ -272,36 +629,64 @@ static void gb_loopback_check_attr(struct gb_loopback *gb)
 			gb->jiffy_timeout = GB_LOOPBACK_TIMEOUT_MIN;
 		else if (gb->jiffy_timeout > GB_LOOPBACK_TIMEOUT_MAX)
 			gb->jiffy_timeout = GB_LOOPBACK_TIMEOUT_MAX;
+		if (gb->sweep_max)
+			gb->size = gb->sweep_min;
+		gb->sweep_count = 0;
+		gb->sweep_error_base = 0;
+		atomic_set(&gb->warmup_left, gb->warmup);
+		if (gb->async)
+			gb_loopback_async_pool_fill(gb);
 		gb_loopback_reset_stats(gb);
+		/* An armed test waits for the global start */
+		gb->held = gb->armed;
+		if (gb->held) {
+			gb_loopback_rate_stop(gb);
+			break;
+		}
+		gb_loopback_rate_start(gb, ktime_get());
 		wake_up(&gb->wq);
 		break;
 	default:
 		gb->type = 0;
+		gb->held = false;
+		gb_loopback_rate_stop(gb);
 		break;
 	}
 }
 
 /* Time to send and receive one message */
-gb_loopback_stats_attrs(latency);
+gb_loopback_latency_attrs(latency);
 /* Number of requests sent per second on this cport */
-gb_loopback_stats_attrs(requests_per_second);
+gb_loopback_stats_attrs(requests_per_second, gb_loopback);
 /* Quantity of data sent and received on this cport */
-gb_loopback_stats_attrs(throughput);
+gb_loopback_stats_attrs(throughput, gb_loopback);
 /* Latency across the UniPro link from APBridge's perspective */
-gb_loopback_stats_attrs(apbridge_unipro_latency);
+gb_loopback_latency_attrs(apbridge_unipro_latency);
 /* Firmware induced overhead in the GPBridge */
-gb_loopback_stats_attrs(gpbridge_firmware_latency);
+gb_loopback_latency_attrs(gpbridge_firmware_latency);
 
 /* Number of errors encountered during loop */
-gb_loopback_ro_attr(error);
+gb_loopback_ro_atomic_attr(error);
 /* Number of requests successfully completed async */
-gb_loopback_ro_attr(requests_completed);
+gb_loopback_ro_atomic_attr(requests_completed);
 /* Number of requests timed out async */
-gb_loopback_ro_attr(requests_timedout);
+gb_loopback_ro_atomic_attr(requests_timedout);
 /* Timeout minimum in useconds */
 gb_loopback_ro_attr(timeout_min);
 /* Timeout minimum in useconds */
 gb_loopback_ro_attr(timeout_max);
+/* Scheduled arrivals dropped because no sender thread kept up */
+gb_loopback_ro_attr(rate_missed);
+
+/* Requests received from the module, or the stand-in host device */
+gb_loopback_ro_attr(responder_requests);
+gb_loopback_stats_attrs(responder_requests_per_second, gb_loopback_responder);
+/* Time from the arrival of a request to its handler */
+gb_loopback_stats_attrs(responder_queue_latency, gb_loopback_responder);
+/* Time spent in the request handler */
+gb_loopback_stats_attrs(responder_handler_latency, gb_loopback_responder);
+/* Time from the return of the handler to the response being sent */
+gb_loopback_stats_attrs(responder_response_latency, gb_loopback_responder);
 
 /*
  * Type of loopback message to send based on protocol type definitions
@@ -319,18 +704,181 @@ gb_dev_loopback_rw_attr(us_wait, d);
 /* Maximum iterations for a given operation: 1-(2^32-1), 0 implies infinite */
 gb_dev_loopback_rw_attr(iteration_max, u);
 /* The current index of the for (i = 0; i < iteration_max; i++) loop */
-gb_dev_loopback_ro_attr(iteration_count, false);
+gb_loopback_ro_atomic_attr(iteration_count);
 /* A flag to indicate synchronous or asynchronous operations */
 gb_dev_loopback_rw_attr(async, u);
 /* Timeout of an individual asynchronous request */
 gb_dev_loopback_rw_attr(timeout, u);
 /* Maximum number of in-flight operations before back-off */
 gb_dev_loopback_rw_attr(outstanding_operations_max, u);
+/* Open-loop request rate in requests per second, 0 sends back-to-back */
+gb_dev_loopback_rw_attr(rate, u);
+/* Inter-arrival times at a given rate: 0 => constant, 1 => Poisson */
+gb_dev_loopback_rw_attr(rate_mode, u);
+/*
+ * Check of transfer payloads: 0 => none, 1 => full, 2 => sampled,
+ * 3 => CRC32C, 4 => pseudo-random pattern
+ */
+gb_dev_loopback_rw_attr(verify, u);
+/* Send the mix loaded in the debugfs profile file instead of type and size */
+gb_dev_loopback_rw_attr(profile, u);
+/* Hold tests started through type until the global start in debugfs */
+gb_dev_loopback_rw_attr(armed, u);
+/* Iterations sent before results are recorded, at each step of a sweep */
+gb_dev_loopback_rw_attr(warmup, u);
+/* Sweep the size from sweep_min to sweep_max, disabled if sweep_max is 0 */
+gb_dev_loopback_rw_attr(sweep_min, u);
+gb_dev_loopback_rw_attr(sweep_max, u);
+/* Size increment, or multiplier for a geometric sweep */
+gb_dev_loopback_rw_attr(sweep_step, u);
+/* 0 => linear sweep, 1 => geometric sweep */
+gb_dev_loopback_rw_attr(sweep_mode, u);
+/* Payload size of the requests injected by inbound_type */
+gb_dev_loopback_rw_attr(inbound_size, u);
+/* Injected requests kept in flight, 0 behaves as 1 */
+gb_dev_loopback_rw_attr(inbound_outstanding, u);
+
+static int gb_loopback_inbound_start(struct gb_loopback *gb, int type);
+
+/*
+ * Type of request injected through the stand-in host device, as for type:
+ * 0 => stop, 2 => ping, 3 => transfer, 4 => sink
+ */
+static ssize_t inbound_type_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", gb->inbound_type);
+}
+
+static ssize_t inbound_type_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+	int type;
+	int ret;
+
+	if (kstrtoint(buf, 0, &type))
+		return -EINVAL;
+
+	switch (type) {
+	case 0:
+	case GB_LOOPBACK_TYPE_PING:
+	case GB_LOOPBACK_TYPE_TRANSFER:
+	case GB_LOOPBACK_TYPE_SINK:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&gb->mutex);
+	ret = gb_loopback_inbound_start(gb, type);
+	mutex_unlock(&gb->mutex);
+
+	return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(inbound_type);
+
+/*
+ * Number of sender threads: 1-GB_LOOPBACK_THREADS_MAX. The threads share the
+ * iteration budget of a test and can only be changed while no test runs.
+ */
+static ssize_t threads_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", gb->nthreads);
+}
+
+static ssize_t threads_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t len)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+	u32 nthreads;
+	int ret;
+
+	if (kstrtou32(buf, 0, &nthreads))
+		return -EINVAL;
+	if (!nthreads || nthreads > GB_LOOPBACK_THREADS_MAX)
+		return -EINVAL;
+
+	mutex_lock(&gb->thread_mutex);
+	ret = gb_loopback_threads_restart(gb, nthreads);
+	mutex_unlock(&gb->thread_mutex);
+
+	return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(threads);
+
+/* Bind sender thread N to the Nth online CPU (modulo the number of CPUs) */
+static ssize_t thread_pinning_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", gb->thread_pinning);
+}
+
+static ssize_t thread_pinning_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t len)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+	bool pinning;
+	u32 old;
+	int ret;
+
+	if (strtobool(buf, &pinning))
+		return -EINVAL;
+
+	mutex_lock(&gb->thread_mutex);
+	old = gb->thread_pinning;
+	gb->thread_pinning = pinning;
+	ret = gb_loopback_threads_restart(gb, gb->nthreads);
+	if (ret)
+		gb->thread_pinning = old;
+	mutex_unlock(&gb->thread_mutex);
+
+	return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(thread_pinning);
+
+/* Share of the host device transmit bandwidth of the loopback connection */
+static ssize_t tx_weight_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", gb->connection->tx_weight);
+}
+
+static ssize_t tx_weight_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct gb_loopback *gb = dev_get_drvdata(dev);
+	unsigned int weight;
+	int ret;
+
+	if (kstrtouint(buf, 0, &weight))
+		return -EINVAL;
+
+	ret = gb_connection_set_tx_weight(gb->connection, weight);
+
+	return ret ? ret : len;
+}
+static DEVICE_ATTR_RW(tx_weight);
 
 static struct attribute *loopback_attrs[] = {
 	&dev_attr_latency_min.attr,
 	&dev_attr_latency_max.attr,
 	&dev_attr_latency_avg.attr,
+	&dev_attr_latency_p50.attr,
+	&dev_attr_latency_p99.attr,
+	&dev_attr_latency_p999.attr,
 	&dev_attr_requests_per_second_min.attr,
 	&dev_attr_requests_per_second_max.attr,
 	&dev_attr_requests_per_second_avg.attr,
@@ -340,9 +888,15 @@ static struct attribute *loopback_attrs[] = {
 	&dev_attr_apbridge_unipro_latency_min.attr,
 	&dev_attr_apbridge_unipro_latency_max.attr,
 	&dev_attr_apbridge_unipro_latency_avg.attr,
+	&dev_attr_apbridge_unipro_latency_p50.attr,
+	&dev_attr_apbridge_unipro_latency_p99.attr,
+	&dev_attr_apbridge_unipro_latency_p999.attr,
 	&dev_attr_gpbridge_firmware_latency_min.attr,
 	&dev_attr_gpbridge_firmware_latency_max.attr,
 	&dev_attr_gpbridge_firmware_latency_avg.attr,
+	&dev_attr_gpbridge_firmware_latency_p50.attr,
+	&dev_attr_gpbridge_firmware_latency_p99.attr,
+	&dev_attr_gpbridge_firmware_latency_p999.attr,
 	&dev_attr_type.attr,
 	&dev_attr_size.attr,
 	&dev_attr_us_wait.attr,
@@ -354,13 +908,45 @@ static struct attribute *loopback_attrs[] = {
 	&dev_attr_requests_timedout.attr,
 	&dev_attr_timeout.attr,
 	&dev_attr_outstanding_operations_max.attr,
+	&dev_attr_threads.attr,
+	&dev_attr_thread_pinning.attr,
+	&dev_attr_rate.attr,
+	&dev_attr_rate_mode.attr,
+	&dev_attr_rate_missed.attr,
+	&dev_attr_verify.attr,
+	&dev_attr_armed.attr,
+	&dev_attr_profile.attr,
+	&dev_attr_warmup.attr,
+	&dev_attr_sweep_min.attr,
+	&dev_attr_sweep_max.attr,
+	&dev_attr_sweep_step.attr,
+	&dev_attr_sweep_mode.attr,
 	&dev_attr_timeout_min.attr,
 	&dev_attr_timeout_max.attr,
+	&dev_attr_responder_requests.attr,
+	&dev_attr_responder_requests_per_second_min.attr,
+	&dev_attr_responder_requests_per_second_max.attr,
+	&dev_attr_responder_requests_per_second_avg.attr,
+	&dev_attr_responder_queue_latency_min.attr,
+	&dev_attr_responder_queue_latency_max.attr,
+	&dev_attr_responder_queue_latency_avg.attr,
+	&dev_attr_responder_handler_latency_min.attr,
+	&dev_attr_responder_handler_latency_max.attr,
+	&dev_attr_responder_handler_latency_avg.attr,
+	&dev_attr_responder_response_latency_min.attr,
+	&dev_attr_responder_response_latency_max.attr,
+	&dev_attr_responder_response_latency_avg.attr,
+	&dev_attr_inbound_type.attr,
+	&dev_attr_inbound_size.attr,
+	&dev_attr_inbound_outstanding.attr,
+	&dev_attr_tx_weight.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(loopback);
 
-static void gb_loopback_calculate_stats(struct gb_loopback *gb, bool error);
+static void gb_loopback_calculate_stats(struct gb_loopback *gb,
+					struct gb_loopback_sample *sample,
+					bool error);
 
 static u32 gb_loopback_nsec_to_usec_latency(u64 elapsed_nsecs)
 {
@@ -371,127 +957,326 @@ static u32 gb_loopback_nsec_to_usec_latency(u64 elapsed_nsecs)
 	return lat;
 }
 
-static u64 __gb_loopback_calc_latency(u64 t1, u64 t2)
+static u64 gb_loopback_calc_latency(ktime_t ts, ktime_t te)
 {
-	if (t2 > t1)
-		return t2 - t1;
-	else
-		return NSEC_PER_DAY - t2 + t1;
+	return ktime_to_ns(ktime_sub(te, ts));
 }
 
-static u64 gb_loopback_calc_latency(struct timeval *ts, struct timeval *te)
+/*
+ * Open-loop tests measure latency from the scheduled arrival rather than
+ * from the actual send, so that a backlog shows up in the results instead
+ * of silently lowering the offered load.
+ */
+static ktime_t gb_loopback_start_time(struct gb_loopback_thread *thread)
 {
-	u64 t1, t2;
-
-	t1 = timeval_to_ns(ts);
-	t2 = timeval_to_ns(te);
+	if (ktime_to_ns(thread->scheduled))
+		return thread->scheduled;
 
-	return __gb_loopback_calc_latency(t1, t2);
+	return ktime_get();
 }
 
-static void gb_loopback_push_latency_ts(struct gb_loopback *gb,
-					struct timeval *ts, struct timeval *te)
+/* -ln(x / 2^32) in 16.16 fixed point, for x in [1, 2^32 - 1] */
+static u32 gb_loopback_neg_ln(u32 x)
 {
-	kfifo_in(&gb->kfifo_ts, (unsigned char *)ts, sizeof(*ts));
-	kfifo_in(&gb->kfifo_ts, (unsigned char *)te, sizeof(*te));
+	int msb = fls(x) - 1;
+	u64 y = (u64)x << (31 - msb);
+	u32 frac = 0;
+	int i;
+
+	/* Fractional bits of log2(x), one per squaring */
+	for (i = 0; i < 16; i++) {
+		y = (y * y) >> 31;
+		frac <<= 1;
+		if (y >= (1ULL << 32)) {
+			y >>= 1;
+			frac |= 1;
+		}
+	}
+
+	/* ln(2) is 45426 in 16.16 fixed point */
+	return ((u64)((32 << 16) - ((msb << 16) | frac)) * 45426) >> 16;
 }
 
-static int gb_loopback_operation_sync(struct gb_loopback *gb, int type,
-				      void *request, int request_size,
-				      void *response, int response_size)
+static u64 gb_loopback_rate_next(struct gb_loopback *gb)
 {
-	struct gb_operation *operation;
-	struct timeval ts, te;
-	int ret;
+	u32 x;
 
-	do_gettimeofday(&ts);
-	operation = gb_operation_create(gb->connection, type, request_size,
-					response_size, GFP_KERNEL);
-	if (!operation)
-		return -ENOMEM;
+	if (!gb->rate_poisson)
+		return gb->rate_interval;
 
-	if (request_size)
-		memcpy(operation->request->payload, request, request_size);
+	/* Exponentially distributed, with rate_interval as its mean */
+	x = prandom_u32();
+	if (!x)
+		x = 1;
 
-	ret = gb_operation_request_send_sync(operation);
-	if (ret) {
-		dev_err(&gb->connection->bundle->dev,
-			"synchronous operation failed: %d\n", ret);
-		goto out_put_operation;
-	} else {
-		if (response_size == operation->response->payload_size) {
-			memcpy(response, operation->response->payload,
-			       response_size);
-		} else {
-			dev_err(&gb->connection->bundle->dev,
-				"response size %zu expected %d\n",
-				operation->response->payload_size,
-				response_size);
-			ret = -EINVAL;
-			goto out_put_operation;
-		}
-	}
+	return (gb->rate_interval * gb_loopback_neg_ln(x)) >> 16;
+}
 
-	do_gettimeofday(&te);
+static enum hrtimer_restart gb_loopback_rate_fn(struct hrtimer *timer)
+{
+	struct gb_loopback *gb = container_of(timer, struct gb_loopback,
+					      rate_timer);
+	ktime_t now = ktime_get();
+	ktime_t arrival;
+	unsigned int i;
+
+	/* Hand out every arrival that is due, even if the timer ran late */
+	for (i = 0; i < GB_LOOPBACK_RATE_BACKLOG; i++) {
+		arrival = hrtimer_get_expires(timer);
+		if (ktime_compare(arrival, now) > 0)
+			break;
 
-	/* Calculate the total time the message took */
-	gb_loopback_push_latency_ts(gb, &ts, &te);
-	gb->elapsed_nsecs = gb_loopback_calc_latency(&ts, &te);
+		if (!kfifo_in_spinlocked(&gb->rate_fifo, &arrival, 1,
+					 &gb->rate_lock))
+			gb->rate_missed++;
 
-out_put_operation:
-	gb_operation_put(operation);
+		hrtimer_add_expires_ns(timer, gb_loopback_rate_next(gb));
+	}
+	if (i == GB_LOOPBACK_RATE_BACKLOG)
+		hrtimer_set_expires(timer, ktime_add_ns(now,
+						gb_loopback_rate_next(gb)));
 
-	return ret;
+	wake_up(&gb->wq);
+
+	return HRTIMER_RESTART;
 }
 
-static void __gb_loopback_async_operation_destroy(struct kref *kref)
+static bool gb_loopback_rate_get(struct gb_loopback *gb, ktime_t *arrival)
 {
-	struct gb_loopback_async_operation *op_async;
+	return kfifo_out_spinlocked(&gb->rate_fifo, arrival, 1,
+				    &gb->rate_lock);
+}
 
-	op_async = container_of(kref, struct gb_loopback_async_operation, kref);
+/* Called with gb->mutex held */
+static void gb_loopback_rate_start(struct gb_loopback *gb, ktime_t start)
+{
+	unsigned long flags;
 
-	list_del(&op_async->entry);
-	if (op_async->operation)
-		gb_operation_put(op_async->operation);
-	atomic_dec(&op_async->gb->outstanding_operations);
-	wake_up(&op_async->gb->wq_completion);
-	kfree(op_async);
+	gb_loopback_rate_stop(gb);
+	if (!gb->rate)
+		return;
+
+	spin_lock_irqsave(&gb->rate_lock, flags);
+	kfifo_reset(&gb->rate_fifo);
+	spin_unlock_irqrestore(&gb->rate_lock, flags);
+
+	gb->rate_interval = div_u64(NSEC_PER_SEC, gb->rate);
+	gb->rate_poisson = gb->rate_mode == GB_LOOPBACK_RATE_POISSON;
+	hrtimer_start(&gb->rate_timer, start, HRTIMER_MODE_ABS);
 }
 
-static void gb_loopback_async_operation_get(struct gb_loopback_async_operation
-					    *op_async)
+/* Called with gb->mutex held */
+static void gb_loopback_rate_stop(struct gb_loopback *gb)
 {
-	kref_get(&op_async->kref);
+	hrtimer_cancel(&gb->rate_timer);
 }
 
-static void gb_loopback_async_operation_put(struct gb_loopback_async_operation
-					    *op_async)
+static unsigned int gb_loopback_hist_index(u64 val)
 {
-	unsigned long flags;
+	unsigned int shift, idx;
 
-	spin_lock_irqsave(&gb_dev.lock, flags);
-	kref_put(&op_async->kref, __gb_loopback_async_operation_destroy);
-	spin_unlock_irqrestore(&gb_dev.lock, flags);
+	if (val < GB_LOOPBACK_HIST_SUB_COUNT)
+		return val;
+
+	shift = fls64(val) - 1 - GB_LOOPBACK_HIST_SUB_BITS;
+	idx = ((shift + 1) << GB_LOOPBACK_HIST_SUB_BITS) +
+		((val >> shift) & (GB_LOOPBACK_HIST_SUB_COUNT - 1));
+
+	return min_t(unsigned int, idx, GB_LOOPBACK_HIST_BUCKETS - 1);
 }
 
-static struct gb_loopback_async_operation *
-	gb_loopback_operation_find(u16 id)
+/* Smallest value falling into bucket idx */
+static u64 gb_loopback_hist_value(unsigned int idx)
 {
-	struct gb_loopback_async_operation *op_async;
-	bool found = false;
-	unsigned long flags;
+	unsigned int shift;
 
-	spin_lock_irqsave(&gb_dev.lock, flags);
-	list_for_each_entry(op_async, &gb_dev.list_op_async, entry) {
-		if (op_async->operation->id == id) {
-			gb_loopback_async_operation_get(op_async);
-			found = true;
-			break;
-		}
-	}
-	spin_unlock_irqrestore(&gb_dev.lock, flags);
+	if (idx < GB_LOOPBACK_HIST_SUB_COUNT)
+		return idx;
 
-	return found ? op_async : NULL;
+	shift = (idx >> GB_LOOPBACK_HIST_SUB_BITS) - 1;
+
+	return (u64)(GB_LOOPBACK_HIST_SUB_COUNT +
+		     (idx & (GB_LOOPBACK_HIST_SUB_COUNT - 1))) << shift;
+}
+
+static void gb_loopback_hist_add(struct gb_loopback_histogram *hist, u64 val)
+{
+	hist->buckets[gb_loopback_hist_index(val)]++;
+	hist->count++;
+}
+
+#define gb_loopback_cpu_member(gb, cpu, offset, type)	\
+	((type *)((void *)per_cpu_ptr((gb)->stats, cpu) + (offset)))
+
+static void gb_loopback_stats_get(struct gb_loopback *gb, size_t offset,
+				  struct gb_loopback_stats *stats)
+{
+	spin_lock(&gb->window_lock);
+	*stats = *(struct gb_loopback_stats *)((void *)gb + offset);
+	spin_unlock(&gb->window_lock);
+}
+
+static void gb_loopback_responder_stats_get(struct gb_loopback *gb,
+					    size_t offset,
+					    struct gb_loopback_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->responder_lock, flags);
+	*stats = *(struct gb_loopback_stats *)((void *)&gb->responder + offset);
+	spin_unlock_irqrestore(&gb->responder_lock, flags);
+}
+
+/*
+ * Fold the stats at offset in struct gb_loopback_cpu across CPUs.
+ * This does not stop concurrent updates, so a test still running may be
+ * seen partway through a completion.
+ */
+static void gb_loopback_cpu_stats_get(struct gb_loopback *gb, size_t offset,
+				      struct gb_loopback_stats *stats)
+{
+	struct gb_loopback_stats *s;
+	unsigned int cpu;
+
+	stats->min = U32_MAX;
+	stats->max = 0;
+	stats->sum = 0;
+	stats->count = 0;
+
+	for_each_possible_cpu(cpu) {
+		s = gb_loopback_cpu_member(gb, cpu, offset,
+					   struct gb_loopback_stats);
+		if (!s->count)
+			continue;
+		stats->min = min(stats->min, s->min);
+		stats->max = max(stats->max, s->max);
+		stats->sum += s->sum;
+		stats->count += s->count;
+	}
+}
+
+/*
+ * Return the upper bound of the bucket holding the given percentile
+ * (expressed in tenths of a percent) of the histogram at offset in struct
+ * gb_loopback_cpu, summed across CPUs, or 0 if nothing has been
+ * recorded.
+ */
+static u64 gb_loopback_hist_percentile(struct gb_loopback *gb, size_t offset,
+				       unsigned int permille)
+{
+	struct gb_loopback_histogram *hist;
+	u64 rank, count = 0, seen = 0;
+	unsigned int i, cpu;
+	u64 val = 0;
+
+	for_each_possible_cpu(cpu) {
+		hist = gb_loopback_cpu_member(gb, cpu, offset,
+					      struct gb_loopback_histogram);
+		count += hist->count;
+	}
+	if (!count)
+		return 0;
+
+	rank = DIV_ROUND_UP_ULL(count * permille, 1000);
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < GB_LOOPBACK_HIST_BUCKETS - 1; i++) {
+		for_each_possible_cpu(cpu) {
+			hist = gb_loopback_cpu_member(gb, cpu, offset,
+						struct gb_loopback_histogram);
+			seen += hist->buckets[i];
+		}
+		if (seen >= rank)
+			break;
+	}
+	if (i < GB_LOOPBACK_HIST_BUCKETS - 1)
+		val = gb_loopback_hist_value(i + 1) - 1;
+	else
+		val = gb_loopback_hist_value(i);
+
+	return val;
+}
+
+static int gb_loopback_operation_sync(struct gb_loopback_thread *thread,
+				      int type, void *request, int request_size,
+				      void *response, int response_size)
+{
+	struct gb_loopback *gb = thread->gb;
+	struct gb_operation *operation;
+	ktime_t ts, te;
+	int ret;
+
+	ts = gb_loopback_start_time(thread);
+	operation = gb_operation_create(gb->connection, type, request_size,
+					response_size, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	if (request_size)
+		memcpy(operation->request->payload, request, request_size);
+
+	ret = gb_operation_request_send_sync(operation);
+	thread->sample.ts = ts;
+	thread->sample.te = ktime_get();
+	thread->sample.operation_id = operation->id;
+	if (ret) {
+		dev_err(&gb->connection->bundle->dev,
+			"synchronous operation failed: %d\n", ret);
+		goto out_put_operation;
+	} else {
+		if (response_size == operation->response->payload_size) {
+			memcpy(response, operation->response->payload,
+			       response_size);
+		} else {
+			dev_err(&gb->connection->bundle->dev,
+				"response size %zu expected %d\n",
+				operation->response->payload_size,
+				response_size);
+			ret = -EINVAL;
+			goto out_put_operation;
+		}
+	}
+
+	te = thread->sample.te;
+
+	/* Calculate the total time the message took */
+	thread->sample.elapsed_nsecs = gb_loopback_calc_latency(ts, te);
+
+out_put_operation:
+	gb_operation_put(operation);
+
+	return ret;
+}
+
+/* Return an operation to the pool once nobody uses it anymore */
+static void __gb_loopback_async_operation_destroy(struct kref *kref)
+{
+	struct gb_loopback_async_operation *op_async;
+	struct gb_loopback *gb;
+
+	unsigned long flags;
+
+	op_async = container_of(kref, struct gb_loopback_async_operation, kref);
+	gb = op_async->gb;
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	list_add(&op_async->pool_entry, &gb->op_pool);
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+	atomic_dec(&gb->outstanding_operations);
+	wake_up(&gb->wq_completion);
+}
+
+static void gb_loopback_async_operation_get(struct gb_loopback_async_operation
+					    *op_async)
+{
+	kref_get(&op_async->kref);
+}
+
+static void gb_loopback_async_operation_put(struct gb_loopback_async_operation
+					    *op_async)
+{
+	kref_put(&op_async->kref, __gb_loopback_async_operation_destroy);
 }
 
 static void gb_loopback_async_wait_all(struct gb_loopback *gb)
@@ -500,49 +1285,46 @@ static void gb_loopback_async_wait_all(struct gb_loopback *gb)
 		   !atomic_read(&gb->outstanding_operations));
 }
 
+/*
+ * The entry stays valid while the callback runs: either the reference of
+ * the pending operation is still held, or the timeout work holds one until
+ * its cancellation of the operation has waited for us.
+ */
 static void gb_loopback_async_operation_callback(struct gb_operation *operation)
 {
 	struct gb_loopback_async_operation *op_async;
 	struct gb_loopback *gb;
-	struct timeval te;
-	bool err = false;
-
-	do_gettimeofday(&te);
-	op_async = gb_loopback_operation_find(operation->id);
-	if (!op_async)
-		return;
+	ktime_t te;
+	bool err;
+	int result;
 
+	te = ktime_get();
+	op_async = gb_operation_get_data(operation);
 	gb = op_async->gb;
-	mutex_lock(&gb->mutex);
 
-	if (!op_async->pending || gb_operation_result(operation)) {
-		err = true;
-	} else {
-		if (op_async->completion)
-			if (op_async->completion(op_async))
-				err = true;
-	}
+	dev_dbg(&gb->connection->bundle->dev, "complete operation %d\n",
+		operation->id);
 
-	if (!err) {
-		gb_loopback_push_latency_ts(gb, &op_async->ts, &te);
-		gb->elapsed_nsecs = gb_loopback_calc_latency(&op_async->ts,
-							     &te);
-	}
+	/* Whoever clears pending first, us or the timeout, does the sums */
+	if (!atomic_xchg(&op_async->pending, 0))
+		return;
 
-	if (op_async->pending) {
-		if (err)
-			gb->error++;
-		gb->iteration_count++;
-		op_async->pending = false;
-		del_timer_sync(&op_async->timer);
-		gb_loopback_async_operation_put(op_async);
-		gb_loopback_calculate_stats(gb, err);
-	}
-	mutex_unlock(&gb->mutex);
+	del_timer_sync(&op_async->timer);
 
-	dev_dbg(&gb->connection->bundle->dev, "complete operation %d\n",
-		operation->id);
+	result = gb_operation_result(operation);
+	if (!result && op_async->completion)
+		result = op_async->completion(op_async);
+	err = !!result;
+
+	op_async->sample.te = te;
+	op_async->sample.operation_id = operation->id;
+	op_async->sample.result = result;
+	if (!err)
+		op_async->sample.elapsed_nsecs =
+			gb_loopback_calc_latency(op_async->ts, te);
 
+	if (!op_async->warmup)
+		gb_loopback_calculate_stats(gb, &op_async->sample, err);
 	gb_loopback_async_operation_put(op_async);
 }
 
@@ -556,16 +1338,17 @@ static void gb_loopback_async_operation_work(struct work_struct *work)
 	gb = op_async->gb;
 	operation = op_async->operation;
 
-	mutex_lock(&gb->mutex);
-	if (op_async->pending) {
-		gb->requests_timedout++;
-		gb->error++;
-		gb->iteration_count++;
-		op_async->pending = false;
+	if (atomic_xchg(&op_async->pending, 0)) {
+		if (!op_async->warmup) {
+			op_async->sample.te = ktime_get();
+			op_async->sample.operation_id = operation->id;
+			op_async->sample.result = -ETIMEDOUT;
+			atomic_inc(&gb->requests_timedout);
+			gb_loopback_calculate_stats(gb, &op_async->sample,
+						    true);
+		}
 		gb_loopback_async_operation_put(op_async);
-		gb_loopback_calculate_stats(gb, true);
 	}
-	mutex_unlock(&gb->mutex);
 
 	dev_dbg(&gb->connection->bundle->dev, "timeout operation %d\n",
 		operation->id);
@@ -574,79 +1357,354 @@ static void gb_loopback_async_operation_work(struct work_struct *work)
 	gb_loopback_async_operation_put(op_async);
 }
 
+/*
+ * The reference of the pending operation is held while the timer runs, as
+ * the callback only drops it after del_timer_sync().
+ */
 static void gb_loopback_async_operation_timeout(unsigned long data)
 {
-	struct gb_loopback_async_operation *op_async;
-	u16 id = data;
+	struct gb_loopback_async_operation *op_async = (void *)data;
 
-	op_async = gb_loopback_operation_find(id);
-	if (!op_async) {
-		pr_err("operation %d not found - time out ?\n", id);
-		return;
-	}
+	gb_loopback_async_operation_get(op_async);
 	schedule_work(&op_async->work);
 }
 
-static int gb_loopback_async_operation(struct gb_loopback *gb, int type,
-				       void *request, int request_size,
-				       int response_size,
-				       void *completion)
+static u32 gb_loopback_async_pool_size(struct gb_loopback *gb)
+{
+	if (gb->outstanding_operations_max)
+		return gb->outstanding_operations_max;
+
+	return GB_LOOPBACK_ASYNC_POOL_DEFAULT;
+}
+
+/*
+ * Fill the payload of a transfer request for the given verification mode.
+ * The CRC32C of the payload is computed chunk by chunk as it is generated,
+ * while still in the cache, and returned for GB_LOOPBACK_VERIFY_CRC32C.
+ */
+static u32 gb_loopback_fill(u32 verify, u8 *data, u32 len)
+{
+	struct rnd_state state;
+	u32 crc = ~0;
+	u32 n;
+
+	if (verify == GB_LOOPBACK_VERIFY_NONE ||
+	    verify == GB_LOOPBACK_VERIFY_FULL) {
+		memset(data, 0x5A, len);
+		return 0;
+	}
+
+	prandom_seed_state(&state, ((u64)prandom_u32() << 32) | prandom_u32());
+	while (len) {
+		n = min_t(u32, len, GB_LOOPBACK_FILL_CHUNK);
+		prandom_bytes_state(&state, data, n);
+		if (verify == GB_LOOPBACK_VERIFY_CRC32C)
+			crc = crc32c(crc, data, n);
+		data += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+/* Check the payload echoed back by a transfer operation */
+static bool gb_loopback_verify(u32 verify, u32 crc, const u8 *request,
+			       const u8 *response, u32 len)
+{
+	u32 offset;
+	unsigned int i;
+
+	switch (verify) {
+	case GB_LOOPBACK_VERIFY_NONE:
+		return true;
+	case GB_LOOPBACK_VERIFY_SAMPLED:
+		if (len <= GB_LOOPBACK_VERIFY_SAMPLES *
+			   GB_LOOPBACK_VERIFY_SAMPLE_SIZE)
+			break;
+		/* Evenly spread windows, including both ends of the payload */
+		for (i = 0; i < GB_LOOPBACK_VERIFY_SAMPLES; i++) {
+			offset = (len - GB_LOOPBACK_VERIFY_SAMPLE_SIZE) * i /
+				 (GB_LOOPBACK_VERIFY_SAMPLES - 1);
+			if (memcmp(request + offset, response + offset,
+				   GB_LOOPBACK_VERIFY_SAMPLE_SIZE))
+				return false;
+		}
+		return true;
+	case GB_LOOPBACK_VERIFY_CRC32C:
+		return crc32c(~0, response, len) == crc;
+	}
+
+	return !memcmp(request, response, len);
+}
+
+/*
+ * Build (or rebuild) the operation of a pooled entry for the given test,
+ * with its request payload filled in once and for all.
+ */
+static int gb_loopback_async_prepare(struct gb_loopback_async_operation
+				     *op_async, int type, u32 len)
+{
+	struct gb_loopback *gb = op_async->gb;
+	struct gb_loopback_transfer_request *request;
+	struct gb_operation *operation = op_async->operation;
+	size_t request_size = 0;
+	size_t response_size = 0;
+
+	if (operation && op_async->type == type && op_async->len == len &&
+	    !gb_operation_reinit(operation))
+		return 0;
+
+	if (operation) {
+		gb_operation_put(operation);
+		op_async->operation = NULL;
+	}
+
+	switch (type) {
+	case GB_LOOPBACK_TYPE_TRANSFER:
+		response_size = len +
+			sizeof(struct gb_loopback_transfer_response);
+		/* fall through */
+	case GB_LOOPBACK_TYPE_SINK:
+		request_size = len + sizeof(*request);
+		break;
+	}
+
+	operation = gb_operation_create(gb->connection, type, request_size,
+					response_size, GFP_KERNEL);
+	if (!operation)
+		return -ENOMEM;
+
+	if (request_size) {
+		request = operation->request->payload;
+		request->len = cpu_to_le32(len);
+		memset(request->data, 0x5A, len);
+	}
+
+	gb_operation_set_data(operation, op_async);
+	op_async->operation = operation;
+	op_async->type = type;
+	op_async->len = len;
+
+	return 0;
+}
+
+static void gb_loopback_async_free(struct gb_loopback_async_operation
+				   *op_async)
+{
+	if (op_async->operation)
+		gb_operation_put(op_async->operation);
+	kfree(op_async);
+}
+
+static struct gb_loopback_async_operation *
+gb_loopback_async_alloc(struct gb_loopback *gb)
 {
 	struct gb_loopback_async_operation *op_async;
-	struct gb_operation *operation;
-	int ret;
-	unsigned long flags;
 
 	op_async = kzalloc(sizeof(*op_async), GFP_KERNEL);
 	if (!op_async)
-		return -ENOMEM;
+		return NULL;
 
+	op_async->gb = gb;
 	INIT_WORK(&op_async->work, gb_loopback_async_operation_work);
 	init_timer(&op_async->timer);
-	kref_init(&op_async->kref);
 
-	operation = gb_operation_create(gb->connection, type, request_size,
-					response_size, GFP_KERNEL);
-	if (!operation) {
-		kfree(op_async);
-		return -ENOMEM;
+	return op_async;
+}
+
+/*
+ * Take an idle entry from the pool, growing the pool up to its size. Sets
+ * *op_async to NULL if a new entry has to be allocated. Entries beyond the
+ * pool size (after outstanding_operations_max was lowered) are dropped.
+ */
+static bool gb_loopback_async_pool_get(struct gb_loopback *gb,
+			struct gb_loopback_async_operation **op_async)
+{
+	struct gb_loopback_async_operation *entry = NULL;
+	unsigned long flags;
+	bool ret = true;
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	while (!list_empty(&gb->op_pool)) {
+		entry = list_first_entry(&gb->op_pool,
+					 struct gb_loopback_async_operation,
+					 pool_entry);
+		list_del(&entry->pool_entry);
+		if (gb->op_pool_count <= gb_loopback_async_pool_size(gb))
+			break;
+
+		gb->op_pool_count--;
+		spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+		gb_loopback_async_free(entry);
+		entry = NULL;
+		spin_lock_irqsave(&gb->op_pool_lock, flags);
 	}
 
-	if (request_size)
-		memcpy(operation->request->payload, request, request_size);
+	if (!entry) {
+		if (gb->op_pool_count < gb_loopback_async_pool_size(gb))
+			gb->op_pool_count++;
+		else
+			ret = false;
+	}
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
 
-	op_async->gb = gb;
-	op_async->operation = operation;
-	op_async->completion = completion;
+	*op_async = entry;
 
-	spin_lock_irqsave(&gb_dev.lock, flags);
-	list_add_tail(&op_async->entry, &gb_dev.list_op_async);
-	spin_unlock_irqrestore(&gb_dev.lock, flags);
+	return ret;
+}
+
+static void gb_loopback_async_pool_put(struct gb_loopback_async_operation
+				       *op_async)
+{
+	struct gb_loopback *gb = op_async->gb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	list_add(&op_async->pool_entry, &gb->op_pool);
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+	wake_up(&gb->wq_completion);
+}
+
+static void gb_loopback_async_pool_uncharge(struct gb_loopback *gb)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	gb->op_pool_count--;
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+	wake_up(&gb->wq_completion);
+}
+
+/*
+ * Fill the pool with operations built for the test about to start, so that
+ * the first iterations do not pay for allocation either. Entries still in
+ * flight from a previous test are rebuilt when next used.
+ */
+static void gb_loopback_async_pool_fill(struct gb_loopback *gb)
+{
+	struct gb_loopback_async_operation *op_async;
+	LIST_HEAD(idle);
+	unsigned long flags;
+	u32 size = gb_loopback_async_pool_size(gb);
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	list_splice_init(&gb->op_pool, &idle);
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+
+	list_for_each_entry(op_async, &idle, pool_entry)
+		gb_loopback_async_prepare(op_async, gb->type, gb->size);
+
+	for (;;) {
+		spin_lock_irqsave(&gb->op_pool_lock, flags);
+		if (gb->op_pool_count >= size) {
+			spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+			break;
+		}
+		gb->op_pool_count++;
+		spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+
+		op_async = gb_loopback_async_alloc(gb);
+		if (op_async &&
+		    gb_loopback_async_prepare(op_async, gb->type, gb->size)) {
+			gb_loopback_async_free(op_async);
+			op_async = NULL;
+		}
+		if (!op_async) {
+			gb_loopback_async_pool_uncharge(gb);
+			break;
+		}
+		list_add_tail(&op_async->pool_entry, &idle);
+	}
+
+	spin_lock_irqsave(&gb->op_pool_lock, flags);
+	list_splice(&idle, &gb->op_pool);
+	spin_unlock_irqrestore(&gb->op_pool_lock, flags);
+}
+
+/* Called once no operation is in flight anymore */
+static void gb_loopback_async_pool_destroy(struct gb_loopback *gb)
+{
+	struct gb_loopback_async_operation *op_async, *tmp;
+
+	list_for_each_entry_safe(op_async, tmp, &gb->op_pool, pool_entry) {
+		list_del(&op_async->pool_entry);
+		gb_loopback_async_free(op_async);
+	}
+	gb->op_pool_count = 0;
+}
+
+static int gb_loopback_async_operation(struct gb_loopback_thread *thread,
+				       int type, u32 len, void *completion)
+{
+	struct gb_loopback *gb = thread->gb;
+	struct gb_loopback_async_operation *op_async;
+	struct gb_loopback_transfer_request *request;
+	struct gb_operation *operation;
+	bool ready = false;
+	int ret;
+
+	/* Wait for an idle pool entry, or room to allocate one */
+	wait_event_interruptible(gb->wq_completion,
+			(ready = gb_loopback_async_pool_get(gb, &op_async)) ||
+			kthread_should_stop());
+	if (!ready)
+		return -EINTR;
+
+	if (!op_async) {
+		op_async = gb_loopback_async_alloc(gb);
+		if (!op_async) {
+			gb_loopback_async_pool_uncharge(gb);
+			return -ENOMEM;
+		}
+	}
+
+	ret = gb_loopback_async_prepare(op_async, type, len);
+	if (ret) {
+		gb_loopback_async_pool_put(op_async);
+		return ret;
+	}
+
+	operation = op_async->operation;
+	op_async->thread = thread;
+	op_async->warmup = thread->warmup;
+	op_async->verify = thread->verify;
+	memset(&op_async->sample, 0, sizeof(op_async->sample));
+	op_async->sample.type = type;
+	op_async->sample.len = len;
+	op_async->sample.profile_class = thread->profile_class;
+	if (type == GB_LOOPBACK_TYPE_TRANSFER &&
+	    thread->verify != GB_LOOPBACK_VERIFY_NONE &&
+	    thread->verify != GB_LOOPBACK_VERIFY_FULL) {
+		request = operation->request->payload;
+		op_async->crc = gb_loopback_fill(thread->verify, request->data,
+						 len);
+	}
+	op_async->completion = completion;
+	kref_init(&op_async->kref);
 
-	do_gettimeofday(&op_async->ts);
-	op_async->pending = true;
+	op_async->ts = gb_loopback_start_time(thread);
+	op_async->sample.ts = op_async->ts;
+	atomic_set(&op_async->pending, 1);
 	atomic_inc(&gb->outstanding_operations);
-	mutex_lock(&gb->mutex);
-	ret = gb_operation_request_send(operation,
-					gb_loopback_async_operation_callback,
-					GFP_KERNEL);
-	if (ret)
-		goto error;
 
+	/* Arm the timeout first, the response may well beat us back */
 	op_async->timer.function = gb_loopback_async_operation_timeout;
 	op_async->timer.expires = jiffies + gb->jiffy_timeout;
-	op_async->timer.data = (unsigned long)operation->id;
+	op_async->timer.data = (unsigned long)op_async;
 	add_timer(&op_async->timer);
 
-	goto done;
-error:
-	gb_loopback_async_operation_put(op_async);
-done:
-	mutex_unlock(&gb->mutex);
+	ret = gb_operation_request_send(operation,
+					gb_loopback_async_operation_callback,
+					GFP_KERNEL);
+	if (ret && atomic_xchg(&op_async->pending, 0)) {
+		del_timer_sync(&op_async->timer);
+		gb_loopback_async_operation_put(op_async);
+	}
+
 	return ret;
 }
 
-static int gb_loopback_sync_sink(struct gb_loopback *gb, u32 len)
+static int gb_loopback_sync_sink(struct gb_loopback_thread *thread, u32 len)
 {
 	struct gb_loopback_transfer_request *request;
 	int retval;
@@ -656,21 +1714,24 @@ static int gb_loopback_sync_sink(struct gb_loopback *gb, u32 len)
 		return -ENOMEM;
 
 	request->len = cpu_to_le32(len);
-	retval = gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_SINK,
+	retval = gb_loopback_operation_sync(thread, GB_LOOPBACK_TYPE_SINK,
 					    request, len + sizeof(*request),
 					    NULL, 0);
 	kfree(request);
 	return retval;
 }
 
-static int gb_loopback_sync_transfer(struct gb_loopback *gb, u32 len)
+static int gb_loopback_sync_transfer(struct gb_loopback_thread *thread,
+				     u32 len)
 {
+	struct gb_loopback *gb = thread->gb;
 	struct gb_loopback_transfer_request *request;
 	struct gb_loopback_transfer_response *response;
 	int retval;
+	u32 crc;
 
-	gb->apbridge_latency_ts = 0;
-	gb->gpbridge_latency_ts = 0;
+	thread->sample.apbridge_latency_ts = 0;
+	thread->sample.gpbridge_latency_ts = 0;
 
 	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
 	if (!request)
@@ -681,22 +1742,25 @@ static int gb_loopback_sync_transfer(struct gb_loopback *gb, u32 len)
 		return -ENOMEM;
 	}
 
-	memset(request->data, 0x5A, len);
+	crc = gb_loopback_fill(thread->verify, request->data, len);
 
 	request->len = cpu_to_le32(len);
-	retval = gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_TRANSFER,
+	retval = gb_loopback_operation_sync(thread, GB_LOOPBACK_TYPE_TRANSFER,
 					    request, len + sizeof(*request),
 					    response, len + sizeof(*response));
 	if (retval)
 		goto gb_error;
 
-	if (memcmp(request->data, response->data, len)) {
+	if (!gb_loopback_verify(thread->verify, crc, request->data,
+				response->data, len)) {
 		dev_err(&gb->connection->bundle->dev,
 			"Loopback Data doesn't match\n");
 		retval = -EREMOTEIO;
 	}
-	gb->apbridge_latency_ts = (u32)__le32_to_cpu(response->reserved0);
-	gb->gpbridge_latency_ts = (u32)__le32_to_cpu(response->reserved1);
+	thread->sample.apbridge_latency_ts =
+		(u32)__le32_to_cpu(response->reserved0);
+	thread->sample.gpbridge_latency_ts =
+		(u32)__le32_to_cpu(response->reserved1);
 
 gb_error:
 	kfree(request);
@@ -705,27 +1769,16 @@ gb_error:
 	return retval;
 }
 
-static int gb_loopback_sync_ping(struct gb_loopback *gb)
+static int gb_loopback_sync_ping(struct gb_loopback_thread *thread)
 {
-	return gb_loopback_operation_sync(gb, GB_LOOPBACK_TYPE_PING,
+	return gb_loopback_operation_sync(thread, GB_LOOPBACK_TYPE_PING,
 					  NULL, 0, NULL, 0);
 }
 
-static int gb_loopback_async_sink(struct gb_loopback *gb, u32 len)
+static int gb_loopback_async_sink(struct gb_loopback_thread *thread, u32 len)
 {
-	struct gb_loopback_transfer_request *request;
-	int retval;
-
-	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
-	if (!request)
-		return -ENOMEM;
-
-	request->len = cpu_to_le32(len);
-	retval = gb_loopback_async_operation(gb, GB_LOOPBACK_TYPE_SINK,
-					     request, len + sizeof(*request),
-					     0, NULL);
-	kfree(request);
-	return retval;
+	return gb_loopback_async_operation(thread, GB_LOOPBACK_TYPE_SINK, len,
+					   NULL);
 }
 
 static int gb_loopback_async_transfer_complete(
@@ -744,58 +1797,42 @@ static int gb_loopback_async_transfer_complete(
 	response = operation->response->payload;
 	len = le32_to_cpu(request->len);
 
-	if (memcmp(request->data, response->data, len)) {
+	if (!gb_loopback_verify(op_async->verify, op_async->crc, request->data,
+				response->data, len)) {
 		dev_err(&gb->connection->bundle->dev,
 			"Loopback Data doesn't match operation id %d\n",
 			operation->id);
 		retval = -EREMOTEIO;
 	} else {
-		gb->apbridge_latency_ts =
+		op_async->sample.apbridge_latency_ts =
 			(u32)__le32_to_cpu(response->reserved0);
-		gb->gpbridge_latency_ts =
+		op_async->sample.gpbridge_latency_ts =
 			(u32)__le32_to_cpu(response->reserved1);
 	}
 
 	return retval;
 }
 
-static int gb_loopback_async_transfer(struct gb_loopback *gb, u32 len)
+static int gb_loopback_async_transfer(struct gb_loopback_thread *thread,
+				      u32 len)
 {
-	struct gb_loopback_transfer_request *request;
-	int retval, response_len;
-
-	request = kmalloc(len + sizeof(*request), GFP_KERNEL);
-	if (!request)
-		return -ENOMEM;
-
-	memset(request->data, 0x5A, len);
-
-	request->len = cpu_to_le32(len);
-	response_len = sizeof(struct gb_loopback_transfer_response);
-	retval = gb_loopback_async_operation(gb, GB_LOOPBACK_TYPE_TRANSFER,
-					     request, len + sizeof(*request),
-					     len + response_len,
-					     gb_loopback_async_transfer_complete);
-	if (retval)
-		goto gb_error;
-
-gb_error:
-	kfree(request);
-	return retval;
+	return gb_loopback_async_operation(thread, GB_LOOPBACK_TYPE_TRANSFER,
+					   len,
+					   gb_loopback_async_transfer_complete);
 }
 
-static int gb_loopback_async_ping(struct gb_loopback *gb)
+static int gb_loopback_async_ping(struct gb_loopback_thread *thread)
 {
-	return gb_loopback_async_operation(gb, GB_LOOPBACK_TYPE_PING,
-					   NULL, 0, 0, NULL);
+	return gb_loopback_async_operation(thread, GB_LOOPBACK_TYPE_PING, 0,
+					   NULL);
 }
 
-static int gb_loopback_request_handler(struct gb_operation *operation)
+static int gb_loopback_request_serve(struct gb_loopback *gb,
+				     struct gb_operation *operation)
 {
-	struct gb_connection *connection = operation->connection;
 	struct gb_loopback_transfer_request *request;
 	struct gb_loopback_transfer_response *response;
-	struct device *dev = &connection->bundle->dev;
+	struct device *dev = &gb->connection->bundle->dev;
 	size_t len;
 
 	/* By convention, the AP initiates the version operation */
@@ -838,28 +1875,328 @@ static int gb_loopback_request_handler(struct gb_operation *operation)
 	}
 }
 
+static void gb_loopback_responder_reset(struct gb_loopback *gb)
+{
+	struct gb_loopback_stats reset = {
+		.min = U32_MAX,
+	};
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->responder_lock, flags);
+	gb->responder.responder_requests_per_second = reset;
+	gb->responder.responder_queue_latency = reset;
+	gb->responder.responder_handler_latency = reset;
+	gb->responder.responder_response_latency = reset;
+	gb->responder_ts = ktime_set(0, 0);
+	gb->responder_window = 0;
+	gb->responder_requests = 0;
+	spin_unlock_irqrestore(&gb->responder_lock, flags);
+}
+
+static void gb_loopback_update_stats(struct gb_loopback_stats *stats,
+				     u32 val);
+static void gb_loopback_update_stats_window(struct gb_loopback_stats *stats,
+					    u64 val, u32 count);
+
+/* Called from the connection workqueue, one request at a time */
+static void gb_loopback_responder_update(struct gb_loopback *gb,
+					 struct gb_operation *operation,
+					 ktime_t ts, ktime_t te)
+{
+	unsigned long flags;
+	u64 nlat;
+
+	spin_lock_irqsave(&gb->responder_lock, flags);
+	gb->responder_requests++;
+	gb_loopback_update_stats(&gb->responder.responder_queue_latency,
+		gb_loopback_nsec_to_usec_latency(
+			gb_loopback_calc_latency(operation->received, ts)));
+	gb_loopback_update_stats(&gb->responder.responder_handler_latency,
+		gb_loopback_nsec_to_usec_latency(
+			gb_loopback_calc_latency(ts, te)));
+
+	/* Requests per second, over windows opened by the first request */
+	if (!ktime_to_ns(gb->responder_ts))
+		gb->responder_ts = operation->received;
+	gb->responder_window++;
+	nlat = gb_loopback_calc_latency(gb->responder_ts, te);
+	if (nlat >= NSEC_PER_SEC) {
+		gb_loopback_update_stats_window(
+			&gb->responder.responder_requests_per_second,
+			(u64)gb->responder_window * USEC_PER_SEC,
+			gb_loopback_nsec_to_usec_latency(nlat));
+		gb->responder_ts = te;
+		gb->responder_window = 0;
+	}
+	spin_unlock_irqrestore(&gb->responder_lock, flags);
+}
+
+/* Called once the response has been sent, possibly in atomic context */
+static void gb_loopback_response_sent(struct gb_operation *operation)
+{
+	struct gb_loopback *gb = gb_connection_get_data(operation->connection);
+	unsigned long flags;
+	u32 lat;
+
+	lat = gb_loopback_nsec_to_usec_latency(
+		gb_loopback_calc_latency(operation->handled, ktime_get()));
+
+	spin_lock_irqsave(&gb->responder_lock, flags);
+	gb_loopback_update_stats(&gb->responder.responder_response_latency,
+				 lat);
+	spin_unlock_irqrestore(&gb->responder_lock, flags);
+}
+
+static int gb_loopback_request_handler(struct gb_operation *operation)
+{
+	struct gb_loopback *gb = gb_connection_get_data(operation->connection);
+	ktime_t ts, te;
+	int ret;
+
+	ts = ktime_get();
+	ret = gb_loopback_request_serve(gb, operation);
+	te = ktime_get();
+
+	gb_loopback_responder_update(gb, operation, ts, te);
+	operation->callback = gb_loopback_response_sent;
+
+	return ret;
+}
+
+/* The stand-in host device sends nothing, responses are completed as is */
+#define GB_LOOPBACK_INBOUND_CPORT	1
+
+static struct gb_loopback *gb_loopback_hd_to_gb(struct gb_host_device *hd)
+{
+	return *(struct gb_loopback **)hd->hd_priv;
+}
+
+static int gb_loopback_hd_message_send(struct gb_host_device *hd,
+				       u16 cport_id,
+				       struct gb_message *message,
+				       gfp_t gfp_mask)
+{
+	struct gb_loopback *gb = gb_loopback_hd_to_gb(hd);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb->inbound_lock, flags);
+	list_add_tail(&message->hc_links, &gb->inbound_sent);
+	spin_unlock_irqrestore(&gb->inbound_lock, flags);
+
+	schedule_work(&gb->inbound_work);
+
+	return 0;
+}
+
+static void gb_loopback_hd_message_cancel(struct gb_message *message)
+{
+	struct gb_host_device *hd = message->operation->connection->hd;
+	struct gb_loopback *gb = gb_loopback_hd_to_gb(hd);
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&gb->inbound_lock, flags);
+	queued = !list_empty(&message->hc_links);
+	if (queued)
+		list_del_init(&message->hc_links);
+	spin_unlock_irqrestore(&gb->inbound_lock, flags);
+
+	if (queued) {
+		atomic_dec(&gb->inbound_inflight);
+		greybus_message_sent(hd, message, -ECANCELED);
+	}
+}
+
+static struct gb_hd_driver gb_loopback_hd_driver = {
+	.hd_priv_size	= sizeof(struct gb_loopback *),
+	.message_send	= gb_loopback_hd_message_send,
+	.message_cancel	= gb_loopback_hd_message_cancel,
+};
+
+/* Inject one request, as if the stand-in host device had received it */
+static void gb_loopback_inbound_send(struct gb_loopback *gb)
+{
+	struct gb_operation_msg_hdr *header = gb->inbound_request;
+	struct gb_loopback_transfer_request *request;
+	int type = READ_ONCE(gb->inbound_type);
+	size_t size = sizeof(*header);
+	unsigned long flags;
+
+	if (!type)
+		return;
+
+	spin_lock_irqsave(&gb->inbound_lock, flags);
+	if (type != GB_LOOPBACK_TYPE_PING) {
+		request = (void *)(header + 1);
+		request->len = cpu_to_le32(gb->inbound_size);
+		size += sizeof(*request) + gb->inbound_size;
+	}
+
+	/* Operation id 0 is reserved for unidirectional requests */
+	if (!++gb->inbound_operation_id)
+		gb->inbound_operation_id++;
+	header->size = cpu_to_le16(size);
+	header->operation_id = cpu_to_le16(gb->inbound_operation_id);
+	header->type = type;
+	header->result = 0;
+
+	atomic_inc(&gb->inbound_inflight);
+	greybus_data_rcvd(gb->inbound_hd, GB_LOOPBACK_INBOUND_CPORT,
+			  (u8 *)header, size);
+	spin_unlock_irqrestore(&gb->inbound_lock, flags);
+}
+
+static void gb_loopback_inbound_work(struct work_struct *work)
+{
+	struct gb_loopback *gb = container_of(work, struct gb_loopback,
+					      inbound_work);
+	struct gb_message *message;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&gb->inbound_lock, flags);
+		message = list_first_entry_or_null(&gb->inbound_sent,
+						   struct gb_message,
+						   hc_links);
+		if (message)
+			list_del_init(&message->hc_links);
+		spin_unlock_irqrestore(&gb->inbound_lock, flags);
+
+		if (!message)
+			break;
+
+		atomic_dec(&gb->inbound_inflight);
+		greybus_message_sent(gb->inbound_hd, message, 0);
+		gb_loopback_inbound_send(gb);
+	}
+}
+
+/* Called with gb->mutex held */
+static int gb_loopback_inbound_create(struct gb_loopback *gb)
+{
+	struct gb_connection *connection;
+	struct gb_host_device *hd;
+	size_t size;
+	int retval;
+
+	size = sizeof(struct gb_operation_msg_hdr) +
+	       sizeof(struct gb_loopback_transfer_request) + gb_dev.size_max;
+	gb->inbound_request = kzalloc(size, GFP_KERNEL);
+	if (!gb->inbound_request)
+		return -ENOMEM;
+
+	hd = gb_hd_create(&gb_loopback_hd_driver, gb->dev,
+			  GB_OPERATION_MESSAGE_SIZE_MAX,
+			  GB_LOOPBACK_INBOUND_CPORT + 1);
+	if (IS_ERR(hd)) {
+		retval = PTR_ERR(hd);
+		goto err_free_request;
+	}
+	*(struct gb_loopback **)hd->hd_priv = gb;
+	gb->inbound_hd = hd;
+
+	connection = gb_connection_create_static(hd, GB_LOOPBACK_INBOUND_CPORT,
+						 gb_loopback_request_handler);
+	if (IS_ERR(connection)) {
+		retval = PTR_ERR(connection);
+		goto err_hd_put;
+	}
+	gb_connection_set_data(connection, gb);
+
+	retval = gb_connection_enable(connection);
+	if (retval)
+		goto err_connection_destroy;
+	gb->inbound_connection = connection;
+
+	return 0;
+
+err_connection_destroy:
+	gb_connection_destroy(connection);
+err_hd_put:
+	gb_hd_put(hd);
+	gb->inbound_hd = NULL;
+err_free_request:
+	kfree(gb->inbound_request);
+	gb->inbound_request = NULL;
+
+	return retval;
+}
+
+static void gb_loopback_inbound_destroy(struct gb_loopback *gb)
+{
+	if (!gb->inbound_hd)
+		return;
+
+	WRITE_ONCE(gb->inbound_type, 0);
+	gb_connection_disable(gb->inbound_connection);
+	flush_work(&gb->inbound_work);
+	gb_connection_destroy(gb->inbound_connection);
+	gb_hd_put(gb->inbound_hd);
+	kfree(gb->inbound_request);
+}
+
+/*
+ * Start injecting requests of the given type, or stop with type 0, in which
+ * case the requests in flight are left to complete. Called with gb->mutex
+ * held.
+ */
+static int gb_loopback_inbound_start(struct gb_loopback *gb, int type)
+{
+	u32 outstanding = max(gb->inbound_outstanding, 1U);
+	unsigned int i;
+	int retval;
+
+	if (!type) {
+		WRITE_ONCE(gb->inbound_type, 0);
+		return 0;
+	}
+
+	if (!gb->inbound_hd) {
+		retval = gb_loopback_inbound_create(gb);
+		if (retval)
+			return retval;
+	}
+
+	gb_loopback_responder_reset(gb);
+	WRITE_ONCE(gb->inbound_type, type);
+	for (i = atomic_read(&gb->inbound_inflight); i < outstanding; i++)
+		gb_loopback_inbound_send(gb);
+
+	return 0;
+}
+
 static void gb_loopback_reset_stats(struct gb_loopback *gb)
 {
 	struct gb_loopback_stats reset = {
 		.min = U32_MAX,
 	};
+	struct gb_loopback_cpu *stats;
+	unsigned int cpu, i;
 
 	/* Reset per-connection stats */
-	memcpy(&gb->latency, &reset,
-	       sizeof(struct gb_loopback_stats));
+	spin_lock(&gb->window_lock);
 	memcpy(&gb->throughput, &reset,
 	       sizeof(struct gb_loopback_stats));
 	memcpy(&gb->requests_per_second, &reset,
 	       sizeof(struct gb_loopback_stats));
-	memcpy(&gb->apbridge_unipro_latency, &reset,
-	       sizeof(struct gb_loopback_stats));
-	memcpy(&gb->gpbridge_firmware_latency, &reset,
-	       sizeof(struct gb_loopback_stats));
 
 	/* Should be initialized at least once per transaction set */
-	gb->apbridge_latency_ts = 0;
-	gb->gpbridge_latency_ts = 0;
-	memset(&gb->ts, 0, sizeof(struct timeval));
+	gb->ts = ktime_set(0, 0);
+	spin_unlock(&gb->window_lock);
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(gb->stats, cpu);
+		memset(stats, 0, sizeof(*stats));
+		memcpy(&stats->latency, &reset,
+		       sizeof(struct gb_loopback_stats));
+		memcpy(&stats->apbridge_unipro_latency, &reset,
+		       sizeof(struct gb_loopback_stats));
+		memcpy(&stats->gpbridge_firmware_latency, &reset,
+		       sizeof(struct gb_loopback_stats));
+		for (i = 0; i < GB_LOOPBACK_PROFILE_CLASSES; i++)
+			memcpy(&stats->class_latency[i], &reset,
+			       sizeof(struct gb_loopback_stats));
+	}
 }
 
 static void gb_loopback_update_stats(struct gb_loopback_stats *stats, u32 val)
@@ -885,83 +2222,255 @@ static void gb_loopback_update_stats_window(struct gb_loopback_stats *stats,
 		stats->max = val;
 }
 
-static void gb_loopback_requests_update(struct gb_loopback *gb, u32 latency)
+static void gb_loopback_requests_update(struct gb_loopback *gb, u32 count,
+					u32 latency)
 {
-	u64 req = gb->requests_completed * USEC_PER_SEC;
+	u64 req = (u64)count * USEC_PER_SEC;
 
 	gb_loopback_update_stats_window(&gb->requests_per_second, req, latency);
 }
 
-static void gb_loopback_throughput_update(struct gb_loopback *gb, u32 latency)
+/* Bytes moved over the link by one request and its response */
+static u64 gb_loopback_request_bytes(int type, u32 len)
 {
-	u64 aggregate_size = sizeof(struct gb_operation_msg_hdr) * 2;
+	u64 size = sizeof(struct gb_operation_msg_hdr) * 2;
 
-	switch (gb->type) {
-	case GB_LOOPBACK_TYPE_PING:
-		break;
+	switch (type) {
 	case GB_LOOPBACK_TYPE_SINK:
-		aggregate_size += sizeof(struct gb_loopback_transfer_request) +
-				  gb->size;
+		size += sizeof(struct gb_loopback_transfer_request) + len;
 		break;
 	case GB_LOOPBACK_TYPE_TRANSFER:
-		aggregate_size += sizeof(struct gb_loopback_transfer_request) +
-				  sizeof(struct gb_loopback_transfer_response) +
-				  gb->size * 2;
+		size += sizeof(struct gb_loopback_transfer_request) +
+			sizeof(struct gb_loopback_transfer_response) +
+			len * 2;
 		break;
-	default:
+	}
+
+	return size;
+}
+
+static void gb_loopback_throughput_update(struct gb_loopback *gb, u64 bytes,
+					  u32 latency)
+{
+	u64 aggregate_size = bytes;
+
+	aggregate_size *= USEC_PER_SEC;
+	gb_loopback_update_stats_window(&gb->throughput, aggregate_size,
+					latency);
+}
+
+static struct gb_loopback_sample_record *
+gb_loopback_sample_record(struct gb_loopback_sample_ring *ring, u32 idx)
+{
+	return (void *)ring + ring->offset +
+	       (idx & (ring->nr - 1)) * ring->record_size;
+}
+
+/*
+ * Append a sample to the ring if somebody is reading it. Concurrent
+ * completions reserve their slot by moving head and commit it through seq,
+ * so records may be committed out of order but never torn.
+ */
+static void gb_loopback_sample_log(struct gb_loopback *gb,
+				   struct gb_loopback_sample *sample)
+{
+	struct gb_loopback_sample_ring *ring;
+	struct gb_loopback_sample_record *rec;
+	u32 head;
+
+	if (!smp_load_acquire(&gb->sample_reader))
 		return;
-	}
 
-	aggregate_size *= gb->requests_completed;
-	aggregate_size *= USEC_PER_SEC;
-	gb_loopback_update_stats_window(&gb->throughput, aggregate_size,
-					latency);
+	ring = gb->sample_ring;
+	do {
+		head = READ_ONCE(ring->head);
+		if (head - smp_load_acquire(&ring->tail) >= ring->nr) {
+			WRITE_ONCE(ring->lost,
+				   atomic_inc_return(&gb->samples_lost));
+			return;
+		}
+	} while (cmpxchg(&ring->head, head, head + 1) != head);
+
+	rec = gb_loopback_sample_record(ring, head);
+	rec->operation_id = sample->operation_id;
+	rec->type = sample->type;
+	rec->result = sample->result;
+	rec->size = sample->len;
+	rec->start_ns = ktime_to_ns(sample->ts);
+	rec->end_ns = ktime_to_ns(sample->te);
+	smp_store_release(&rec->seq, head + 1);
+
+	/* Order the commit against the check, see waitqueue_active() */
+	smp_mb();
+	if (waitqueue_active(&gb->sample_wq))
+		wake_up_interruptible(&gb->sample_wq);
 }
 
-static void gb_loopback_calculate_latency_stats(struct gb_loopback *gb)
+static void
+gb_loopback_calculate_latency_stats(struct gb_loopback *gb,
+				    struct gb_loopback_sample *sample)
 {
+	struct gb_loopback_cpu *stats;
+	unsigned int cls;
 	u32 lat;
 
 	/* Express latency in terms of microseconds */
-	lat = gb_loopback_nsec_to_usec_latency(gb->elapsed_nsecs);
+	lat = gb_loopback_nsec_to_usec_latency(sample->elapsed_nsecs);
+
+	stats = get_cpu_ptr(gb->stats);
 
 	/* Log latency stastic */
-	gb_loopback_update_stats(&gb->latency, lat);
+	gb_loopback_update_stats(&stats->latency, lat);
+	gb_loopback_hist_add(&stats->latency_hist, sample->elapsed_nsecs);
 
-	/* Raw latency log on a per thread basis */
-	kfifo_in(&gb->kfifo_lat, (unsigned char *)&lat, sizeof(lat));
+	/* Raw latency log on a per connection basis, one ring per CPU */
+	kfifo_in(this_cpu_ptr(gb->kfifo_lat), (unsigned char *)&lat,
+		 sizeof(lat));
 
 	/* Log the firmware supplied latency values */
-	gb_loopback_update_stats(&gb->apbridge_unipro_latency,
-				 gb->apbridge_latency_ts);
-	gb_loopback_update_stats(&gb->gpbridge_firmware_latency,
-				 gb->gpbridge_latency_ts);
+	gb_loopback_update_stats(&stats->apbridge_unipro_latency,
+				 sample->apbridge_latency_ts);
+	gb_loopback_update_stats(&stats->gpbridge_firmware_latency,
+				 sample->gpbridge_latency_ts);
+	gb_loopback_hist_add(&stats->apbridge_unipro_latency_hist,
+			     (u64)sample->apbridge_latency_ts * NSEC_PER_USEC);
+	gb_loopback_hist_add(&stats->gpbridge_firmware_latency_hist,
+			     (u64)sample->gpbridge_latency_ts * NSEC_PER_USEC);
+
+	if (gb->profile) {
+		cls = sample->profile_class;
+		gb_loopback_update_stats(&stats->class_latency[cls], lat);
+		gb_loopback_hist_add(&stats->class_latency_hist[cls],
+				     sample->elapsed_nsecs);
+	}
+
+	put_cpu_ptr(gb->stats);
 }
 
-static void gb_loopback_calculate_stats(struct gb_loopback *gb, bool error)
+/*
+ * Account for one iteration. This runs concurrently from every sender and
+ * completion, so only the per-second window roll is serialised and a
+ * completion that finds the window busy leaves the roll to the next one.
+ * The final iteration always closes the window.
+ */
+static void gb_loopback_calculate_stats(struct gb_loopback *gb,
+					struct gb_loopback_sample *sample,
+					bool error)
 {
-	u64 nlat;
-	u32 lat;
-	struct timeval te;
+	u64 nlat, bytes;
+	u32 lat, count;
+	ktime_t te;
+	bool last;
+
+	gb_loopback_sample_log(gb, sample);
+
+	if (error) {
+		atomic_inc(&gb->error);
+	} else {
+		atomic_inc(&gb->requests_completed);
+		atomic64_add(gb_loopback_request_bytes(sample->type,
+						       sample->len),
+			     &gb->bytes_completed);
+		gb_loopback_calculate_latency_stats(gb, sample);
+	}
+	last = atomic_inc_return(&gb->iteration_count) == gb->iteration_max;
 
-	if (!error) {
-		gb->requests_completed++;
-		gb_loopback_calculate_latency_stats(gb);
+	te = ktime_get();
+	if (last) {
+		spin_lock(&gb->window_lock);
+	} else {
+		if (gb_loopback_calc_latency(gb->ts, te) < NSEC_PER_SEC)
+			return;
+		if (!spin_trylock(&gb->window_lock))
+			return;
 	}
 
-	do_gettimeofday(&te);
-	nlat = gb_loopback_calc_latency(&gb->ts, &te);
-	if (nlat >= NSEC_PER_SEC || gb->iteration_count == gb->iteration_max) {
+	nlat = gb_loopback_calc_latency(gb->ts, te);
+	if (nlat >= NSEC_PER_SEC || last) {
 		lat = gb_loopback_nsec_to_usec_latency(nlat);
 
-		gb_loopback_throughput_update(gb, lat);
-		gb_loopback_requests_update(gb, lat);
-
-		if (gb->iteration_count != gb->iteration_max) {
+		if (last) {
+			count = atomic_read(&gb->requests_completed);
+			bytes = atomic64_read(&gb->bytes_completed);
+		} else {
 			gb->ts = te;
-			gb->requests_completed = 0;
+			count = atomic_xchg(&gb->requests_completed, 0);
+			bytes = atomic64_xchg(&gb->bytes_completed, 0);
 		}
+
+		gb_loopback_throughput_update(gb, bytes, lat);
+		gb_loopback_requests_update(gb, count, lat);
 	}
+	spin_unlock(&gb->window_lock);
+}
+
+static u32 gb_loopback_stats_avg(struct gb_loopback_stats *stats)
+{
+	u64 avg;
+
+	if (!stats->count)
+		return 0;
+	avg = stats->sum + stats->count / 2;
+	do_div(avg, stats->count);
+	return avg;
+}
+
+/*
+ * Record the results of the current step of a size sweep and move on to the
+ * next size. Returns false once the sweep is over. Called with gb->mutex held
+ * once all the iterations of the step have completed.
+ */
+static bool gb_loopback_sweep_next(struct gb_loopback *gb)
+{
+	struct gb_loopback_sweep_result *res;
+	struct gb_loopback_stats stats;
+	u64 size;
+
+	if (!gb->sweep_max || gb->sweep_count >= GB_LOOPBACK_SWEEP_STEPS_MAX)
+		return false;
+
+	res = &gb->sweep_results[gb->sweep_count++];
+	res->size = gb->size;
+	res->iterations = atomic_read(&gb->iteration_count);
+	res->errors = atomic_read(&gb->error) - gb->sweep_error_base;
+
+	gb_loopback_stats_get(gb, offsetof(struct gb_loopback,
+					   requests_per_second), &stats);
+	res->requests_per_second = gb_loopback_stats_avg(&stats);
+	gb_loopback_stats_get(gb, offsetof(struct gb_loopback, throughput),
+			      &stats);
+	res->throughput = gb_loopback_stats_avg(&stats);
+
+	gb_loopback_cpu_stats_get(gb, offsetof(struct gb_loopback_cpu,
+					       latency), &stats);
+	res->latency_min = stats.count ? stats.min : 0;
+	res->latency_avg = gb_loopback_stats_avg(&stats);
+	res->latency_max = stats.max;
+	res->latency_p50 = gb_loopback_hist_percentile(gb,
+			offsetof(struct gb_loopback_cpu, latency_hist), 500);
+	res->latency_p99 = gb_loopback_hist_percentile(gb,
+			offsetof(struct gb_loopback_cpu, latency_hist), 990);
+	res->latency_p999 = gb_loopback_hist_percentile(gb,
+			offsetof(struct gb_loopback_cpu, latency_hist), 999);
+
+	if (gb->sweep_mode == GB_LOOPBACK_SWEEP_GEOMETRIC)
+		size = gb->size ? (u64)gb->size * gb->sweep_step : 1;
+	else
+		size = (u64)gb->size + gb->sweep_step;
+	if (size > gb->sweep_max ||
+	    gb->sweep_count == GB_LOOPBACK_SWEEP_STEPS_MAX)
+		return false;
+
+	gb->size = size;
+	atomic_set(&gb->iteration_count, 0);
+	gb->sweep_error_base = atomic_read(&gb->error);
+	gb_loopback_reset_stats(gb);
+
+	/* Publish the new step before senders can claim iterations of it */
+	smp_wmb();
+	atomic_set(&gb->warmup_left, gb->warmup);
+	atomic_set(&gb->send_count, 0);
+	return true;
 }
 
 static void gb_loopback_async_wait_to_send(struct gb_loopback *gb)
@@ -974,18 +2483,44 @@ static void gb_loopback_async_wait_to_send(struct gb_loopback *gb)
 				  kthread_should_stop());
 }
 
+/* Draw the type and size of the next request from the workload profile */
+static void gb_loopback_profile_pick(struct gb_loopback *gb,
+				     struct gb_loopback_thread *thread,
+				     int *type, u32 *size)
+{
+	struct gb_loopback_profile_class *class;
+	u32 r = prandom_u32_max(gb->profile_weight);
+	unsigned int i;
+
+	for (i = 0; i < GB_LOOPBACK_PROFILE_CLASSES - 1; i++) {
+		if (r < gb->profile_classes[i].weight)
+			break;
+		r -= gb->profile_classes[i].weight;
+	}
+
+	class = &gb->profile_classes[i];
+	thread->profile_class = i;
+	*type = gb_loopback_profile_types[i].type;
+	*size = class->size_min;
+	if (class->size_max > class->size_min)
+		*size += prandom_u32_max(class->size_max - class->size_min + 1);
+}
+
 static int gb_loopback_fn(void *data)
 {
 	int error = 0;
 	int us_wait = 0;
 	int type;
 	u32 size;
+	u32 rate;
 
-	struct gb_loopback *gb = data;
+	struct gb_loopback_thread *thread = data;
+	struct gb_loopback *gb = thread->gb;
 
 	while (1) {
-		if (!gb->type)
-			wait_event_interruptible(gb->wq, gb->type ||
+		if (!gb->type || gb->held)
+			wait_event_interruptible(gb->wq,
+						 (gb->type && !gb->held) ||
 						 kthread_should_stop());
 		if (kthread_should_stop())
 			break;
@@ -995,13 +2530,22 @@ static int gb_loopback_fn(void *data)
 		if (kthread_should_stop())
 			break;
 
-		mutex_lock(&gb->mutex);
-
-		/* Optionally terminate */
-		if (gb->send_count == gb->iteration_max) {
-			if (gb->iteration_count == gb->iteration_max) {
+		/*
+		 * Claim an iteration, other senders may be running. Warm-up
+		 * iterations are sent but not accounted for.
+		 */
+		thread->warmup = atomic_dec_if_positive(&gb->warmup_left) >= 0;
+		if (!thread->warmup &&
+		    !atomic_add_unless(&gb->send_count, 1, gb->iteration_max)) {
+			/* Optionally terminate, or move on to the next size */
+			mutex_lock(&gb->mutex);
+			if (gb->type && !gb->held &&
+			    atomic_read(&gb->iteration_count) ==
+			    gb->iteration_max &&
+			    !gb_loopback_sweep_next(gb)) {
 				gb->type = 0;
-				gb->send_count = 0;
+				atomic_set(&gb->send_count, 0);
+				gb_loopback_rate_stop(gb);
 				sysfs_notify(&gb->dev->kobj,  NULL,
 						"iteration_count");
 			}
@@ -1011,43 +2555,151 @@ static int gb_loopback_fn(void *data)
 		size = gb->size;
 		us_wait = gb->us_wait;
 		type = gb->type;
-		if (gb->ts.tv_usec == 0 && gb->ts.tv_sec == 0)
-			do_gettimeofday(&gb->ts);
-		mutex_unlock(&gb->mutex);
+		rate = gb->rate;
+		if (!type)
+			continue;
+		if (gb->profile)
+			gb_loopback_profile_pick(gb, thread, &type, &size);
+		thread->verify = gb->verify;
+		if (!thread->warmup && !ktime_to_ns(gb->ts)) {
+			spin_lock(&gb->window_lock);
+			if (!ktime_to_ns(gb->ts))
+				gb->ts = ktime_get();
+			spin_unlock(&gb->window_lock);
+		}
+
+		/* In rate mode, wait for the next scheduled arrival */
+		thread->scheduled = ktime_set(0, 0);
+		if (rate) {
+			wait_event_interruptible(gb->wq,
+				gb_loopback_rate_get(gb, &thread->scheduled) ||
+				!gb->type || kthread_should_stop());
+			if (!ktime_to_ns(thread->scheduled))
+				continue;
+		}
 
 		/* Else operations to perform */
 		if (gb->async) {
 			if (type == GB_LOOPBACK_TYPE_PING) {
-				error = gb_loopback_async_ping(gb);
+				error = gb_loopback_async_ping(thread);
 			} else if (type == GB_LOOPBACK_TYPE_TRANSFER) {
-				error = gb_loopback_async_transfer(gb, size);
+				error = gb_loopback_async_transfer(thread, size);
 			} else if (type == GB_LOOPBACK_TYPE_SINK) {
-				error = gb_loopback_async_sink(gb, size);
+				error = gb_loopback_async_sink(thread, size);
 			}
 
-			if (error)
-				gb->error++;
+			if (error && !thread->warmup)
+				atomic_inc(&gb->error);
 		} else {
-			/* We are effectively single threaded here */
+			/* Each thread has one operation in flight at a time */
 			if (type == GB_LOOPBACK_TYPE_PING)
-				error = gb_loopback_sync_ping(gb);
+				error = gb_loopback_sync_ping(thread);
 			else if (type == GB_LOOPBACK_TYPE_TRANSFER)
-				error = gb_loopback_sync_transfer(gb, size);
+				error = gb_loopback_sync_transfer(thread, size);
 			else if (type == GB_LOOPBACK_TYPE_SINK)
-				error = gb_loopback_sync_sink(gb, size);
-
-			if (error)
-				gb->error++;
-			gb->iteration_count++;
-			gb_loopback_calculate_stats(gb, !!error);
+				error = gb_loopback_sync_sink(thread, size);
+
+			if (!thread->warmup) {
+				thread->sample.type = type;
+				thread->sample.len = size;
+				thread->sample.profile_class =
+					thread->profile_class;
+				thread->sample.result = error;
+				gb_loopback_calculate_stats(gb, &thread->sample,
+							    !!error);
+			}
 		}
-		gb->send_count++;
 		if (us_wait)
 			udelay(us_wait);
 	}
 	return 0;
 }
 
+/* Called with thread_mutex held */
+static void gb_loopback_threads_stop(struct gb_loopback *gb)
+{
+	struct gb_loopback_thread *thread;
+	unsigned int i;
+
+	for (i = 0; i < gb->nthreads; i++) {
+		thread = gb->threads[i];
+		kthread_stop(thread->task);
+		thread->task = NULL;
+	}
+	gb->nthreads = 0;
+}
+
+/* Called with thread_mutex held */
+static int gb_loopback_threads_start(struct gb_loopback *gb, u32 nthreads)
+{
+	struct gb_loopback_thread *thread;
+	struct task_struct *task;
+	unsigned int cpu = 0;
+	unsigned int i;
+
+	for (i = 0; i < nthreads; i++) {
+		thread = gb->threads[i];
+		if (!thread) {
+			thread = kzalloc(sizeof(*thread), GFP_KERNEL);
+			if (!thread)
+				goto err_stop;
+			thread->gb = gb;
+
+			mutex_lock(&gb->mutex);
+			gb->threads[i] = thread;
+			gb->threads_allocated++;
+			mutex_unlock(&gb->mutex);
+		}
+
+		task = kthread_create(gb_loopback_fn, thread, "gb_loopback%d/%u",
+				      gb->id, i);
+		if (IS_ERR(task))
+			goto err_stop;
+
+		if (gb->thread_pinning) {
+			cpu = i ? cpumask_next(cpu, cpu_online_mask) :
+				  cpumask_first(cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpu_online_mask);
+			set_cpus_allowed_ptr(task, cpumask_of(cpu));
+		}
+
+		thread->task = task;
+		gb->nthreads++;
+		wake_up_process(task);
+	}
+
+	return 0;
+
+err_stop:
+	gb_loopback_threads_stop(gb);
+
+	return -ENOMEM;
+}
+
+/*
+ * Replace the running sender threads with nthreads new ones, restoring the
+ * previous set on failure. Called with thread_mutex held.
+ */
+static int gb_loopback_threads_restart(struct gb_loopback *gb, u32 nthreads)
+{
+	u32 old = gb->nthreads;
+	int ret;
+
+	mutex_lock(&gb->mutex);
+	ret = gb->type ? -EBUSY : 0;
+	mutex_unlock(&gb->mutex);
+	if (ret)
+		return ret;
+
+	gb_loopback_threads_stop(gb);
+	ret = gb_loopback_threads_start(gb, nthreads);
+	if (ret)
+		gb_loopback_threads_start(gb, old);
+
+	return ret;
+}
+
 static int gb_loopback_dbgfs_latency_show_common(struct seq_file *s,
 						 struct kfifo *kfifo,
 						 struct mutex *mutex)
@@ -1074,9 +2726,17 @@ done:
 static int gb_loopback_dbgfs_latency_show(struct seq_file *s, void *unused)
 {
 	struct gb_loopback *gb = s->private;
+	struct kfifo *kfifo;
+	unsigned int cpu;
 
-	return gb_loopback_dbgfs_latency_show_common(s, &gb->kfifo_lat,
-						     &gb->mutex);
+	/* Each CPU logs to its own ring, drain whichever has data */
+	for_each_possible_cpu(cpu) {
+		kfifo = per_cpu_ptr(gb->kfifo_lat, cpu);
+		if (kfifo_len(kfifo))
+			break;
+	}
+
+	return gb_loopback_dbgfs_latency_show_common(s, kfifo, &gb->mutex);
 }
 
 static int gb_loopback_latency_open(struct inode *inode, struct file *file)
@@ -1092,6 +2752,324 @@ static const struct file_operations gb_loopback_debugfs_latency_ops = {
 	.release	= single_release,
 };
 
+static int gb_loopback_sample_ring_alloc(struct gb_loopback *gb)
+{
+	struct gb_loopback_sample_ring *ring;
+	size_t size;
+	u32 nr;
+
+	nr = roundup_pow_of_two(max(sample_depth, 1U));
+	size = PAGE_SIZE + PAGE_ALIGN(nr *
+			sizeof(struct gb_loopback_sample_record));
+
+	ring = vmalloc_user(size);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->nr = nr;
+	ring->offset = PAGE_SIZE;
+	ring->record_size = sizeof(struct gb_loopback_sample_record);
+	ring->size = size;
+	gb->sample_ring = ring;
+
+	return 0;
+}
+
+/* A single reader at a time owns the tail of the ring */
+static int gb_loopback_samples_open(struct inode *inode, struct file *file)
+{
+	struct gb_loopback *gb = inode->i_private;
+	int retval = 0;
+
+	mutex_lock(&gb->mutex);
+	if (gb->sample_reader) {
+		retval = -EBUSY;
+		goto done;
+	}
+	if (!gb->sample_ring) {
+		retval = gb_loopback_sample_ring_alloc(gb);
+		if (retval)
+			goto done;
+	}
+
+	/* Whatever was left in the ring belongs to the previous reader */
+	gb->sample_ring->tail = READ_ONCE(gb->sample_ring->head);
+	atomic_set(&gb->samples_lost, 0);
+	gb->sample_ring->lost = 0;
+	file->private_data = gb;
+	smp_store_release(&gb->sample_reader, true);
+done:
+	mutex_unlock(&gb->mutex);
+	return retval;
+}
+
+static int gb_loopback_samples_release(struct inode *inode,
+				       struct file *file)
+{
+	struct gb_loopback *gb = file->private_data;
+
+	mutex_lock(&gb->mutex);
+	WRITE_ONCE(gb->sample_reader, false);
+	mutex_unlock(&gb->mutex);
+
+	return 0;
+}
+
+static int gb_loopback_samples_mmap(struct file *file,
+				    struct vm_area_struct *vma)
+{
+	struct gb_loopback *gb = file->private_data;
+
+	return remap_vmalloc_range(vma, gb->sample_ring, vma->vm_pgoff);
+}
+
+static unsigned int gb_loopback_samples_poll(struct file *file,
+					     poll_table *wait)
+{
+	struct gb_loopback *gb = file->private_data;
+	struct gb_loopback_sample_ring *ring = gb->sample_ring;
+	struct gb_loopback_sample_record *rec;
+	u32 tail;
+
+	poll_wait(file, &gb->sample_wq, wait);
+
+	tail = READ_ONCE(ring->tail);
+	rec = gb_loopback_sample_record(ring, tail);
+	if (smp_load_acquire(&rec->seq) == tail + 1)
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations gb_loopback_debugfs_samples_ops = {
+	.open		= gb_loopback_samples_open,
+	.release	= gb_loopback_samples_release,
+	.mmap		= gb_loopback_samples_mmap,
+	.poll		= gb_loopback_samples_poll,
+	.llseek		= no_llseek,
+};
+
+static int gb_loopback_dbgfs_sweep_show(struct seq_file *s, void *unused)
+{
+	struct gb_loopback *gb = s->private;
+	struct gb_loopback_sweep_result *res;
+	unsigned int i;
+
+	seq_puts(s, "# size iterations errors requests_per_second throughput "
+		 "latency_min latency_avg latency_max "
+		 "latency_p50_ns latency_p99_ns latency_p999_ns\n");
+
+	mutex_lock(&gb->mutex);
+	for (i = 0; i < gb->sweep_count; i++) {
+		res = &gb->sweep_results[i];
+		seq_printf(s, "%u %u %u %llu %llu %llu %llu %llu %llu %llu %llu\n",
+			   res->size, res->iterations, res->errors,
+			   res->requests_per_second, res->throughput,
+			   res->latency_min, res->latency_avg,
+			   res->latency_max, res->latency_p50,
+			   res->latency_p99, res->latency_p999);
+	}
+	mutex_unlock(&gb->mutex);
+
+	return 0;
+}
+
+static int gb_loopback_sweep_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_loopback_dbgfs_sweep_show,
+			   inode->i_private);
+}
+
+static const struct file_operations gb_loopback_debugfs_sweep_ops = {
+	.open		= gb_loopback_sweep_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int gb_loopback_dbgfs_profile_show(struct seq_file *s, void *unused)
+{
+	struct gb_loopback *gb = s->private;
+	struct gb_loopback_profile_class *class;
+	struct gb_loopback_stats stats;
+	size_t offset;
+	unsigned int i;
+
+	seq_puts(s, "# class weight size_min size_max count latency_min "
+		 "latency_avg latency_max "
+		 "latency_p50_ns latency_p99_ns latency_p999_ns\n");
+
+	mutex_lock(&gb->mutex);
+	for (i = 0; i < GB_LOOPBACK_PROFILE_CLASSES; i++) {
+		class = &gb->profile_classes[i];
+		if (!class->weight)
+			continue;
+
+		gb_loopback_cpu_stats_get(gb,
+			offsetof(struct gb_loopback_cpu, class_latency[i]),
+			&stats);
+		offset = offsetof(struct gb_loopback_cpu,
+				  class_latency_hist[i]);
+		seq_printf(s, "%s %u %u %u %u %u %u %u %llu %llu %llu\n",
+			   gb_loopback_profile_types[i].name, class->weight,
+			   class->size_min, class->size_max, stats.count,
+			   stats.count ? stats.min : 0,
+			   gb_loopback_stats_avg(&stats), stats.max,
+			   gb_loopback_hist_percentile(gb, offset, 500),
+			   gb_loopback_hist_percentile(gb, offset, 990),
+			   gb_loopback_hist_percentile(gb, offset, 999));
+	}
+	mutex_unlock(&gb->mutex);
+
+	return 0;
+}
+
+static int gb_loopback_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gb_loopback_dbgfs_profile_show,
+			   inode->i_private);
+}
+
+/*
+ * Load a workload profile, one "<class> <weight> <size_min> <size_max>" line
+ * per class, where class is one of ping, transfer or sink. Classes that are
+ * not listed get no weight. Sizes are drawn uniformly from the range.
+ */
+static ssize_t gb_loopback_profile_write(struct file *file,
+					 const char __user *buf, size_t count,
+					 loff_t *ppos)
+{
+	struct gb_loopback *gb = file_inode(file)->i_private;
+	struct gb_loopback_profile_class classes[GB_LOOPBACK_PROFILE_CLASSES];
+	struct gb_loopback_profile_class class;
+	char name[16];
+	char *kbuf, *line, *cur;
+	u32 weight = 0;
+	unsigned int i;
+	ssize_t retval;
+
+	if (count >= PAGE_SIZE)
+		return -EINVAL;
+
+	kbuf = kmalloc(count + 1, GFP_KERNEL);
+	if (!kbuf)
+		return -ENOMEM;
+	if (copy_from_user(kbuf, buf, count)) {
+		retval = -EFAULT;
+		goto out_free;
+	}
+	kbuf[count] = '\0';
+
+	memset(classes, 0, sizeof(classes));
+	cur = kbuf;
+	while ((line = strsep(&cur, "\n"))) {
+		line = skip_spaces(line);
+		if (!*line || *line == '#')
+			continue;
+
+		if (sscanf(line, "%15s %u %u %u", name, &class.weight,
+			   &class.size_min, &class.size_max) != 4 ||
+		    class.weight > GB_LOOPBACK_PROFILE_WEIGHT_MAX ||
+		    class.size_min > class.size_max ||
+		    class.size_max > gb_dev.size_max) {
+			retval = -EINVAL;
+			goto out_free;
+		}
+
+		for (i = 0; i < GB_LOOPBACK_PROFILE_CLASSES; i++)
+			if (!strcmp(name, gb_loopback_profile_types[i].name))
+				break;
+		if (i == GB_LOOPBACK_PROFILE_CLASSES) {
+			retval = -EINVAL;
+			goto out_free;
+		}
+
+		weight -= classes[i].weight;
+		classes[i] = class;
+		weight += class.weight;
+	}
+
+	mutex_lock(&gb->mutex);
+	if (gb->type) {
+		retval = -EBUSY;
+	} else {
+		memcpy(gb->profile_classes, classes, sizeof(classes));
+		gb->profile_weight = weight;
+		retval = count;
+	}
+	mutex_unlock(&gb->mutex);
+
+out_free:
+	kfree(kbuf);
+	return retval;
+}
+
+static const struct file_operations gb_loopback_debugfs_profile_ops = {
+	.open		= gb_loopback_profile_open,
+	.read		= seq_read,
+	.write		= gb_loopback_profile_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Release the tests held on all armed devices at once. They share the same
+ * epoch, from which their throughput and any rate schedule are measured, so
+ * that the results of several devices can be added up.
+ */
+static void gb_loopback_start_all(void)
+{
+	struct gb_loopback *gb;
+	ktime_t epoch;
+
+	mutex_lock(&gb_dev.list_mutex);
+	epoch = ktime_get();
+	gb_dev.epoch = epoch;
+	list_for_each_entry(gb, &gb_dev.list, entry) {
+		mutex_lock(&gb->mutex);
+		if (gb->held) {
+			gb->held = false;
+			gb->ts = epoch;
+			gb_loopback_rate_start(gb, epoch);
+			wake_up(&gb->wq);
+		}
+		mutex_unlock(&gb->mutex);
+	}
+	mutex_unlock(&gb_dev.list_mutex);
+}
+
+static ssize_t gb_loopback_start_read(struct file *f, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	char tmp_buf[24];
+	int len;
+
+	len = snprintf(tmp_buf, sizeof(tmp_buf), "%lld\n",
+		       ktime_to_ns(gb_dev.epoch));
+	return simple_read_from_buffer(buf, count, ppos, tmp_buf, len);
+}
+
+static ssize_t gb_loopback_start_write(struct file *f, const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	int start;
+	ssize_t retval;
+
+	retval = kstrtoint_from_user(buf, count, 10, &start);
+	if (retval)
+		return retval;
+
+	if (start)
+		gb_loopback_start_all();
+
+	return count;
+}
+
+static const struct file_operations gb_loopback_debugfs_start_ops = {
+	.read	= gb_loopback_start_read,
+	.write	= gb_loopback_start_write,
+};
+
 static int gb_loopback_bus_id_compare(void *priv, struct list_head *lha,
 				      struct list_head *lhb)
 {
@@ -1132,6 +3110,35 @@ static void gb_loopback_insert_id(struct gb_loopback *gb)
 
 #define DEBUGFS_NAMELEN 32
 
+static void gb_loopback_kfifo_free(struct gb_loopback *gb)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfifo_free(per_cpu_ptr(gb->kfifo_lat, cpu));
+	free_percpu(gb->kfifo_lat);
+}
+
+/* One raw latency ring per CPU, so that completions never share a ring */
+static int gb_loopback_kfifo_alloc(struct gb_loopback *gb)
+{
+	unsigned int cpu;
+
+	gb->kfifo_lat = alloc_percpu(struct kfifo);
+	if (!gb->kfifo_lat)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		if (kfifo_alloc(per_cpu_ptr(gb->kfifo_lat, cpu),
+				kfifo_depth * sizeof(u32), GFP_KERNEL)) {
+			gb_loopback_kfifo_free(gb);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int gb_loopback_probe(struct gb_bundle *bundle,
 			     const struct greybus_bundle_id *id)
 {
@@ -1154,19 +3161,42 @@ static int gb_loopback_probe(struct gb_bundle *bundle,
 	if (!gb)
 		return -ENOMEM;
 
+	gb->stats = alloc_percpu(struct gb_loopback_cpu);
+	if (!gb->stats) {
+		retval = -ENOMEM;
+		goto out_kzalloc;
+	}
+
 	connection = gb_connection_create(bundle, le16_to_cpu(cport_desc->id),
 					  gb_loopback_request_handler);
 	if (IS_ERR(connection)) {
 		retval = PTR_ERR(connection);
-		goto out_kzalloc;
+		goto out_stats;
 	}
 
 	gb->connection = connection;
+	gb_connection_set_data(connection, gb);
 	greybus_set_drvdata(bundle, gb);
 
 	init_waitqueue_head(&gb->wq);
 	init_waitqueue_head(&gb->wq_completion);
+	init_waitqueue_head(&gb->sample_wq);
+	spin_lock_init(&gb->responder_lock);
+	gb_loopback_responder_reset(gb);
+	spin_lock_init(&gb->inbound_lock);
+	INIT_LIST_HEAD(&gb->inbound_sent);
+	INIT_WORK(&gb->inbound_work, gb_loopback_inbound_work);
 	atomic_set(&gb->outstanding_operations, 0);
+	mutex_init(&gb->mutex);
+	mutex_init(&gb->thread_mutex);
+	spin_lock_init(&gb->window_lock);
+	spin_lock_init(&gb->op_pool_lock);
+	INIT_LIST_HEAD(&gb->op_pool);
+	spin_lock_init(&gb->rate_lock);
+	INIT_KFIFO(gb->rate_fifo);
+	hrtimer_init(&gb->rate_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	gb->rate_timer.function = gb_loopback_rate_fn;
+	gb->verify = GB_LOOPBACK_VERIFY_FULL;
 	gb_loopback_reset_stats(gb);
 
 	/* Reported values to user-space for min/max timeouts */
@@ -1189,6 +3219,23 @@ static int gb_loopback_probe(struct gb_bundle *bundle,
 		 dev_name(&connection->bundle->dev));
 	gb->file = debugfs_create_file(name, S_IFREG | S_IRUGO, gb_dev.root, gb,
 				       &gb_loopback_debugfs_latency_ops);
+	snprintf(name, sizeof(name), "sweep_%s",
+		 dev_name(&connection->bundle->dev));
+	gb->sweep_file = debugfs_create_file(name, S_IFREG | S_IRUGO,
+					     gb_dev.root, gb,
+					     &gb_loopback_debugfs_sweep_ops);
+	snprintf(name, sizeof(name), "profile_%s",
+		 dev_name(&connection->bundle->dev));
+	gb->profile_file = debugfs_create_file(name,
+					S_IFREG | S_IRUGO | S_IWUSR,
+					gb_dev.root, gb,
+					&gb_loopback_debugfs_profile_ops);
+	snprintf(name, sizeof(name), "samples_%s",
+		 dev_name(&connection->bundle->dev));
+	gb->samples_file = debugfs_create_file(name,
+					S_IFREG | S_IRUSR | S_IWUSR,
+					gb_dev.root, gb,
+					&gb_loopback_debugfs_samples_ops);
 
 	gb->id = ida_simple_get(&loopback_ida, 0, 0, GFP_KERNEL);
 	if (gb->id < 0) {
@@ -1211,37 +3258,30 @@ static int gb_loopback_probe(struct gb_bundle *bundle,
 	gb->dev = dev;
 
 	/* Allocate kfifo */
-	if (kfifo_alloc(&gb->kfifo_lat, kfifo_depth * sizeof(u32),
-			  GFP_KERNEL)) {
-		retval = -ENOMEM;
+	retval = gb_loopback_kfifo_alloc(gb);
+	if (retval)
 		goto out_conn;
-	}
-	if (kfifo_alloc(&gb->kfifo_ts, kfifo_depth * sizeof(struct timeval) * 2,
-			  GFP_KERNEL)) {
-		retval = -ENOMEM;
-		goto out_kfifo0;
-	}
 
 	/* Fork worker thread */
-	mutex_init(&gb->mutex);
-	gb->task = kthread_run(gb_loopback_fn, gb, "gb_loopback");
-	if (IS_ERR(gb->task)) {
-		retval = PTR_ERR(gb->task);
-		goto out_kfifo1;
-	}
+	mutex_lock(&gb->thread_mutex);
+	retval = gb_loopback_threads_start(gb, 1);
+	mutex_unlock(&gb->thread_mutex);
+	if (retval)
+		goto out_kfifo;
 
+	mutex_lock(&gb_dev.list_mutex);
 	spin_lock_irqsave(&gb_dev.lock, flags);
 	gb_loopback_insert_id(gb);
 	gb_dev.count++;
 	spin_unlock_irqrestore(&gb_dev.lock, flags);
+	mutex_unlock(&gb_dev.list_mutex);
 
 	gb_connection_latency_tag_enable(connection);
 	return 0;
 
-out_kfifo1:
-	kfifo_free(&gb->kfifo_ts);
-out_kfifo0:
-	kfifo_free(&gb->kfifo_lat);
+out_kfifo:
+	kfree(gb->threads[0]);
+	gb_loopback_kfifo_free(gb);
 out_conn:
 	device_unregister(dev);
 out_connection_disable:
@@ -1249,9 +3289,14 @@ out_connection_disable:
 out_ida_remove:
 	ida_simple_remove(&loopback_ida, gb->id);
 out_debugfs_remove:
+	debugfs_remove(gb->samples_file);
+	debugfs_remove(gb->profile_file);
+	debugfs_remove(gb->sweep_file);
 	debugfs_remove(gb->file);
 out_connection_destroy:
 	gb_connection_destroy(connection);
+out_stats:
+	free_percpu(gb->stats);
 out_kzalloc:
 	kfree(gb);
 
@@ -1262,15 +3307,22 @@ static void gb_loopback_disconnect(struct gb_bundle *bundle)
 {
 	struct gb_loopback *gb = greybus_get_drvdata(bundle);
 	unsigned long flags;
+	unsigned int i;
 
 	gb_connection_disable(gb->connection);
 
-	if (!IS_ERR_OR_NULL(gb->task))
-		kthread_stop(gb->task);
+	hrtimer_cancel(&gb->rate_timer);
 
-	kfifo_free(&gb->kfifo_lat);
-	kfifo_free(&gb->kfifo_ts);
+	mutex_lock(&gb->thread_mutex);
+	gb_loopback_threads_stop(gb);
+	mutex_unlock(&gb->thread_mutex);
+
+	gb_loopback_inbound_destroy(gb);
+	gb_loopback_kfifo_free(gb);
 	gb_connection_latency_tag_disable(gb->connection);
+	debugfs_remove(gb->samples_file);
+	debugfs_remove(gb->profile_file);
+	debugfs_remove(gb->sweep_file);
 	debugfs_remove(gb->file);
 
 	/*
@@ -1279,16 +3331,24 @@ static void gb_loopback_disconnect(struct gb_bundle *bundle)
 	 * incoming/outgoing requests.
 	 */
 	gb_loopback_async_wait_all(gb);
+	gb_loopback_async_pool_destroy(gb);
+	vfree(gb->sample_ring);
 
+	mutex_lock(&gb_dev.list_mutex);
 	spin_lock_irqsave(&gb_dev.lock, flags);
 	gb_dev.count--;
 	list_del(&gb->entry);
 	spin_unlock_irqrestore(&gb_dev.lock, flags);
+	mutex_unlock(&gb_dev.list_mutex);
 
 	device_unregister(gb->dev);
 	ida_simple_remove(&loopback_ida, gb->id);
 
+	for (i = 0; i < gb->threads_allocated; i++)
+		kfree(gb->threads[i]);
+
 	gb_connection_destroy(gb->connection);
+	free_percpu(gb->stats);
 	kfree(gb);
 }
 
@@ -1310,9 +3370,11 @@ static int loopback_init(void)
 	int retval;
 
 	INIT_LIST_HEAD(&gb_dev.list);
-	INIT_LIST_HEAD(&gb_dev.list_op_async);
 	spin_lock_init(&gb_dev.lock);
+	mutex_init(&gb_dev.list_mutex);
 	gb_dev.root = debugfs_create_dir("gb_loopback", NULL);
+	debugfs_create_file("start", S_IFREG | S_IRUGO | S_IWUSR, gb_dev.root,
+			    NULL, &gb_loopback_debugfs_start_ops);
 
 	retval = class_register(&loopback_class);
 	if (retval)
@@ -90,6 +90,17 @@ static bool gb_operation_is_active(struct gb_operation *operation)
 	return ret;
 }
 
+/*
+ * Schedule the completion of an outgoing operation. This takes both the
+ * result of the operation being set and the request message being released
+ * by the host device driver, and only the last of the two queues the work.
+ */
+static void gb_operation_complete_outgoing(struct gb_operation *operation)
+{
+	if (atomic_dec_and_test(&operation->completion_pending))
+		queue_work(gb_operation_completion_wq, &operation->work);
+}
+
 /*
  * Set an operation's result.
  *
@@ -196,15 +207,133 @@ gb_operation_find_outgoing(struct gb_connection *connection, u16 operation_id)
 	return found ? operation : NULL;
 }
 
+static void gb_operation_message_sent(struct gb_message *message, int status);
+static struct gb_message *
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
+				size_t payload_size, bool outbound,
+				gfp_t gfp_flags);
+static void gb_operation_message_free(struct gb_host_device *hd,
+				      struct gb_message *message);
+
+/*
+ * Drop a reference to the segments of a message, and report the message as
+ * sent once all of its segments have been.
+ */
+static void gb_message_segments_put(struct gb_message *message)
+{
+	struct gb_host_device *hd = message->operation->connection->hd;
+	unsigned int i;
+
+	if (!atomic_dec_and_test(&message->segments_pending))
+		return;
+
+	for (i = 0; i < message->num_segments; i++)
+		gb_operation_message_free(hd, message->segments[i]);
+	kfree(message->segments);
+	message->segments = NULL;
+	message->num_segments = 0;
+
+	gb_operation_message_sent(message, message->segments_status);
+}
+
+static void gb_message_segment_sent(struct gb_message *segment, int status)
+{
+	struct gb_message *message = segment->parent;
+
+	/* The first error is what gets reported for the message. */
+	if (status)
+		cmpxchg(&message->segments_status, 0, status);
+
+	gb_message_segments_put(message);
+}
+
+/*
+ * Send a message larger than the host device buffers as a sequence of
+ * segments. All segments are queued at once so that they are pipelined
+ * rather than sent one round trip at a time.
+ */
+static int gb_message_send_segmented(struct gb_message *message, gfp_t gfp)
+{
+	struct gb_operation *operation = message->operation;
+	struct gb_connection *connection = operation->connection;
+	struct gb_host_device *hd = connection->hd;
+	struct gb_message *segment;
+	size_t payload_max;
+	size_t offset = 0;
+	size_t len;
+	unsigned int num_segments;
+	unsigned int i;
+
+	payload_max = hd->buffer_size_max - sizeof(*message->header);
+	num_segments = DIV_ROUND_UP(message->payload_size, payload_max);
+
+	message->segments = kcalloc(num_segments, sizeof(*message->segments),
+				    gfp);
+	if (!message->segments)
+		return -ENOMEM;
+
+	for (i = 0; i < num_segments; i++) {
+		len = min(message->payload_size - offset, payload_max);
+		segment = gb_operation_message_alloc(connection,
+						     message->header->type,
+						     len, true, gfp);
+		if (!segment)
+			goto err_free_segments;
+
+		memcpy(segment->header, message->header,
+		       sizeof(*segment->header));
+		segment->header->size = cpu_to_le16(sizeof(*segment->header) +
+						    len);
+		if (i < num_segments - 1)
+			segment->header->pad[1] = GB_OPERATION_SEGMENT_MORE;
+		memcpy(segment->payload, message->payload + offset, len);
+
+		segment->operation = operation;
+		segment->parent = message;
+		message->segments[i] = segment;
+		offset += len;
+	}
+
+	message->num_segments = num_segments;
+	message->segments_status = 0;
+
+	/* Segments must be visible to gb_message_cancel() before the count. */
+	smp_wmb();
+	atomic_set(&message->segments_pending, num_segments);
+
+	for (i = 0; i < num_segments; i++)
+		gb_hd_message_send(connection, message->segments[i], gfp);
+
+	return 0;
+
+err_free_segments:
+	while (i--)
+		gb_operation_message_free(hd, message->segments[i]);
+	kfree(message->segments);
+	message->segments = NULL;
+
+	return -ENOMEM;
+}
+
+/*
+ * Pass a message to the host device layer to be sent. Any failure to send
+ * the message once it has been queued is reported through
+ * greybus_message_sent().
+ */
 static int gb_message_send(struct gb_message *message, gfp_t gfp)
 {
 	struct gb_connection *connection = message->operation->connection;
+	size_t message_size;
 
 	trace_gb_message_send(message);
-	return connection->hd->driver->message_send(connection->hd,
-					connection->hd_cport_id,
-					message,
-					gfp);
+
+	message_size = sizeof(*message->header) + message->payload_size;
+	if (message_size > connection->hd->buffer_size_max)
+		return gb_message_send_segmented(message, gfp);
+
+	gb_hd_message_send(connection, message, gfp);
+
+	return 0;
 }
 
 /*
@@ -212,7 +341,23 @@ static int gb_message_send(struct gb_message *message, gfp_t gfp)
  */
 static void gb_message_cancel(struct gb_message *message)
 {
-	struct gb_host_device *hd = message->operation->connection->hd;
+	struct gb_connection *connection = message->operation->connection;
+	struct gb_host_device *hd = connection->hd;
+	unsigned int i;
+
+	/* Keep the segments around while cancelling them. */
+	if (atomic_inc_not_zero(&message->segments_pending)) {
+		for (i = 0; i < message->num_segments; i++)
+			gb_message_cancel(message->segments[i]);
+		gb_message_segments_put(message);
+		return;
+	}
+
+	/* Messages still waiting to be scheduled never reach the driver. */
+	if (gb_hd_message_dequeue(connection, message)) {
+		gb_operation_message_sent(message, -ECANCELED);
+		return;
+	}
 
 	hd->driver->message_cancel(message);
 }
@@ -225,6 +370,7 @@ static void gb_operation_request_handle(struct gb_operation *operation)
 
 	if (connection->handler) {
 		status = connection->handler(operation);
+		operation->handled = ktime_get();
 	} else {
 		dev_err(&connection->hd->dev,
 			"%s: unexpected incoming request of type 0x%02x\n",
@@ -276,6 +422,8 @@ static void gb_operation_message_init(struct gb_host_device *hd,
 
 	header = message->buffer;
 
+	INIT_LIST_HEAD(&message->hc_links);
+	INIT_LIST_HEAD(&message->tx_links);
 	message->header = header;
 	message->payload = payload_size ? header + 1 : NULL;
 	message->payload_size = payload_size;
@@ -314,21 +462,28 @@ static void gb_operation_message_init(struct gb_host_device *hd,
  * The headers for inbound messages don't need to be initialized;
  * they'll be filled in by arriving data.
  *
+ * Only outbound messages are allocated by the host driver.  Inbound
+ * messages are written and parsed by the CPU, so they are better off
+ * in regular (cached) memory.
+ *
  * Our message buffers have the following layout:
  *	message header  \_ these combined are
  *	message payload /  the message size
  */
 static struct gb_message *
-gb_operation_message_alloc(struct gb_host_device *hd, u8 type,
-				size_t payload_size, gfp_t gfp_flags)
+gb_operation_message_alloc(struct gb_connection *connection, u8 type,
+				size_t payload_size, bool outbound,
+				gfp_t gfp_flags)
 {
+	struct gb_host_device *hd = connection->hd;
 	struct gb_message *message;
 	struct gb_operation_msg_hdr *header;
 	size_t message_size = payload_size + sizeof(*header);
+	size_t message_size_max = gb_operation_message_size_max(connection);
 
-	if (message_size > hd->buffer_size_max) {
+	if (message_size > message_size_max) {
 		dev_warn(&hd->dev, "requested message size too big (%zu > %zu)\n",
-				message_size, hd->buffer_size_max);
+				message_size, message_size_max);
 		return NULL;
 	}
 
@@ -337,9 +492,27 @@ gb_operation_message_alloc(struct gb_host_device *hd, u8 type,
 	if (!message)
 		return NULL;
 
-	message->buffer = kzalloc(message_size, gfp_flags);
-	if (!message->buffer)
-		goto err_free_message;
+	/*
+	 * Host drivers may provide buffers that are ready for DMA, so that
+	 * messages can be sent without being mapped first.
+	 */
+	message->buffer_size = message_size;
+	if (message_size > hd->buffer_size_max) {
+		/* Only ever sent and received in segments. */
+		message->buffer = kzalloc(message_size, gfp_flags);
+		if (!message->buffer)
+			goto err_free_message;
+	} else if (outbound && hd->driver->message_buffer_alloc) {
+		if (hd->driver->message_buffer_alloc(hd, message, message_size,
+						     gfp_flags))
+			goto err_free_message;
+		memset(message->buffer, 0, message_size);
+		message->hd_buffer = true;
+	} else {
+		message->buffer = kzalloc(message_size, gfp_flags);
+		if (!message->buffer)
+			goto err_free_message;
+	}
 
 	/* Initialize the message.  Operation id is filled in later. */
 	gb_operation_message_init(hd, message, 0, payload_size, type);
@@ -352,9 +525,13 @@ err_free_message:
 	return NULL;
 }
 
-static void gb_operation_message_free(struct gb_message *message)
+static void gb_operation_message_free(struct gb_host_device *hd,
+				      struct gb_message *message)
 {
-	kfree(message->buffer);
+	if (message->hd_buffer)
+		hd->driver->message_buffer_free(hd, message);
+	else
+		kfree(message->buffer);
 	kmem_cache_free(gb_message_cache, message);
 }
 
@@ -429,13 +606,16 @@ static u8 gb_operation_errno_map(int errno)
 bool gb_operation_response_alloc(struct gb_operation *operation,
 					size_t response_size, gfp_t gfp)
 {
-	struct gb_host_device *hd = operation->connection->hd;
 	struct gb_operation_msg_hdr *request_header;
 	struct gb_message *response;
+	bool outbound;
 	u8 type;
 
 	type = operation->type | GB_MESSAGE_TYPE_RESPONSE;
-	response = gb_operation_message_alloc(hd, type, response_size, gfp);
+	/* Only the response to an incoming request is sent by us. */
+	outbound = gb_operation_is_incoming(operation);
+	response = gb_operation_message_alloc(operation->connection, type,
+					      response_size, outbound, gfp);
 	if (!response)
 		return false;
 	response->operation = operation;
@@ -482,28 +662,30 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 				unsigned long op_flags, gfp_t gfp_flags)
 {
 	struct gb_host_device *hd = connection->hd;
+	bool incoming = op_flags & GB_OPERATION_FLAG_INCOMING;
 	struct gb_operation *operation;
 
 	operation = kmem_cache_zalloc(gb_operation_cache, gfp_flags);
 	if (!operation)
 		return NULL;
 	operation->connection = connection;
+	operation->flags = op_flags;
 
-	operation->request = gb_operation_message_alloc(hd, type, request_size,
+	operation->request = gb_operation_message_alloc(connection, type,
+							request_size, !incoming,
 							gfp_flags);
 	if (!operation->request)
 		goto err_cache;
 	operation->request->operation = operation;
 
 	/* Allocate the response buffer for outgoing operations */
-	if (!(op_flags & GB_OPERATION_FLAG_INCOMING)) {
+	if (!incoming) {
 		if (!gb_operation_response_alloc(operation, response_size,
 						 gfp_flags)) {
 			goto err_request;
 		}
 	}
 
-	operation->flags = op_flags;
 	operation->type = type;
 	operation->errno = -EBADR;  /* Initial value--means "never set" */
 
@@ -515,7 +697,7 @@ gb_operation_create_common(struct gb_connection *connection, u8 type,
 	return operation;
 
 err_request:
-	gb_operation_message_free(operation->request);
+	gb_operation_message_free(hd, operation->request);
 err_cache:
 	kmem_cache_free(gb_operation_cache, operation);
 
@@ -550,11 +732,22 @@ gb_operation_create_flags(struct gb_connection *connection,
 }
 EXPORT_SYMBOL_GPL(gb_operation_create_flags);
 
-size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+/*
+ * Messages on connections that support segmentation are only limited by what
+ * the message header can describe.
+ */
+size_t gb_operation_message_size_max(struct gb_connection *connection)
 {
-	struct gb_host_device *hd = connection->hd;
+	if (gb_connection_segmentation_enabled(connection))
+		return GB_OPERATION_MESSAGE_SIZE_MAX;
 
-	return hd->buffer_size_max - sizeof(struct gb_operation_msg_hdr);
+	return connection->hd->buffer_size_max;
+}
+
+size_t gb_operation_get_payload_size_max(struct gb_connection *connection)
+{
+	return gb_operation_message_size_max(connection) -
+			sizeof(struct gb_operation_msg_hdr);
 }
 EXPORT_SYMBOL_GPL(gb_operation_get_payload_size_max);
 
@@ -598,12 +791,14 @@ EXPORT_SYMBOL_GPL(gb_operation_get);
 static void _gb_operation_destroy(struct kref *kref)
 {
 	struct gb_operation *operation;
+	struct gb_host_device *hd;
 
 	operation = container_of(kref, struct gb_operation, kref);
+	hd = operation->connection->hd;
 
 	if (operation->response)
-		gb_operation_message_free(operation->response);
-	gb_operation_message_free(operation->request);
+		gb_operation_message_free(hd, operation->response);
+	gb_operation_message_free(hd, operation->request);
 
 	kmem_cache_free(gb_operation_cache, operation);
 }
@@ -621,6 +816,41 @@ void gb_operation_put(struct gb_operation *operation)
 }
 EXPORT_SYMBOL_GPL(gb_operation_put);
 
+/*
+ * Prepare a completed outgoing operation to be sent again, without
+ * reallocating it or rebuilding its request payload.
+ *
+ * The core is done with an operation once its callback has returned, but
+ * the caller must make sure nobody else (e.g. a canceller) still uses it.
+ * Returns -EBUSY if the host device still holds on to the request.
+ */
+int gb_operation_reinit(struct gb_operation *operation)
+{
+	struct gb_message *request = operation->request;
+	struct gb_message *response = operation->response;
+
+	if (WARN_ON(gb_operation_is_incoming(operation)))
+		return -EINVAL;
+
+	if (WARN_ON(request->hcpriv || !list_empty(&request->tx_links) ||
+		    !list_empty(&request->hc_links) ||
+		    atomic_read(&operation->completion_pending)))
+		return -EBUSY;
+
+	operation->errno = -EBADR;
+	reinit_completion(&operation->completion);
+
+	/* Undo any truncation by a short response */
+	if (response) {
+		response->payload_size = response->buffer_size -
+						sizeof(*response->header);
+	}
+	operation->segment_offset = 0;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gb_operation_reinit);
+
 /* Tell the requester we're done */
 static void gb_operation_sync_callback(struct gb_operation *operation)
 {
@@ -664,6 +894,9 @@ int gb_operation_request_send(struct gb_operation *operation,
 
 	gb_operation_result_set(operation, -EINPROGRESS);
 
+	/* Completes once the result is set and the request is released. */
+	atomic_set(&operation->completion_pending, 2);
+
 	/*
 	 * Get an extra reference on the operation. It'll be dropped when the
 	 * operation completes.
@@ -779,14 +1012,19 @@ err_put:
 }
 
 /*
- * This function is called when a message send request has completed.
+ * A message send request has completed, or the message was cancelled before
+ * it was handed to the host driver.
  */
-void greybus_message_sent(struct gb_host_device *hd,
-					struct gb_message *message, int status)
+static void gb_operation_message_sent(struct gb_message *message, int status)
 {
 	struct gb_operation *operation = message->operation;
 	struct gb_connection *connection = operation->connection;
 
+	if (message->parent) {
+		gb_message_segment_sent(message, status);
+		return;
+	}
+
 	/*
 	 * If the message was a response, we just need to drop our
 	 * reference to the operation.  If an error occurred, report
@@ -802,16 +1040,31 @@ void greybus_message_sent(struct gb_host_device *hd,
 			dev_err(&connection->hd->dev,
 				"%s: error sending response 0x%02x: %d\n",
 				connection->name, operation->type, status);
+		} else if (operation->callback) {
+			operation->callback(operation);
 		}
 		gb_operation_put_active(operation);
 		gb_operation_put(operation);
-	} else if (status) {
-		if (gb_operation_result_set(operation, status)) {
-			queue_work(gb_operation_completion_wq,
-					&operation->work);
-		}
+	} else {
+		if (status && gb_operation_result_set(operation, status))
+			gb_operation_complete_outgoing(operation);
+
+		/* The host device driver is done with the request. */
+		gb_operation_complete_outgoing(operation);
 	}
 }
+
+/*
+ * This function is called when a message send request has completed.
+ */
+void greybus_message_sent(struct gb_host_device *hd,
+					struct gb_message *message, int status)
+{
+	gb_operation_message_sent(message, status);
+
+	/* Let the next queued message go. */
+	gb_hd_message_sent(hd);
+}
 EXPORT_SYMBOL_GPL(greybus_message_sent);
 
 /*
@@ -826,6 +1079,7 @@ static void gb_connection_recv_request(struct gb_connection *connection,
 				       void *data, size_t size)
 {
 	struct gb_operation *operation;
+	ktime_t received = ktime_get();
 	int ret;
 
 	operation = gb_operation_create_incoming(connection, operation_id,
@@ -843,6 +1097,7 @@ static void gb_connection_recv_request(struct gb_connection *connection,
 		return;
 	}
 	trace_gb_message_recv_request(operation->request);
+	operation->received = received;
 
 	/*
 	 * The initial reference to the operation will be dropped when the
@@ -852,6 +1107,157 @@ static void gb_connection_recv_request(struct gb_connection *connection,
 		queue_work(connection->wq, &operation->work);
 }
 
+static void gb_connection_rx_segments_free(struct gb_connection *connection)
+{
+	kfree(connection->rx_segments);
+	connection->rx_segments = NULL;
+	connection->rx_segments_size = 0;
+}
+
+/*
+ * Append a segment of a request that was split up by the sender. The
+ * segments of a request arrive back to back; the first one also provides
+ * the request header, and the request is handled once the last one is in.
+ *
+ * This is called in interrupt context.
+ */
+static void gb_connection_recv_request_segment(struct gb_connection *connection,
+			u16 operation_id, u8 type, bool more,
+			void *data, size_t size)
+{
+	struct gb_operation_msg_hdr *header = connection->rx_segments;
+	size_t payload_size = size - sizeof(*header);
+	size_t message_size;
+	void *buf;
+
+	if (header && (le16_to_cpu(header->operation_id) != operation_id ||
+		       header->type != type)) {
+		dev_err(&connection->hd->dev,
+			"%s: incomplete request 0x%04x of type 0x%02x dropped\n",
+			connection->name, le16_to_cpu(header->operation_id),
+			header->type);
+		gb_connection_rx_segments_free(connection);
+		header = NULL;
+
+		if (!more) {
+			gb_connection_recv_request(connection, operation_id,
+						   type, data, size);
+			return;
+		}
+	}
+
+	if (header)
+		message_size = connection->rx_segments_size + payload_size;
+	else
+		message_size = size;
+
+	if (message_size > GB_OPERATION_MESSAGE_SIZE_MAX) {
+		dev_err(&connection->hd->dev,
+			"%s: oversized request 0x%04x of type 0x%02x dropped\n",
+			connection->name, operation_id, type);
+		gb_connection_rx_segments_free(connection);
+		return;
+	}
+
+	buf = krealloc(connection->rx_segments, message_size, GFP_ATOMIC);
+	if (!buf) {
+		dev_err(&connection->hd->dev,
+			"%s: can't reassemble request 0x%04x of type 0x%02x\n",
+			connection->name, operation_id, type);
+		gb_connection_rx_segments_free(connection);
+		return;
+	}
+
+	if (header)
+		memcpy(buf + connection->rx_segments_size,
+		       data + sizeof(*header), payload_size);
+	else
+		memcpy(buf, data, size);
+
+	connection->rx_segments = buf;
+	connection->rx_segments_size = message_size;
+
+	if (more)
+		return;
+
+	header = buf;
+	header->size = cpu_to_le16(message_size);
+	header->pad[1] = 0;
+
+	gb_connection_recv_request(connection, operation_id, type, buf,
+				   message_size);
+	gb_connection_rx_segments_free(connection);
+}
+
+/*
+ * Append a segment of a response that was split up by the sender. Segments
+ * arrive in order; the first one also provides the response header, and the
+ * operation completes with the last one.
+ *
+ * This is called in interrupt context.
+ */
+static void gb_connection_recv_response_segment(struct gb_connection *connection,
+			struct gb_operation *operation, u8 result, bool more,
+			void *data, size_t size)
+{
+	struct gb_message *message = operation->response;
+	struct gb_operation_msg_hdr *header = message->header;
+	size_t message_size = sizeof(*header) + message->payload_size;
+	size_t payload_size = size - sizeof(*header);
+	int errno = gb_operation_status_map(result);
+
+	/* Late segments of a completed or cancelled operation are dropped. */
+	if (READ_ONCE(operation->errno) != -EINPROGRESS)
+		return;
+
+	if (errno) {
+		memcpy(header, data, sizeof(*header));
+		goto complete;
+	}
+
+	if (!operation->segment_offset) {
+		memcpy(header, data, sizeof(*header));
+		operation->segment_offset = sizeof(*header);
+	}
+
+	if (operation->segment_offset + payload_size > message_size) {
+		dev_err(&connection->hd->dev,
+			"%s: malformed response segment 0x%02x received (%zu > %zu)\n",
+			connection->name, header->type,
+			operation->segment_offset + payload_size,
+			message_size);
+		errno = -EMSGSIZE;
+		goto complete;
+	}
+
+	memcpy(message->buffer + operation->segment_offset,
+	       data + sizeof(*header), payload_size);
+	operation->segment_offset += payload_size;
+
+	if (more)
+		return;
+
+	if (operation->segment_offset < message_size) {
+		if (gb_operation_short_response_allowed(operation)) {
+			message->payload_size = operation->segment_offset -
+						sizeof(*header);
+		} else {
+			dev_err(&connection->hd->dev,
+				"%s: short response 0x%02x received (%zu < %zu)\n",
+				connection->name, header->type,
+				operation->segment_offset, message_size);
+			errno = -EMSGSIZE;
+		}
+	}
+	header->size = cpu_to_le16(operation->segment_offset);
+complete:
+	trace_gb_message_recv_response(message);
+
+	/* The rest will be handled in work queue context */
+	if (gb_operation_result_set(operation, errno))
+		gb_operation_complete_outgoing(operation);
+}
+
 /*
  * We've received data that appears to be an operation response
  * message.  Look up the operation, and record that we've received
@@ -861,7 +1267,8 @@ static void gb_connection_recv_request(struct gb_connection *connection,
  * data into the response buffer and handle the rest via workqueue.
  */
 static void gb_connection_recv_response(struct gb_connection *connection,
-			u16 operation_id, u8 result, void *data, size_t size)
+			u16 operation_id, u8 result, bool more,
+			void *data, size_t size)
 {
 	struct gb_operation_msg_hdr *header;
 	struct gb_operation *operation;
@@ -877,6 +1284,13 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 		return;
 	}
 
+	if (more || operation->segment_offset) {
+		gb_connection_recv_response_segment(connection, operation,
+						    result, more, data, size);
+		gb_operation_put(operation);
+		return;
+	}
+
 	message = operation->response;
 	header = message->header;
 	message_size = sizeof(*header) + message->payload_size;
@@ -906,7 +1320,7 @@ static void gb_connection_recv_response(struct gb_connection *connection,
 	/* The rest will be handled in work queue context */
 	if (gb_operation_result_set(operation, errno)) {
 		memcpy(header, data, size);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		gb_operation_complete_outgoing(operation);
 	}
 
 	gb_operation_put(operation);
@@ -924,6 +1338,7 @@ void gb_connection_recv(struct gb_connection *connection,
 	struct device *dev = &connection->hd->dev;
 	size_t msg_size;
 	u16 operation_id;
+	bool more;
 
 	if (connection->state != GB_CONNECTION_STATE_ENABLED &&
 		connection->state != GB_CONNECTION_STATE_ENABLED_TX) {
@@ -949,12 +1364,20 @@ void gb_connection_recv(struct gb_connection *connection,
 	}
 
 	operation_id = le16_to_cpu(header.operation_id);
-	if (header.type & GB_MESSAGE_TYPE_RESPONSE)
+	more = gb_connection_segmentation_enabled(connection) &&
+			(header.pad[1] & GB_OPERATION_SEGMENT_MORE);
+	if (header.type & GB_MESSAGE_TYPE_RESPONSE) {
 		gb_connection_recv_response(connection, operation_id,
-						header.result, data, msg_size);
-	else
+						header.result, more, data,
+						msg_size);
+	} else if (more || connection->rx_segments) {
+		gb_connection_recv_request_segment(connection, operation_id,
+						   header.type, more, data,
+						   msg_size);
+	} else {
 		gb_connection_recv_request(connection, operation_id,
 						header.type, data, msg_size);
+	}
 }
 
 /*
@@ -968,7 +1391,7 @@ void gb_operation_cancel(struct gb_operation *operation, int errno)
 
 	if (gb_operation_result_set(operation, errno)) {
 		gb_message_cancel(operation->request);
-		queue_work(gb_operation_completion_wq, &operation->work);
+		gb_operation_complete_outgoing(operation);
 	}
 	trace_gb_message_cancel_outgoing(operation->request);
 
@@ -1005,6 +1428,132 @@ void gb_operation_cancel_incoming(struct gb_operation *operation, int errno)
 	atomic_dec(&operation->waiters);
 }
 
+void gb_operation_window_init(struct gb_operation_window *window,
+			unsigned int depth, unsigned int timeout,
+			void (*complete)(struct gb_operation_window *window,
+					 struct gb_operation *operation))
+{
+	memset(window, 0, sizeof(*window));
+	window->depth = clamp_t(unsigned int, depth, 1,
+				GB_OPERATION_WINDOW_MAX);
+	window->timeout = timeout;
+	window->complete = complete;
+}
+EXPORT_SYMBOL_GPL(gb_operation_window_init);
+
+static void gb_operation_window_callback(struct gb_operation *operation)
+{
+	struct gb_operation_window *window = operation->window;
+
+	complete(&operation->completion);
+
+	if (window->complete)
+		window->complete(window, operation);
+}
+
+/*
+ * Send an operation as the newest one of a window. The window takes over the
+ * caller's reference to the operation, and gives it back when the operation
+ * is taken off the window. The caller keeps its reference on failure.
+ */
+int gb_operation_window_send(struct gb_operation_window *window,
+			     struct gb_operation *operation, gfp_t gfp)
+{
+	unsigned int slot;
+	int ret;
+
+	if (WARN_ON(gb_operation_window_full(window)))
+		return -EBUSY;
+
+	/* The operation may complete before the send returns. */
+	slot = (window->head + window->count) % GB_OPERATION_WINDOW_MAX;
+	window->ops[slot] = operation;
+	window->count++;
+
+	operation->window = window;
+	reinit_completion(&operation->completion);
+
+	ret = gb_operation_request_send(operation,
+					gb_operation_window_callback, gfp);
+	if (ret) {
+		window->ops[slot] = NULL;
+		window->count--;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(gb_operation_window_send);
+
+/*
+ * Take the oldest operation off a window if it has completed, or return
+ * NULL.
+ */
+struct gb_operation *
+gb_operation_window_pop(struct gb_operation_window *window)
+{
+	struct gb_operation *operation;
+
+	if (!window->count)
+		return NULL;
+
+	operation = window->ops[window->head];
+	if (!completion_done(&operation->completion))
+		return NULL;
+
+	window->ops[window->head] = NULL;
+	window->head = (window->head + 1) % GB_OPERATION_WINDOW_MAX;
+	window->count--;
+
+	return operation;
+}
+EXPORT_SYMBOL_GPL(gb_operation_window_pop);
+
+/*
+ * Wait for the oldest operation of a window to complete, cancelling it if it
+ * times out, and take it off the window. Can not be used on windows with a
+ * complete function.
+ */
+struct gb_operation *
+gb_operation_window_retire(struct gb_operation_window *window)
+{
+	struct gb_operation *operation;
+	unsigned long timeout;
+
+	if (WARN_ON(!window->count || window->complete))
+		return NULL;
+
+	if (window->timeout)
+		timeout = msecs_to_jiffies(window->timeout);
+	else
+		timeout = MAX_SCHEDULE_TIMEOUT;
+
+	operation = window->ops[window->head];
+	if (!wait_for_completion_timeout(&operation->completion, timeout))
+		gb_operation_cancel(operation, -ETIMEDOUT);
+
+	return gb_operation_window_pop(window);
+}
+EXPORT_SYMBOL_GPL(gb_operation_window_retire);
+
+/*
+ * Cancel the operations of a window, oldest first, and drop them. Can not be
+ * used on windows with a complete function.
+ */
+void gb_operation_window_flush(struct gb_operation_window *window, int errno)
+{
+	struct gb_operation *operation;
+
+	if (WARN_ON(window->complete))
+		return;
+
+	while (window->count) {
+		operation = window->ops[window->head];
+		gb_operation_cancel(operation, errno);
+		gb_operation_put(gb_operation_window_pop(window));
+	}
+}
+EXPORT_SYMBOL_GPL(gb_operation_window_flush);
+
 /**
  * gb_operation_sync: implement a "simple" synchronous gb operation.
  * @connection: the Greybus connection to send this to
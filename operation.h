@@ -11,6 +11,7 @@
 #define __OPERATION_H
 
 #include <linux/completion.h>
+#include <linux/ktime.h>
 
 struct gb_operation;
 
@@ -48,8 +49,10 @@ enum gb_operation_result {
 
 /*
  * Protocol code should only examine the payload and payload_size fields, and
- * host-controller drivers may use the hcpriv field. All other fields are
- * intended to be private to the operations core code.
+ * host-controller drivers may use the hcpriv and hc_links fields. Host drivers
+ * that allocate message buffers themselves also own buffer_dma, which is only
+ * valid when hd_buffer is set. All other fields are intended to be private to
+ * the operations core code.
  */
 struct gb_message {
 	struct gb_operation		*operation;
@@ -59,8 +62,21 @@ struct gb_message {
 	size_t				payload_size;
 
 	void				*buffer;
+	size_t				buffer_size;
+	dma_addr_t			buffer_dma;
+	bool				hd_buffer;
 
 	void				*hcpriv;
+	struct list_head		hc_links;
+
+	struct list_head		tx_links;	/* connection->tx_queue */
+
+	/* Segmented transmission of messages larger than the host buffers */
+	struct gb_message		*parent;
+	struct gb_message		**segments;
+	unsigned int			num_segments;
+	atomic_t			segments_pending;
+	int				segments_status;
 };
 
 #define GB_OPERATION_FLAG_INCOMING		BIT(0)
@@ -86,7 +102,17 @@ struct gb_message {
  *
  * In addition, every operation has a result, which is an errno
  * value.  Protocol handlers access the operation result using
- * gb_operation_result().
+ * gb_operation_result(), and may attach data of their own to an
+ * operation using gb_operation_set_data().
+ *
+ * For incoming requests, the request handler may set the callback, which
+ * is then called once the response has been sent successfully, possibly
+ * in atomic context. The received and handled timestamps record the
+ * arrival of the request and the return of its handler.
+ *
+ * For outgoing requests, the callback is not called before the host device
+ * driver has released the request message, even if the response (or an
+ * error) arrives first.
  */
 typedef void (*gb_operation_callback)(struct gb_operation *);
 struct gb_operation {
@@ -102,12 +128,21 @@ struct gb_operation {
 	struct work_struct	work;
 	gb_operation_callback	callback;
 	struct completion	completion;
+	atomic_t		completion_pending;	/* outgoing only */
 
 	struct kref		kref;
 	atomic_t		waiters;
 
 	int			active;
 	struct list_head	links;		/* connection->operations */
+
+	size_t			segment_offset;	/* response reassembly */
+
+	struct gb_operation_window *window;	/* outgoing only */
+	void			*private;
+
+	ktime_t			received;	/* incoming requests only */
+	ktime_t			handled;
 };
 
 static inline bool
@@ -128,11 +163,78 @@ gb_operation_short_response_allowed(struct gb_operation *operation)
 	return operation->flags & GB_OPERATION_FLAG_SHORT_RESPONSE;
 }
 
+static inline void *gb_operation_get_data(struct gb_operation *operation)
+{
+	return operation->private;
+}
+
+static inline void gb_operation_set_data(struct gb_operation *operation,
+					 void *data)
+{
+	operation->private = data;
+}
+
+/*
+ * A window of outgoing operations kept in flight on a connection and retired
+ * in the order they were sent, for protocols splitting a transfer over
+ * several operations. Calls on a window must be serialised by its user.
+ *
+ * Synchronous users retire operations with gb_operation_window_retire().
+ * Others set a complete function, which is called from the callback of every
+ * operation of the window, and take completed operations off the window with
+ * gb_operation_window_pop().
+ */
+#define GB_OPERATION_WINDOW_MAX		16
+
+struct gb_operation_window {
+	struct gb_operation	*ops[GB_OPERATION_WINDOW_MAX];
+	unsigned int		head;		/* oldest operation */
+	unsigned int		count;
+	unsigned int		depth;
+	unsigned int		timeout;	/* ms, 0 for none */
+	void			(*complete)(struct gb_operation_window *window,
+					    struct gb_operation *operation);
+};
+
+static inline bool
+gb_operation_window_empty(struct gb_operation_window *window)
+{
+	return !window->count;
+}
+
+static inline bool
+gb_operation_window_full(struct gb_operation_window *window)
+{
+	return window->count >= window->depth;
+}
+
+/* The oldest operation of a window, or NULL if it is empty */
+static inline struct gb_operation *
+gb_operation_window_oldest(struct gb_operation_window *window)
+{
+	return window->count ? window->ops[window->head] : NULL;
+}
+
+/* The operation last sent on a window, or NULL if it is empty */
+static inline struct gb_operation *
+gb_operation_window_newest(struct gb_operation_window *window)
+{
+	unsigned int slot;
+
+	if (!window->count)
+		return NULL;
+
+	slot = (window->head + window->count - 1) % GB_OPERATION_WINDOW_MAX;
+
+	return window->ops[slot];
+}
+
 void gb_connection_recv(struct gb_connection *connection,
 					void *data, size_t size);
 
 int gb_operation_result(struct gb_operation *operation);
 
+size_t gb_operation_message_size_max(struct gb_connection *connection);
 size_t gb_operation_get_payload_size_max(struct gb_connection *connection);
 struct gb_operation *
 gb_operation_create_flags(struct gb_connection *connection,
@@ -151,6 +253,7 @@ gb_operation_create(struct gb_connection *connection,
 
 void gb_operation_get(struct gb_operation *operation);
 void gb_operation_put(struct gb_operation *operation);
+int gb_operation_reinit(struct gb_operation *operation);
 
 bool gb_operation_response_alloc(struct gb_operation *operation,
 					size_t response_size, gfp_t gfp);
@@ -170,6 +273,18 @@ gb_operation_request_send_sync(struct gb_operation *operation)
 void gb_operation_cancel(struct gb_operation *operation, int errno);
 void gb_operation_cancel_incoming(struct gb_operation *operation, int errno);
 
+void gb_operation_window_init(struct gb_operation_window *window,
+			unsigned int depth, unsigned int timeout,
+			void (*complete)(struct gb_operation_window *window,
+					 struct gb_operation *operation));
+int gb_operation_window_send(struct gb_operation_window *window,
+			     struct gb_operation *operation, gfp_t gfp);
+struct gb_operation *
+gb_operation_window_pop(struct gb_operation_window *window);
+struct gb_operation *
+gb_operation_window_retire(struct gb_operation_window *window);
+void gb_operation_window_flush(struct gb_operation_window *window, int errno);
+
 void greybus_message_sent(struct gb_host_device *hd,
 				struct gb_message *message, int status);
 
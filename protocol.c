@@ -41,6 +41,37 @@ static struct gb_protocol *gb_protocol_find(u8 id, u8 major, u8 minor)
 	return NULL;
 }
 
+/*
+ * Caller must hold gb_protocols_lock.
+ *
+ * Minor versions are backwards compatible, so a request for version
+ * major.minor is satisfied by the newest registered protocol with the same
+ * major version and a minor version no older than the requested one.
+ */
+static struct gb_protocol *gb_protocol_find_compatible(u8 id, u8 major,
+							u8 minor)
+{
+	struct gb_protocol *protocol;
+
+	list_for_each_entry(protocol, &gb_protocols, links) {
+		if (protocol->id < id)
+			continue;
+		if (protocol->id > id)
+			break;
+
+		if (protocol->major > major)
+			continue;
+		if (protocol->major < major)
+			break;
+
+		if (protocol->minor < minor)
+			break;
+
+		return protocol;
+	}
+	return NULL;
+}
+
 int __gb_protocol_register(struct gb_protocol *protocol, struct module *module)
 {
 	struct gb_protocol *existing;
@@ -124,7 +155,7 @@ struct gb_protocol *gb_protocol_get(u8 id, u8 major, u8 minor)
 	u8 protocol_count;
 
 	spin_lock_irq(&gb_protocols_lock);
-	protocol = gb_protocol_find(id, major, minor);
+	protocol = gb_protocol_find_compatible(id, major, minor);
 	if (protocol) {
 		if (!try_module_get(protocol->owner)) {
 			protocol = NULL;
@@ -27,6 +27,7 @@ struct gb_protocol {
 	u8			major;
 	u8			minor;
 	u8			count;
+	unsigned int		tx_weight;	/* 0 for the default */
 
 	struct list_head	links;		/* global list */
 
@@ -17,13 +17,27 @@
 #include "greybus.h"
 #include "gpbridge.h"
 
+/* Number of transfer operations a data request keeps in flight */
+#define GB_SDIO_XFER_DEPTH	4
+
+/* Number of requests that can be prepared ahead of being issued */
+#define GB_SDIO_PREP_SLOTS	2
+
+/* Transfer operations built by pre_req for one request's data */
+struct gb_sdio_prep {
+	struct mmc_data		*data;
+	struct gb_operation	**ops;
+	unsigned int		nr_ops;
+};
+
 struct gb_sdio_host {
 	struct gb_connection	*connection;
 	struct mmc_host		*mmc;
 	struct mmc_request	*mrq;
 	struct mutex		lock;	/* lock for this host */
 	size_t			data_max;
-	void			*xfer_buffer;
+	struct gb_operation_window window;
+	struct gb_sdio_prep	prep[GB_SDIO_PREP_SLOTS];
 	spinlock_t		xfer;	/* lock to cancel ongoing transfer */
 	bool			xfer_stop;
 	struct workqueue_struct	*mrq_workqueue;
@@ -239,97 +253,182 @@ static int gb_sdio_set_ios(struct gb_sdio_host *host,
 				 request, sizeof(*request), NULL, 0);
 }
 
-static int _gb_sdio_send(struct gb_sdio_host *host, struct mmc_data *data,
-			 size_t len, u16 nblocks, off_t skip)
+static bool gb_sdio_xfer_stopped(struct gb_sdio_host *host)
+{
+	bool stop;
+
+	/* check if a stop transmission is pending */
+	spin_lock(&host->xfer);
+	stop = host->xfer_stop;
+	host->xfer_stop = false;
+	spin_unlock(&host->xfer);
+
+	return stop;
+}
+
+static size_t gb_sdio_chunk_len(struct gb_sdio_host *host,
+				struct mmc_data *data, size_t left,
+				u16 *nblocks)
+{
+	size_t len = min(left, host->data_max);
+
+	*nblocks = len / data->blksz;
+
+	return *nblocks * data->blksz;
+}
+
+/*
+ * Build the transfer operation for one chunk. For writes the data is
+ * gathered from the scatterlist into the request payload straight away.
+ */
+static struct gb_operation *
+gb_sdio_chunk_create(struct gb_sdio_host *host, struct mmc_data *data,
+		     size_t len, u16 nblocks, off_t skip, gfp_t gfp)
 {
 	struct gb_sdio_transfer_request *request;
-	struct gb_sdio_transfer_response response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
+	struct gb_operation *operation;
+	size_t request_size = sizeof(*request);
+	size_t response_size = sizeof(struct gb_sdio_transfer_response);
+	bool read = data->flags & MMC_DATA_READ;
 	size_t copied;
-	u16 send_blksz;
-	u16 send_blocks;
-	int ret;
 
 	WARN_ON(len > host->data_max);
 
-	request = host->xfer_buffer;
+	if (read)
+		response_size += len;
+	else
+		request_size += len;
+
+	operation = gb_operation_create(host->connection,
+					GB_SDIO_TYPE_TRANSFER, request_size,
+					response_size, gfp);
+	if (!operation)
+		return ERR_PTR(-ENOMEM);
+
+	request = operation->request->payload;
 	request->data_flags = (data->flags >> 8);
 	request->data_blocks = cpu_to_le16(nblocks);
 	request->data_blksz = cpu_to_le16(data->blksz);
 
-	copied = sg_pcopy_to_buffer(sg, sg_len, &request->data[0], len, skip);
+	if (!read) {
+		copied = sg_pcopy_to_buffer(data->sg, data->sg_len,
+					    &request->data[0], len, skip);
+		if (copied != len) {
+			gb_operation_put(operation);
+			return ERR_PTR(-EINVAL);
+		}
+	}
 
-	if (copied != len)
-		return -EINVAL;
+	return operation;
+}
 
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				request, len + sizeof(*request),
-				&response, sizeof(response));
+/*
+ * Retire the oldest chunk in flight, check its response and, for reads,
+ * copy the data it carries into place at offset skip. The length of the
+ * chunk is returned through len.
+ */
+static int gb_sdio_chunk_retire(struct gb_sdio_host *host,
+				struct mmc_data *data, off_t skip, size_t *len)
+{
+	struct gb_sdio_transfer_response *response;
+	struct gb_sdio_transfer_request *request;
+	struct gb_operation *operation;
+	bool read = data->flags & MMC_DATA_READ;
+	size_t copied;
+	u16 blksz;
+	u16 blocks;
+	int ret;
+
+	operation = gb_operation_window_retire(&host->window);
+
+	request = operation->request->payload;
+	*len = le16_to_cpu(request->data_blocks) *
+	       le16_to_cpu(request->data_blksz);
+
+	ret = gb_operation_result(operation);
 	if (ret < 0)
-		return ret;
+		goto out;
 
-	send_blocks = le16_to_cpu(response.data_blocks);
-	send_blksz = le16_to_cpu(response.data_blksz);
+	response = operation->response->payload;
+	blocks = le16_to_cpu(response->data_blocks);
+	blksz = le16_to_cpu(response->data_blksz);
 
-	if (len != send_blksz * send_blocks) {
-		dev_err(mmc_dev(host->mmc), "send: size received: %zu != %d\n",
-			len, send_blksz * send_blocks);
-		return -EINVAL;
+	if (*len != blksz * blocks) {
+		dev_err(mmc_dev(host->mmc), "%s: size received: %d != %zu\n",
+			read ? "recv" : "send", blksz * blocks, *len);
+		ret = -EINVAL;
+		goto out;
 	}
 
+	if (read) {
+		copied = sg_pcopy_from_buffer(data->sg, data->sg_len,
+					      &response->data[0], *len, skip);
+		if (copied != *len)
+			ret = -EINVAL;
+	}
+
+out:
+	gb_operation_put(operation);
+
 	return ret;
 }
 
-static int _gb_sdio_recv(struct gb_sdio_host *host, struct mmc_data *data,
-			 size_t len, u16 nblocks, off_t skip)
+static struct gb_sdio_prep *gb_sdio_prep_get(struct gb_sdio_host *host,
+					      struct mmc_data *data)
 {
-	struct gb_sdio_transfer_request request;
-	struct gb_sdio_transfer_response *response;
-	struct scatterlist *sg = data->sg;
-	unsigned int sg_len = data->sg_len;
-	size_t copied;
-	u16 recv_blksz;
-	u16 recv_blocks;
-	int ret;
+	struct gb_sdio_prep *prep;
+	int cookie = data->host_cookie;
 
-	WARN_ON(len > host->data_max);
-
-	request.data_flags = (data->flags >> 8);
-	request.data_blocks = cpu_to_le16(nblocks);
-	request.data_blksz = cpu_to_le16(data->blksz);
+	if (cookie <= 0 || cookie > GB_SDIO_PREP_SLOTS)
+		return NULL;
 
-	response = host->xfer_buffer;
+	prep = &host->prep[cookie - 1];
+	if (prep->data != data)
+		return NULL;
 
-	ret = gb_operation_sync(host->connection, GB_SDIO_TYPE_TRANSFER,
-				&request, sizeof(request), response, len +
-				sizeof(*response));
-	if (ret < 0)
-		return ret;
+	return prep;
+}
 
-	recv_blocks = le16_to_cpu(response->data_blocks);
-	recv_blksz = le16_to_cpu(response->data_blksz);
+static void gb_sdio_prep_release(struct gb_sdio_host *host,
+				 struct gb_sdio_prep *prep)
+{
+	unsigned int i;
 
-	if (len != recv_blksz * recv_blocks) {
-		dev_err(mmc_dev(host->mmc), "recv: size received: %d != %zu\n",
-			recv_blksz * recv_blocks, len);
-		return -EINVAL;
+	for (i = 0; i < prep->nr_ops; i++) {
+		if (prep->ops[i])
+			gb_operation_put(prep->ops[i]);
 	}
+	kfree(prep->ops);
 
-	copied = sg_pcopy_from_buffer(sg, sg_len, &response->data[0], len,
-				      skip);
-	if (copied != len)
-		return -EINVAL;
-
-	return 0;
+	spin_lock(&host->xfer);
+	prep->ops = NULL;
+	prep->nr_ops = 0;
+	prep->data = NULL;
+	spin_unlock(&host->xfer);
 }
 
+/*
+ * Up to GB_SDIO_XFER_DEPTH chunks are kept in flight. They are retired in
+ * submission order, so bytes_xfered only ever counts a prefix of the data
+ * that made it through. After an error or a stop transmission no further
+ * chunks are issued, but the ones already sent are waited for.
+ *
+ * Chunks prepared by gb_mmc_pre_req() are used as they are; anything else is
+ * built here.
+ */
 static int gb_sdio_transfer(struct gb_sdio_host *host, struct mmc_data *data)
 {
+	struct gb_operation_window *window = &host->window;
+	struct gb_sdio_prep *prep = gb_sdio_prep_get(host, data);
+	struct gb_operation *operation;
+	unsigned int sent = 0;
 	size_t left, len;
 	off_t skip = 0;
+	off_t done = 0;
+	bool failed = false;
 	int ret = 0;
 	u16 nblocks;
+	int err;
 
 	if (single_op(data->mrq->cmd) && data->blocks > 1) {
 		ret = -ETIMEDOUT;
@@ -338,32 +437,51 @@ static int gb_sdio_transfer(struct gb_sdio_host *host, struct mmc_data *data)
 
 	left = data->blksz * data->blocks;
 
-	while (left) {
-		/* check is a stop transmission is pending */
-		spin_lock(&host->xfer);
-		if (host->xfer_stop) {
-			host->xfer_stop = false;
-			spin_unlock(&host->xfer);
-			ret = -EINTR;
-			goto out;
+	for (;;) {
+		while (!ret && left && !gb_operation_window_full(window)) {
+			if (gb_sdio_xfer_stopped(host)) {
+				ret = -EINTR;
+				break;
+			}
+			len = gb_sdio_chunk_len(host, data, left, &nblocks);
+
+			if (prep && sent < prep->nr_ops && prep->ops[sent]) {
+				operation = prep->ops[sent];
+				prep->ops[sent] = NULL;
+			} else {
+				operation = gb_sdio_chunk_create(host, data,
+								 len, nblocks,
+								 skip,
+								 GFP_KERNEL);
+				if (IS_ERR(operation)) {
+					ret = PTR_ERR(operation);
+					break;
+				}
+			}
+
+			ret = gb_operation_window_send(window, operation,
+						       GFP_KERNEL);
+			if (ret < 0) {
+				gb_operation_put(operation);
+				break;
+			}
+			sent++;
+			left -= len;
+			skip += len;
 		}
-		spin_unlock(&host->xfer);
-		len = min(left, host->data_max);
-		nblocks = len / data->blksz;
-		len = nblocks * data->blksz;
-
-		if (data->flags & MMC_DATA_READ) {
-			ret = _gb_sdio_recv(host, data, len, nblocks, skip);
-			if (ret < 0)
-				goto out;
-		} else {
-			ret = _gb_sdio_send(host, data, len, nblocks, skip);
-			if (ret < 0)
-				goto out;
+
+		if (gb_operation_window_empty(window))
+			break;
+
+		err = gb_sdio_chunk_retire(host, data, done, &len);
+		done += len;
+		if (err < 0) {
+			if (!ret)
+				ret = err;
+			failed = true;
 		}
-		data->bytes_xfered += len;
-		left -= len;
-		skip += len;
+		if (!failed)
+			data->bytes_xfered += len;
 	}
 
 out:
@@ -699,8 +817,99 @@ static int gb_mmc_get_cd(struct mmc_host *mmc)
 	return host->card_present;
 }
 
+/*
+ * Called by the MMC core for the next request while the current one is still
+ * transferring. Allocate that request's transfer operations and gather its
+ * write data now, so that only sending is left once the request is issued.
+ * On any failure the request is simply left unprepared.
+ */
+static void gb_mmc_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			   bool is_first_req)
+{
+	struct gb_sdio_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	struct gb_sdio_prep *prep = NULL;
+	struct gb_operation **ops;
+	unsigned int nr_ops;
+	unsigned int i;
+	size_t left, len, chunk_max;
+	off_t skip = 0;
+	u16 nblocks;
+
+	if (!data || data->host_cookie)
+		return;
+
+	if (single_op(mrq->cmd) && data->blocks > 1)
+		return;
+
+	left = data->blksz * data->blocks;
+	chunk_max = gb_sdio_chunk_len(host, data, left, &nblocks);
+	if (!chunk_max)
+		return;
+	nr_ops = DIV_ROUND_UP(left, chunk_max);
+
+	ops = kcalloc(nr_ops, sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return;
+
+	for (i = 0; i < nr_ops; i++) {
+		len = gb_sdio_chunk_len(host, data, left, &nblocks);
+		ops[i] = gb_sdio_chunk_create(host, data, len, nblocks, skip,
+					      GFP_KERNEL);
+		if (IS_ERR(ops[i]))
+			goto err_put_ops;
+		left -= len;
+		skip += len;
+	}
+
+	spin_lock(&host->xfer);
+	for (i = 0; i < GB_SDIO_PREP_SLOTS; i++) {
+		if (!host->prep[i].data) {
+			prep = &host->prep[i];
+			prep->data = data;
+			prep->ops = ops;
+			prep->nr_ops = nr_ops;
+			break;
+		}
+	}
+	spin_unlock(&host->xfer);
+
+	if (!prep) {
+		i = nr_ops;
+		goto err_put_ops;
+	}
+
+	data->host_cookie = prep - host->prep + 1;
+
+	return;
+
+err_put_ops:
+	while (i--)
+		gb_operation_put(ops[i]);
+	kfree(ops);
+}
+
+static void gb_mmc_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+			    int err)
+{
+	struct gb_sdio_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	struct gb_sdio_prep *prep;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	prep = gb_sdio_prep_get(host, data);
+	if (prep)
+		gb_sdio_prep_release(host, prep);
+
+	data->host_cookie = 0;
+}
+
 static const struct mmc_host_ops gb_sdio_ops = {
 	.request	= gb_mmc_request,
+	.pre_req	= gb_mmc_pre_req,
+	.post_req	= gb_mmc_post_req,
 	.set_ios	= gb_mmc_set_ios,
 	.get_ro		= gb_mmc_get_ro,
 	.get_cd		= gb_mmc_get_cd,
@@ -710,7 +919,6 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 {
 	struct mmc_host *mmc;
 	struct gb_sdio_host *host;
-	size_t max_buffer;
 	int ret = 0;
 
 	mmc = mmc_alloc_host(sizeof(*host), &connection->bundle->dev);
@@ -736,19 +944,15 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 	mmc->max_req_size = mmc->max_blk_size * mmc->max_blk_count;
 
-	max_buffer = gb_operation_get_payload_size_max(host->connection);
-	host->xfer_buffer = kzalloc(max_buffer, GFP_KERNEL);
-	if (!host->xfer_buffer) {
-		ret = -ENOMEM;
-		goto free_mmc;
-	}
+	gb_operation_window_init(&host->window, GB_SDIO_XFER_DEPTH,
+				 GB_OPERATION_TIMEOUT_DEFAULT, NULL);
 	mutex_init(&host->lock);
 	spin_lock_init(&host->xfer);
 	host->mrq_workqueue = alloc_workqueue("mmc-%s", 0, 1,
 					      dev_name(&connection->bundle->dev));
 	if (!host->mrq_workqueue) {
 		ret = -ENOMEM;
-		goto free_buffer;
+		goto free_mmc;
 	}
 	INIT_WORK(&host->mrqwork, gb_sdio_mrq_work);
 
@@ -763,8 +967,6 @@ static int gb_sdio_connection_init(struct gb_connection *connection)
 
 free_work:
 	destroy_workqueue(host->mrq_workqueue);
-free_buffer:
-	kfree(host->xfer_buffer);
 free_mmc:
 	gb_connection_set_data(connection, NULL);
 	mmc_free_host(mmc);
@@ -776,6 +978,7 @@ static void gb_sdio_connection_exit(struct gb_connection *connection)
 {
 	struct mmc_host *mmc;
 	struct gb_sdio_host *host = gb_connection_get_data(connection);
+	int i;
 
 	if (!host)
 		return;
@@ -789,7 +992,10 @@ static void gb_sdio_connection_exit(struct gb_connection *connection)
 	flush_workqueue(host->mrq_workqueue);
 	destroy_workqueue(host->mrq_workqueue);
 	mmc_remove_host(mmc);
-	kfree(host->xfer_buffer);
+	for (i = 0; i < GB_SDIO_PREP_SLOTS; i++) {
+		if (host->prep[i].data)
+			gb_sdio_prep_release(host, &host->prep[i]);
+	}
 	mmc_free_host(mmc);
 }
 
@@ -16,6 +16,22 @@
 #include "greybus.h"
 #include "gpbridge.h"
 
+/* Number of transfer operations a master keeps in flight */
+#define GB_SPI_OPS_IN_FLIGHT	4
+
+/* Default number of messages a master keeps in flight */
+#define GB_SPI_QUEUE_DEPTH	2
+
+/* Data of an operation carrying the part of msg from xfer on */
+struct gb_spi_chunk {
+	struct spi_message	*msg;
+	struct spi_transfer	*xfer;
+	u32			offset;
+	u32			len;
+	bool			last;		/* msg completes with it */
+	unsigned long		expires;
+};
+
 struct gb_spi {
 	struct gb_connection	*connection;
 	u16			mode;
@@ -24,6 +40,23 @@ struct gb_spi {
 	u8			num_chipselect;
 	u32			min_speed_hz;
 	u32			max_speed_hz;
+	bool			inprogress_supported;
+
+	spinlock_t		queue_lock;	/* protects queue and removed */
+	struct list_head	queue;
+	bool			removed;
+	struct work_struct	work;
+	unsigned int		queue_depth;
+
+	struct mutex		lock;		/* protects the fields below */
+	struct gb_operation_window window;
+	struct delayed_work	timeout_work;
+	unsigned int		msgs_in_flight;
+	struct spi_device	*tx_dev;	/* device of last message */
+	struct spi_message	*tx_msg;	/* message being sent */
+	struct spi_transfer	*tx_xfer;	/* next part to send */
+	u32			tx_offset;
+	bool			cs_held;	/* last sent op kept cs on */
 };
 
 static struct spi_master *get_master_from_spi(struct gb_spi *spi)
@@ -71,65 +104,119 @@ static size_t calc_tx_xfer_size(u32 tx_size, u32 count, size_t len,
 	headers_size = (count + 1) * sizeof(struct gb_spi_transfer);
 
 	if (tx_size + headers_size + len > data_max)
-		return data_max - (tx_size + sizeof(struct gb_spi_transfer));
+		return data_max - (tx_size + headers_size);
 
 	return len;
 }
 
-/* Routines to transfer data */
+static struct spi_transfer *gb_spi_next_xfer(struct spi_message *msg,
+					     struct spi_transfer *xfer)
+{
+	if (list_is_last(&xfer->transfer_list, &msg->transfers))
+		return NULL;
+
+	return list_entry(xfer->transfer_list.next, struct spi_transfer,
+			  transfer_list);
+}
+
+/*
+ * Routines to transfer data
+ *
+ * A message that does not fit a single operation is carried by as many
+ * operations as needed. *xfer and *offset point at the first byte of the
+ * message the operation should start with, and are moved past the part of
+ * the message the operation covers; *xfer is NULL once nothing is left.
+ * A transfer may be split between two operations.
+ *
+ * Only modules supporting GB_SPI_XFER_INPROGRESS can carry on a message in
+ * another operation; without it a message must fit a single operation.
+ */
 static struct gb_operation *
-gb_spi_operation_create(struct gb_connection *connection,
-			struct spi_message *msg, u32 *total_len)
+gb_spi_operation_create(struct gb_spi *spi, struct spi_message *msg,
+			struct spi_transfer **xfer_p, u32 *offset_p,
+			u32 *total_len)
 {
+	struct gb_connection *connection = spi->connection;
 	struct gb_spi_transfer_request *request;
 	struct spi_device *dev = msg->spi;
 	struct spi_transfer *xfer;
 	struct gb_spi_transfer *gb_xfer;
 	struct gb_operation *operation;
-	struct spi_transfer *last_xfer = NULL;
+	struct spi_transfer *end_xfer;
 	u32 tx_size = 0, rx_size = 0, count = 0, xfer_len = 0, request_size;
-	u32 tx_xfer_size = 0, rx_xfer_size = 0, last_xfer_size = 0;
+	u32 tx_xfer_size = 0, rx_xfer_size = 0;
+	u32 offset, end_offset, left;
 	size_t data_max;
+	bool partial;
 	void *tx_data;
+	u32 i;
 
 	data_max = gb_operation_get_payload_size_max(connection);
 
-	/* Find number of transfers queued and tx/rx length in the message */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+	/* Find how much of the message, from the cursor on, fits */
+	xfer = *xfer_p;
+	offset = *offset_p;
+	while (xfer) {
 		if (!xfer->tx_buf && !xfer->rx_buf) {
 			dev_err(&connection->bundle->dev,
 				"bufferless transfer, length %u\n", xfer->len);
-			return NULL;
+			return ERR_PTR(-EINVAL);
 		}
-		last_xfer = xfer;
 
+		if (!tx_header_fit_operation(tx_size, count, data_max))
+			break;
+
+		left = xfer->len - offset;
 		tx_xfer_size = 0;
 		rx_xfer_size = 0;
 
 		if (xfer->tx_buf) {
-			if (!tx_header_fit_operation(tx_size, count, data_max))
+			tx_xfer_size = calc_tx_xfer_size(tx_size, count, left,
+							 data_max);
+			if (!tx_xfer_size && left)
 				break;
-			tx_xfer_size = calc_tx_xfer_size(tx_size, count,
-							 xfer->len, data_max);
-			last_xfer_size = tx_xfer_size;
+			xfer_len = tx_xfer_size;
 		}
 
 		if (xfer->rx_buf) {
 			rx_xfer_size = calc_rx_xfer_size(rx_size, &tx_xfer_size,
-							 xfer->len, data_max);
-			last_xfer_size = rx_xfer_size;
+							 left, data_max);
+			xfer_len = rx_xfer_size;
 		}
 
+		if (!xfer_len && left)
+			break;
+
 		tx_size += tx_xfer_size;
 		rx_size += rx_xfer_size;
 
-		*total_len += last_xfer_size;
+		*total_len += xfer_len;
 		count++;
 
-		if (xfer->len != last_xfer_size)
+		if (xfer_len != left) {
+			offset += xfer_len;
 			break;
+		}
+
+		xfer = gb_spi_next_xfer(msg, xfer);
+		offset = 0;
+	}
+
+	if (!count) {
+		dev_err(&connection->bundle->dev,
+			"transfer does not fit an operation\n");
+		return ERR_PTR(-EMSGSIZE);
 	}
 
+	if (xfer && !spi->inprogress_supported) {
+		dev_err(&connection->bundle->dev,
+			"message does not fit an operation and cannot be split\n");
+		return ERR_PTR(-EMSGSIZE);
+	}
+
+	end_xfer = xfer;
+	end_offset = offset;
+
 	/*
 	 * In addition to space for all message descriptors we need
 	 * to have enough to hold all tx data.
@@ -142,7 +229,7 @@ gb_spi_operation_create(struct gb_connection *connection,
 	operation = gb_operation_create(connection, GB_SPI_TYPE_TRANSFER,
 					request_size, rx_size, GFP_KERNEL);
 	if (!operation)
-		return NULL;
+		return ERR_PTR(-ENOMEM);
 
 	request = operation->request->payload;
 	request->count = cpu_to_le16(count);
@@ -153,84 +240,518 @@ gb_spi_operation_create(struct gb_connection *connection,
 	tx_data = gb_xfer + count;	/* place tx data after last gb_xfer */
 
 	/* Fill in the transfers array */
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
-		if (last_xfer && xfer == last_xfer)
-			xfer_len = last_xfer_size;
+	xfer = *xfer_p;
+	offset = *offset_p;
+	for (i = 0; i < count; i++, gb_xfer++) {
+		partial = xfer == end_xfer;
+		if (partial)
+			xfer_len = end_offset - offset;
 		else
-			xfer_len = xfer->len;
+			xfer_len = xfer->len - offset;
 
 		gb_xfer->speed_hz = cpu_to_le32(xfer->speed_hz);
 		gb_xfer->len = cpu_to_le32(xfer_len);
-		gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
-		gb_xfer->cs_change = xfer->cs_change;
 		gb_xfer->bits_per_word = xfer->bits_per_word;
 
+		/* delay and chipselect change only follow a whole transfer */
+		if (!partial) {
+			gb_xfer->delay_usecs = cpu_to_le16(xfer->delay_usecs);
+			gb_xfer->cs_change = xfer->cs_change;
+		}
+
 		/* Copy tx data */
 		if (xfer->tx_buf) {
 			gb_xfer->rdwr |= GB_SPI_XFER_WRITE;
-			memcpy(tx_data, xfer->tx_buf, xfer_len);
+			memcpy(tx_data, xfer->tx_buf + offset, xfer_len);
 			tx_data += xfer_len;
 		}
 
 		if (xfer->rx_buf)
 			gb_xfer->rdwr |= GB_SPI_XFER_READ;
 
-		if (last_xfer && xfer == last_xfer)
-			break;
-
-		gb_xfer++;
+		if (!partial) {
+			xfer = gb_spi_next_xfer(msg, xfer);
+			offset = 0;
+		}
 	}
 
+	/* The message goes on in the next operation, keep chipselect on */
+	if (end_xfer)
+		request->transfers[count - 1].rdwr |= GB_SPI_XFER_INPROGRESS;
+
+	*xfer_p = end_xfer;
+	*offset_p = end_offset;
+
 	return operation;
 }
 
 static void gb_spi_decode_response(struct spi_message *msg,
-				   struct gb_spi_transfer_response *response)
+				   struct gb_operation *operation)
 {
-	struct spi_transfer *xfer;
-	void *rx_data = response->data;
+	struct gb_spi_chunk *chunk = gb_operation_get_data(operation);
+	struct gb_spi_transfer_request *request;
+	struct gb_spi_transfer *gb_xfer;
+	struct spi_transfer *xfer = chunk->xfer;
+	u32 offset = chunk->offset;
+	void *rx_data;
+	u16 count;
+	u32 len;
+	u16 i;
+
+	request = operation->request->payload;
+	count = le16_to_cpu(request->count);
+	gb_xfer = &request->transfers[0];
+	rx_data = operation->response->payload;
+
+	for (i = 0; i < count; i++, gb_xfer++) {
+		len = le32_to_cpu(gb_xfer->len);
 
-	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
 		/* Copy rx data */
-		if (xfer->rx_buf) {
-			memcpy(xfer->rx_buf, rx_data, xfer->len);
-			rx_data += xfer->len;
+		if (gb_xfer->rdwr & GB_SPI_XFER_READ) {
+			memcpy(xfer->rx_buf + offset, rx_data, len);
+			rx_data += len;
+		}
+
+		offset += len;
+		if (offset == xfer->len) {
+			xfer = gb_spi_next_xfer(msg, xfer);
+			offset = 0;
 		}
 	}
 }
 
-static int gb_spi_transfer_one_message(struct spi_master *master,
-				       struct spi_message *msg)
+static void gb_spi_chunk_put(struct gb_operation *operation)
+{
+	kfree(gb_operation_get_data(operation));
+	gb_operation_put(operation);
+}
+
+/* Send the next part of tx_msg. Called with lock held. */
+static int gb_spi_chunk_send(struct gb_spi *spi)
 {
-	struct gb_spi *spi = spi_master_get_devdata(master);
-	struct gb_connection *connection = spi->connection;
-	struct gb_spi_transfer_response *response;
 	struct gb_operation *operation;
-	u32 len = 0;
+	struct gb_spi_chunk *chunk;
 	int ret;
 
-	operation = gb_spi_operation_create(connection, msg, &len);
-	if (!operation)
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
 		return -ENOMEM;
 
-	ret = gb_operation_request_send_sync(operation);
-	if (!ret) {
-		response = operation->response->payload;
-		if (response)
-			gb_spi_decode_response(msg, response);
-	} else {
-		dev_err(&connection->bundle->dev,
-				"transfer operation failed: %d\n", ret);
+	chunk->msg = spi->tx_msg;
+	chunk->xfer = spi->tx_xfer;
+	chunk->offset = spi->tx_offset;
+
+	operation = gb_spi_operation_create(spi, spi->tx_msg, &spi->tx_xfer,
+					    &spi->tx_offset, &chunk->len);
+	if (IS_ERR(operation)) {
+		kfree(chunk);
+		return PTR_ERR(operation);
+	}
+
+	chunk->last = !spi->tx_xfer;
+	chunk->expires = jiffies +
+			 msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT);
+	gb_operation_set_data(operation, chunk);
+
+	ret = gb_operation_window_send(&spi->window, operation, GFP_KERNEL);
+	if (ret) {
+		gb_spi_chunk_put(operation);
+		return ret;
+	}
+
+	spi->cs_held = spi->tx_xfer != NULL;
+
+	return 0;
+}
+
+/*
+ * Release the chipselect of a message that failed after an operation with
+ * GB_SPI_XFER_INPROGRESS had been sent, using an empty transfer that is
+ * not flagged with it. The message completes with it. Called with lock
+ * held.
+ */
+static int gb_spi_close_send(struct gb_spi *spi, struct spi_message *msg)
+{
+	struct gb_spi_transfer_request *request;
+	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
+	int ret;
+
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (!chunk)
+		return -ENOMEM;
+
+	operation = gb_operation_create(spi->connection, GB_SPI_TYPE_TRANSFER,
+					sizeof(*request) +
+					sizeof(struct gb_spi_transfer),
+					0, GFP_KERNEL);
+	if (!operation) {
+		kfree(chunk);
+		return -ENOMEM;
+	}
+
+	request = operation->request->payload;
+	request->count = cpu_to_le16(1);
+	request->mode = msg->spi->mode;
+	request->chip_select = msg->spi->chip_select;
+
+	chunk->msg = msg;
+	chunk->last = true;
+	chunk->expires = jiffies +
+			 msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT);
+	gb_operation_set_data(operation, chunk);
+
+	ret = gb_operation_window_send(&spi->window, operation, GFP_KERNEL);
+	if (ret) {
+		gb_spi_chunk_put(operation);
+		return ret;
+	}
+
+	spi->cs_held = false;
+
+	return 0;
+}
+
+/*
+ * A message is done; it is completed from done once the lock has been
+ * dropped. Called with lock held.
+ */
+static void gb_spi_msg_done(struct gb_spi *spi, struct spi_message *msg,
+			    struct list_head *done)
+{
+	spi->msgs_in_flight--;
+	list_add_tail(&msg->queue, done);
+}
+
+static void gb_spi_msg_complete(struct list_head *done)
+{
+	struct spi_message *msg, *tmp;
+
+	list_for_each_entry_safe(msg, tmp, done, queue) {
+		list_del_init(&msg->queue);
+
+		if (msg->status == -EINPROGRESS)
+			msg->status = 0;
+
+		if (msg->complete)
+			msg->complete(msg->context);
+	}
+}
+
+/*
+ * Stop sending tx_msg once it has failed. It completes with its operations
+ * still in flight, after the chipselect has been released if it was left
+ * asserted. Called with lock held and room in the window.
+ */
+static void gb_spi_msg_abort(struct gb_spi *spi, struct list_head *done)
+{
+	struct spi_message *msg = spi->tx_msg;
+	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
+	int ret;
+
+	spi->tx_msg = NULL;
+
+	if (spi->cs_held) {
+		ret = gb_spi_close_send(spi, msg);
+		if (!ret)
+			return;
+
+		dev_err(&spi->connection->bundle->dev,
+			"failed to release chipselect: %d\n", ret);
+		spi->cs_held = false;
+	}
+
+	/* the operations of tx_msg are the last ones sent */
+	operation = gb_operation_window_newest(&spi->window);
+	if (operation) {
+		chunk = gb_operation_get_data(operation);
+		if (chunk->msg == msg) {
+			chunk->last = true;
+			return;
+		}
+	}
+
+	gb_spi_msg_done(spi, msg, done);
+}
+
+/*
+ * Take the next queued message, if it may follow the messages in flight.
+ * Operations reach the module in order, so up to queue_depth messages can
+ * be in flight as long as they all address the same chipselect; a message
+ * for another device waits until the bus has drained. Called with lock
+ * held.
+ */
+static struct spi_message *gb_spi_msg_next(struct gb_spi *spi)
+{
+	struct spi_message *msg;
+	unsigned long flags;
+
+	if (spi->msgs_in_flight >= spi->queue_depth)
+		return NULL;
+
+	spin_lock_irqsave(&spi->queue_lock, flags);
+	msg = list_first_entry_or_null(&spi->queue, struct spi_message,
+				       queue);
+	if (msg && spi->msgs_in_flight && msg->spi != spi->tx_dev)
+		msg = NULL;
+	if (msg)
+		list_del_init(&msg->queue);
+	spin_unlock_irqrestore(&spi->queue_lock, flags);
+
+	return msg;
+}
+
+/*
+ * Send as many operations as the window takes, moving on to the next
+ * queued message once all of the current one has been sent. Called with
+ * lock held.
+ */
+static void gb_spi_pump(struct gb_spi *spi, struct list_head *done)
+{
+	struct spi_message *msg;
+	int ret;
+
+	while (!gb_operation_window_full(&spi->window)) {
+		if (!spi->tx_msg) {
+			msg = gb_spi_msg_next(spi);
+			if (!msg)
+				break;
+
+			spi->msgs_in_flight++;
+			spi->tx_dev = msg->spi;
+			spi->tx_xfer = list_first_entry_or_null(&msg->transfers,
+							struct spi_transfer,
+							transfer_list);
+			spi->tx_offset = 0;
+			spi->cs_held = false;
+			if (!spi->tx_xfer) {
+				gb_spi_msg_done(spi, msg, done);
+				continue;
+			}
+			spi->tx_msg = msg;
+		}
+
+		msg = spi->tx_msg;
+		if (msg->status != -EINPROGRESS) {
+			gb_spi_msg_abort(spi, done);
+			continue;
+		}
+
+		ret = gb_spi_chunk_send(spi);
+		if (ret) {
+			dev_err(&spi->connection->bundle->dev,
+				"failed to send transfer operation: %d\n", ret);
+			msg->status = ret;
+			continue;
+		}
+
+		if (!spi->tx_xfer)
+			spi->tx_msg = NULL;
 	}
+}
+
+/*
+ * Take completed operations off the window, in the order they were sent.
+ * Once an operation of a message has failed, the rest are only drained.
+ * Called with lock held.
+ */
+static void gb_spi_retire(struct gb_spi *spi, struct list_head *done)
+{
+	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
+	struct spi_message *msg;
+	int ret;
 
+	while ((operation = gb_operation_window_pop(&spi->window))) {
+		chunk = gb_operation_get_data(operation);
+		msg = chunk->msg;
+		ret = gb_operation_result(operation);
+		if (msg->status == -EINPROGRESS) {
+			if (!ret) {
+				gb_spi_decode_response(msg, operation);
+				msg->actual_length += chunk->len;
+			} else {
+				dev_err(&spi->connection->bundle->dev,
+					"transfer operation failed: %d\n",
+					ret);
+				msg->status = ret;
+			}
+		}
+
+		if (chunk->last)
+			gb_spi_msg_done(spi, msg, done);
+
+		gb_spi_chunk_put(operation);
+	}
+}
+
+/* Arm the timeout of the oldest operation in flight. Called with lock held. */
+static void gb_spi_update(struct gb_spi *spi)
+{
+	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
+
+	operation = gb_operation_window_oldest(&spi->window);
+	if (!operation) {
+		cancel_delayed_work(&spi->timeout_work);
+		return;
+	}
+
+	chunk = gb_operation_get_data(operation);
+	mod_delayed_work(system_wq, &spi->timeout_work,
+			 max_t(long, chunk->expires - jiffies, 0));
+}
+
+static void gb_spi_window_complete(struct gb_operation_window *window,
+				   struct gb_operation *operation)
+{
+	struct gb_spi *spi = container_of(window, struct gb_spi, window);
+	LIST_HEAD(done);
+
+	mutex_lock(&spi->lock);
+	gb_spi_retire(spi, &done);
+	gb_spi_pump(spi, &done);
+	gb_spi_update(spi);
+	mutex_unlock(&spi->lock);
+
+	gb_spi_msg_complete(&done);
+}
+
+/* Cancel the oldest operation in flight once it has timed out */
+static void gb_spi_timeout_work(struct work_struct *work)
+{
+	struct gb_spi *spi = container_of(to_delayed_work(work), struct gb_spi,
+					  timeout_work);
+	struct gb_operation *operation;
+	struct gb_spi_chunk *chunk;
+
+	mutex_lock(&spi->lock);
+	operation = gb_operation_window_oldest(&spi->window);
+	if (operation) {
+		chunk = gb_operation_get_data(operation);
+		if (time_before(jiffies, chunk->expires))
+			operation = NULL;
+		else
+			gb_operation_get(operation);
+	}
+	mutex_unlock(&spi->lock);
+
+	if (!operation)
+		return;
+
+	gb_operation_cancel(operation, -ETIMEDOUT);
 	gb_operation_put(operation);
+}
 
-	msg->actual_length = len;
-	msg->status = 0;
-	spi_finalize_current_message(master);
+static void gb_spi_work(struct work_struct *work)
+{
+	struct gb_spi *spi = container_of(work, struct gb_spi, work);
+	LIST_HEAD(done);
 
-	return ret;
+	mutex_lock(&spi->lock);
+	gb_spi_pump(spi, &done);
+	gb_spi_update(spi);
+	mutex_unlock(&spi->lock);
+
+	gb_spi_msg_complete(&done);
+}
+
+/*
+ * Messages are queued here and sent from gb_spi_work() without waiting for
+ * each other's responses; each is completed from the completion of its
+ * last operation. This may be called in atomic context.
+ */
+static int gb_spi_transfer(struct spi_device *dev, struct spi_message *msg)
+{
+	struct gb_spi *spi = spi_master_get_devdata(dev->master);
+	unsigned long flags;
+
+	msg->actual_length = 0;
+	msg->status = -EINPROGRESS;
+
+	spin_lock_irqsave(&spi->queue_lock, flags);
+	if (spi->removed) {
+		spin_unlock_irqrestore(&spi->queue_lock, flags);
+		return -ESHUTDOWN;
+	}
+	list_add_tail(&msg->queue, &spi->queue);
+	spin_unlock_irqrestore(&spi->queue_lock, flags);
+
+	schedule_work(&spi->work);
+
+	return 0;
+}
+
+/* Fail whatever is still queued or in flight once the master goes away */
+static void gb_spi_flush(struct gb_spi *spi)
+{
+	struct gb_operation *operation;
+	struct spi_message *msg;
+	unsigned long flags;
+	LIST_HEAD(queue);
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&spi->queue_lock, flags);
+	spi->removed = true;
+	list_splice_init(&spi->queue, &queue);
+	spin_unlock_irqrestore(&spi->queue_lock, flags);
+
+	cancel_work_sync(&spi->work);
+
+	for (;;) {
+		mutex_lock(&spi->lock);
+		if (spi->tx_msg && spi->tx_msg->status == -EINPROGRESS)
+			spi->tx_msg->status = -ESHUTDOWN;
+		gb_spi_pump(spi, &done);
+		operation = gb_operation_window_oldest(&spi->window);
+		if (operation)
+			gb_operation_get(operation);
+		mutex_unlock(&spi->lock);
+
+		gb_spi_msg_complete(&done);
+
+		if (!operation)
+			break;
+
+		gb_operation_cancel(operation, -ESHUTDOWN);
+		gb_operation_put(operation);
+	}
+
+	cancel_delayed_work_sync(&spi->timeout_work);
+
+	list_for_each_entry(msg, &queue, queue)
+		msg->status = -ESHUTDOWN;
+	gb_spi_msg_complete(&queue);
+}
+
+static ssize_t queue_depth_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gb_spi *spi = spi_master_get_devdata(to_spi_master(dev));
+
+	return sprintf(buf, "%u\n", spi->queue_depth);
+}
+
+static ssize_t queue_depth_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t len)
+{
+	struct gb_spi *spi = spi_master_get_devdata(to_spi_master(dev));
+	unsigned int depth;
+
+	if (kstrtouint(buf, 10, &depth))
+		return -EINVAL;
+
+	if (!depth || depth > GB_SPI_OPS_IN_FLIGHT)
+		return -EINVAL;
+
+	spi->queue_depth = depth;
+	schedule_work(&spi->work);
+
+	return len;
 }
+static DEVICE_ATTR_RW(queue_depth);
 
 static int gb_spi_setup(struct spi_device *spi)
 {
@@ -279,6 +800,18 @@ static int gb_spi_get_master_config(struct gb_spi *spi)
 	return 0;
 }
 
+/*
+ * Modules keep the chipselect asserted across operations, and thus allow a
+ * message to be split, only from version 0.2 of the protocol on.
+ */
+static bool gb_spi_inprogress_supported(struct gb_connection *connection)
+{
+	if (connection->module_major > GB_SPI_VERSION_MAJOR)
+		return true;
+
+	return connection->module_minor >= GB_SPI_INPROGRESS_MINOR;
+}
+
 static int gb_spi_setup_device(struct gb_spi *spi, u8 cs)
 {
 	struct spi_master *master = get_master_from_spi(spi);
@@ -323,6 +856,18 @@ static int gb_spi_setup_device(struct gb_spi *spi, u8 cs)
 	return 0;
 }
 
+/*
+ * Unregister the master, letting the drivers of its devices finish, then fail
+ * anything still left. The extra reference keeps our data around meanwhile.
+ */
+static void gb_spi_master_remove(struct spi_master *master)
+{
+	spi_master_get(master);
+	spi_unregister_master(master);
+	gb_spi_flush(spi_master_get_devdata(master));
+	spi_master_put(master);
+}
+
 static int gb_spi_connection_init(struct gb_connection *connection)
 {
 	struct gb_spi *spi;
@@ -339,6 +884,14 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 
 	spi = spi_master_get_devdata(master);
 	spi->connection = connection;
+	spin_lock_init(&spi->queue_lock);
+	INIT_LIST_HEAD(&spi->queue);
+	INIT_WORK(&spi->work, gb_spi_work);
+	spi->queue_depth = GB_SPI_QUEUE_DEPTH;
+	mutex_init(&spi->lock);
+	gb_operation_window_init(&spi->window, GB_SPI_OPS_IN_FLIGHT, 0,
+				 gb_spi_window_complete);
+	INIT_DELAYED_WORK(&spi->timeout_work, gb_spi_timeout_work);
 	gb_connection_set_data(connection, master);
 
 	/* get master configuration */
@@ -346,6 +899,8 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 	if (ret)
 		goto out_put_master;
 
+	spi->inprogress_supported = gb_spi_inprogress_supported(connection);
+
 	master->bus_num = -1; /* Allow spi-core to allocate it dynamically */
 	master->num_chipselect = spi->num_chipselect;
 	master->mode_bits = spi->mode;
@@ -355,19 +910,26 @@ static int gb_spi_connection_init(struct gb_connection *connection)
 	/* Attach methods */
 	master->cleanup = gb_spi_cleanup;
 	master->setup = gb_spi_setup;
-	master->transfer_one_message = gb_spi_transfer_one_message;
+	master->transfer = gb_spi_transfer;
 
 	ret = spi_register_master(master);
 	if (ret < 0)
 		goto out_put_master;
 
+	ret = device_create_file(&master->dev, &dev_attr_queue_depth);
+	if (ret < 0) {
+		gb_spi_master_remove(master);
+		return ret;
+	}
+
 	/* now, fetch the devices configuration */
 	for (i = 0; i < spi->num_chipselect; i++) {
 		ret = gb_spi_setup_device(spi, i);
 		if (ret < 0) {
 			dev_err(&connection->bundle->dev,
 				"failed to allocated spi device: %d\n", ret);
-			spi_unregister_master(master);
+			device_remove_file(&master->dev, &dev_attr_queue_depth);
+			gb_spi_master_remove(master);
 			break;
 		}
 	}
@@ -384,7 +946,8 @@ static void gb_spi_connection_exit(struct gb_connection *connection)
 {
 	struct spi_master *master = gb_connection_get_data(connection);
 
-	spi_unregister_master(master);
+	device_remove_file(&master->dev, &dev_attr_queue_depth);
+	gb_spi_master_remove(master);
 }
 
 static struct gb_protocol spi_protocol = {
@@ -14,10 +14,12 @@
 #include <stdint.h>
 #include <poll.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
+#include <getopt.h>
 
 #define MAX_NUM_DEVICES 10
 #define MAX_SYSFS_PATH	0x200
@@ -25,6 +27,9 @@
 #define SYSFS_MAX_INT	0x20
 #define MAX_STR_LEN	255
 #define DEFAULT_ASYNC_TIMEOUT 200000
+#define DEFAULT_VERIFY 1
+#define DEFAULT_TOLERANCE 5.0
+#define JSON_MAX_LEN	0x10000
 
 struct dict {
 	char *name;
@@ -43,6 +48,9 @@ struct loopback_results {
 	uint32_t latency_max;
 	uint32_t latency_min;
 	uint32_t latency_jitter;
+	float latency_p50;
+	float latency_p99;
+	float latency_p999;
 
 	float request_avg;
 	uint32_t request_max;
@@ -58,20 +66,51 @@ struct loopback_results {
 	uint32_t apbridge_unipro_latency_max;
 	uint32_t apbridge_unipro_latency_min;
 	uint32_t apbridge_unipro_latency_jitter;
+	float apbridge_unipro_latency_p50;
+	float apbridge_unipro_latency_p99;
+	float apbridge_unipro_latency_p999;
 
 	float gpbridge_firmware_latency_avg;
 	uint32_t gpbridge_firmware_latency_max;
 	uint32_t gpbridge_firmware_latency_min;
 	uint32_t gpbridge_firmware_latency_jitter;
+	float gpbridge_firmware_latency_p50;
+	float gpbridge_firmware_latency_p99;
+	float gpbridge_firmware_latency_p999;
 
 	uint32_t error;
 };
 
+/* Layout of the samples_<device> debugfs ring, see loopback.c */
+struct sample_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t lost;
+	uint32_t nr;
+	uint32_t offset;
+	uint32_t record_size;
+	uint32_t size;
+};
+
+struct sample_record {
+	uint32_t seq;
+	uint16_t operation_id;
+	uint8_t type;
+	uint8_t pad;
+	int32_t result;
+	uint32_t size;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
 struct loopback_device {
 	char name[MAX_SYSFS_PATH];
 	char sysfs_entry[MAX_SYSFS_PATH];
 	char debugfs_entry[MAX_SYSFS_PATH];
 	struct loopback_results results;
+	int sample_fd;
+	struct sample_ring *ring;
+	FILE *sample_out;
 };
 
 struct loopback_test {
@@ -90,15 +129,29 @@ struct loopback_test {
 	int async_timeout;
 	int async_outstanding_operations;
 	int us_wait;
+	int warmup;
+	int verify;
+	int sweep_min;
+	int sweep_max;
+	int sweep_step;
+	int sweep_geometric;
 	int file_output;
+	int json_output;
+	int sync_start;
+	int record_samples;
+	long long epoch;
 	int poll_count;
+	int sample_count;
+	float tolerance;
+	char baseline[MAX_SYSFS_PATH];
+	char profile[MAX_SYSFS_PATH];
 	char test_name[MAX_STR_LEN];
 	char sysfs_prefix[MAX_SYSFS_PATH];
 	char debugfs_prefix[MAX_SYSFS_PATH];
 	struct timespec poll_timeout;
 	struct loopback_device devices[MAX_NUM_DEVICES];
 	struct loopback_results aggregate_results;
-	struct pollfd fds[MAX_NUM_DEVICES];
+	struct pollfd fds[MAX_NUM_DEVICES * 2];
 };
 
 struct loopback_test t;
@@ -151,6 +204,20 @@ static int get_##field##_aggregate(struct loopback_test *t)		\
 	return val;							\
 }									\
 
+#define GET_MAX_FLOAT(field)						\
+static float get_##field##_aggregate(struct loopback_test *t)		\
+{									\
+	float max = 0;							\
+	int i;								\
+	for (i = 0; i < t->device_count; i++) {				\
+		if (!device_enabled(t, i))				\
+			continue;					\
+		if (t->devices[i].results.field > max)			\
+			max = t->devices[i].results.field;		\
+	}								\
+	return max;							\
+}									\
+
 GET_MAX(throughput_max);
 GET_MAX(request_max);
 GET_MAX(latency_max);
@@ -166,6 +233,15 @@ GET_AVG(request_avg);
 GET_AVG(latency_avg);
 GET_AVG(apbridge_unipro_latency_avg);
 GET_AVG(gpbridge_firmware_latency_avg);
+GET_MAX_FLOAT(latency_p50);
+GET_MAX_FLOAT(latency_p99);
+GET_MAX_FLOAT(latency_p999);
+GET_MAX_FLOAT(apbridge_unipro_latency_p50);
+GET_MAX_FLOAT(apbridge_unipro_latency_p99);
+GET_MAX_FLOAT(apbridge_unipro_latency_p999);
+GET_MAX_FLOAT(gpbridge_firmware_latency_p50);
+GET_MAX_FLOAT(gpbridge_firmware_latency_p99);
+GET_MAX_FLOAT(gpbridge_firmware_latency_p999);
 
 void abort()
 {
@@ -206,7 +282,19 @@ void usage(void)
 	"   -O     Poll loop time out in seconds(max time a test is expected to last, default: 30sec)\n"
 	"   -c     Max number of outstanding operations for async operations\n"
 	"   -w     Wait in uSec between operations\n"
+	"   -u     Number of warm-up iterations left out of the results\n"
+	"   -V     Check of transfer data - 0 none, 1 full (default), 2 sampled, 3 crc32c, 4 random pattern\n"
+	"   -W     Sweep the size as min:max:step, a step of xN multiplies the size by N\n"
+	"   -P     Workload profile file, sent as a mix of operations instead of TEST and SIZE\n"
+	"   -R     Record every sample to <test>_<iterations>_<device>_samples.csv\n"
 	"   -z     Enable output to a CSV file (incompatible with -p)\n"
+	"   -j, --json\n"
+	"          JSON output with every result of each device, written to a .json file with -z\n"
+	"   -B, --baseline FILE\n"
+	"          Compare with the JSON output of a previous run and exit with 2 if the\n"
+	"          throughput or the p99 latency of a device regressed\n"
+	"   -T, --tolerance PCT\n"
+	"          Regression tolerated by --baseline, in percent (default 5)\n"
 	"Examples:\n"
 	"  Send 10000 transfers with a packet size of 128 bytes to all active connections\n"
 	"  loopback_test -t transfer -s 128 -i 10000 -S /sys/bus/greybus/devices/ -D /sys/kernel/debug/gb_loopback/\n"
@@ -214,7 +302,9 @@ void usage(void)
 	"  Send 10000 transfers with a packet size of 128 bytes to connection 1 and 4\n"
 	"  loopback_test -t transfer -s 128 -i 10000 -m 9\n"
 	"  loopback_test -t ping -s 0 128 -i -S /sys/bus/greybus/devices/ -D /sys/kernel/debug/gb_loopback/\n"
-	"  loopback_test -t sink -s 2030 -i 32768 -S /sys/bus/greybus/devices/ -D /sys/kernel/debug/gb_loopback/\n");
+	"  loopback_test -t sink -s 2030 -i 32768 -S /sys/bus/greybus/devices/ -D /sys/kernel/debug/gb_loopback/\n"
+	"  Send 1000 transfers at each size from 16 to 2048 bytes, doubling the size every step\n"
+	"  loopback_test -t transfer -i 1000 -u 100 -W 16:2048:x2\n");
 	abort();
 }
 
@@ -291,6 +381,22 @@ int read_sysfs_int(const char *sys_pfx, const char *node)
 	return val;
 }
 
+long long read_sysfs_int64(const char *sys_pfx, const char *node)
+{
+	char buf[SYSFS_MAX_INT];
+	int fd;
+
+	fd = open_sysfs(sys_pfx, node, O_RDONLY);
+	if (read(fd, buf, sizeof(buf)) < 0) {
+		fprintf(stderr, "unable to read from %s%s %s\n", sys_pfx, node,
+			strerror(errno));
+		close(fd);
+		abort();
+	}
+	close(fd);
+	return atoll(buf);
+}
+
 float read_sysfs_float(const char *sys_pfx, const char *node)
 {
 	int fd;
@@ -339,6 +445,9 @@ static int get_results(struct loopback_test *t)
 		r->latency_min = read_sysfs_int(d->sysfs_entry, "latency_min");
 		r->latency_max = read_sysfs_int(d->sysfs_entry, "latency_max");
 		r->latency_avg = read_sysfs_float(d->sysfs_entry, "latency_avg");
+		r->latency_p50 = read_sysfs_float(d->sysfs_entry, "latency_p50");
+		r->latency_p99 = read_sysfs_float(d->sysfs_entry, "latency_p99");
+		r->latency_p999 = read_sysfs_float(d->sysfs_entry, "latency_p999");
 
 		r->throughput_min = read_sysfs_int(d->sysfs_entry, "throughput_min");
 		r->throughput_max = read_sysfs_int(d->sysfs_entry, "throughput_max");
@@ -350,6 +459,12 @@ static int get_results(struct loopback_test *t)
 			read_sysfs_int(d->sysfs_entry, "apbridge_unipro_latency_max");
 		r->apbridge_unipro_latency_avg =
 			read_sysfs_float(d->sysfs_entry, "apbridge_unipro_latency_avg");
+		r->apbridge_unipro_latency_p50 =
+			read_sysfs_float(d->sysfs_entry, "apbridge_unipro_latency_p50");
+		r->apbridge_unipro_latency_p99 =
+			read_sysfs_float(d->sysfs_entry, "apbridge_unipro_latency_p99");
+		r->apbridge_unipro_latency_p999 =
+			read_sysfs_float(d->sysfs_entry, "apbridge_unipro_latency_p999");
 
 		r->gpbridge_firmware_latency_min =
 			read_sysfs_int(d->sysfs_entry, "gpbridge_firmware_latency_min");
@@ -357,6 +472,12 @@ static int get_results(struct loopback_test *t)
 			read_sysfs_int(d->sysfs_entry, "gpbridge_firmware_latency_max");
 		r->gpbridge_firmware_latency_avg =
 			read_sysfs_float(d->sysfs_entry, "gpbridge_firmware_latency_avg");
+		r->gpbridge_firmware_latency_p50 =
+			read_sysfs_float(d->sysfs_entry, "gpbridge_firmware_latency_p50");
+		r->gpbridge_firmware_latency_p99 =
+			read_sysfs_float(d->sysfs_entry, "gpbridge_firmware_latency_p99");
+		r->gpbridge_firmware_latency_p999 =
+			read_sysfs_float(d->sysfs_entry, "gpbridge_firmware_latency_p999");
 
 		r->request_jitter = r->request_max - r->request_min;
 		r->latency_jitter = r->latency_max - r->latency_min;
@@ -380,6 +501,11 @@ static int get_results(struct loopback_test *t)
 		r->latency_max = get_latency_max_aggregate(t);
 		r->latency_avg = get_latency_avg_aggregate(t);
 
+		/* Worst device, an aggregate percentile needs the histograms */
+		r->latency_p50 = get_latency_p50_aggregate(t);
+		r->latency_p99 = get_latency_p99_aggregate(t);
+		r->latency_p999 = get_latency_p999_aggregate(t);
+
 		r->throughput_min = get_throughput_min_aggregate(t);
 		r->throughput_max = get_throughput_max_aggregate(t);
 		r->throughput_avg = get_throughput_avg_aggregate(t);
@@ -390,6 +516,12 @@ static int get_results(struct loopback_test *t)
 			get_apbridge_unipro_latency_max_aggregate(t);
 		r->apbridge_unipro_latency_avg =
 			get_apbridge_unipro_latency_avg_aggregate(t);
+		r->apbridge_unipro_latency_p50 =
+			get_apbridge_unipro_latency_p50_aggregate(t);
+		r->apbridge_unipro_latency_p99 =
+			get_apbridge_unipro_latency_p99_aggregate(t);
+		r->apbridge_unipro_latency_p999 =
+			get_apbridge_unipro_latency_p999_aggregate(t);
 
 		r->gpbridge_firmware_latency_min =
 			get_gpbridge_firmware_latency_min_aggregate(t);
@@ -397,6 +529,12 @@ static int get_results(struct loopback_test *t)
 			get_gpbridge_firmware_latency_max_aggregate(t);
 		r->gpbridge_firmware_latency_avg =
 			get_gpbridge_firmware_latency_avg_aggregate(t);
+		r->gpbridge_firmware_latency_p50 =
+			get_gpbridge_firmware_latency_p50_aggregate(t);
+		r->gpbridge_firmware_latency_p99 =
+			get_gpbridge_firmware_latency_p99_aggregate(t);
+		r->gpbridge_firmware_latency_p999 =
+			get_gpbridge_firmware_latency_p999_aggregate(t);
 
 		r->request_jitter = r->request_max - r->request_min;
 		r->latency_jitter = r->latency_max - r->latency_min;
@@ -459,12 +597,22 @@ int format_output(struct loopback_test *t,
 			r->latency_max,
 			r->latency_avg,
 			r->latency_jitter);
+		len += snprintf(&buf[len], buf_len - len,
+			" ap-latency usec:\tp50=%f p99=%f p99.9=%f\n",
+			r->latency_p50,
+			r->latency_p99,
+			r->latency_p999);
 		len += snprintf(&buf[len], buf_len - len,
 			" apbridge-latency usec:\tmin=%u max=%u average=%f jitter=%u\n",
 			r->apbridge_unipro_latency_min,
 			r->apbridge_unipro_latency_max,
 			r->apbridge_unipro_latency_avg,
 			r->apbridge_unipro_latency_jitter);
+		len += snprintf(&buf[len], buf_len - len,
+			" apbridge-latency usec:\tp50=%f p99=%f p99.9=%f\n",
+			r->apbridge_unipro_latency_p50,
+			r->apbridge_unipro_latency_p99,
+			r->apbridge_unipro_latency_p999);
 
 		len += snprintf(&buf[len], buf_len - len,
 			" gpbridge-latency usec:\tmin=%u max=%u average=%f jitter=%u\n",
@@ -472,6 +620,11 @@ int format_output(struct loopback_test *t,
 			r->gpbridge_firmware_latency_max,
 			r->gpbridge_firmware_latency_avg,
 			r->gpbridge_firmware_latency_jitter);
+		len += snprintf(&buf[len], buf_len - len,
+			" gpbridge-latency usec:\tp50=%f p99=%f p99.9=%f\n",
+			r->gpbridge_firmware_latency_p50,
+			r->gpbridge_firmware_latency_p99,
+			r->gpbridge_firmware_latency_p999);
 
 	} else {
 		len += snprintf(&buf[len], buf_len- len, ",%s,%s,%u,%u,%u",
@@ -507,6 +660,22 @@ int format_output(struct loopback_test *t,
 			r->gpbridge_firmware_latency_max,
 			r->gpbridge_firmware_latency_avg,
 			r->gpbridge_firmware_latency_jitter);
+
+		/* Percentiles go last to keep the existing columns in place */
+		len += snprintf(&buf[len], buf_len - len, ",%f,%f,%f",
+			r->latency_p50,
+			r->latency_p99,
+			r->latency_p999);
+
+		len += snprintf(&buf[len], buf_len - len, ",%f,%f,%f",
+			r->apbridge_unipro_latency_p50,
+			r->apbridge_unipro_latency_p99,
+			r->apbridge_unipro_latency_p999);
+
+		len += snprintf(&buf[len], buf_len - len, ",%f,%f,%f",
+			r->gpbridge_firmware_latency_p50,
+			r->gpbridge_firmware_latency_p99,
+			r->gpbridge_firmware_latency_p999);
 	}
 
 	printf("\n%s\n", buf);
@@ -575,6 +744,224 @@ static int log_results(struct loopback_test *t)
 	return 0;
 }
 
+#define JSON_U(field)							\
+	len += snprintf(&buf[len], buf_len - len, ",\n\t\t\"" #field "\": %u",	\
+			r->field)
+#define JSON_F(field)							\
+	len += snprintf(&buf[len], buf_len - len, ",\n\t\t\"" #field "\": %f",	\
+			r->field)
+
+/* The results of one device as a flat JSON object */
+static int format_json_results(struct loopback_results *r, const char *name,
+			       char *buf, int buf_len)
+{
+	int len;
+
+	len = snprintf(buf, buf_len, "\t{\n\t\t\"name\": \"%s\"", name);
+	JSON_U(error);
+
+	JSON_U(request_min);
+	JSON_U(request_max);
+	JSON_F(request_avg);
+	JSON_U(request_jitter);
+
+	JSON_U(throughput_min);
+	JSON_U(throughput_max);
+	JSON_F(throughput_avg);
+	JSON_U(throughput_jitter);
+
+	JSON_U(latency_min);
+	JSON_U(latency_max);
+	JSON_F(latency_avg);
+	JSON_U(latency_jitter);
+	JSON_F(latency_p50);
+	JSON_F(latency_p99);
+	JSON_F(latency_p999);
+
+	JSON_U(apbridge_unipro_latency_min);
+	JSON_U(apbridge_unipro_latency_max);
+	JSON_F(apbridge_unipro_latency_avg);
+	JSON_U(apbridge_unipro_latency_jitter);
+	JSON_F(apbridge_unipro_latency_p50);
+	JSON_F(apbridge_unipro_latency_p99);
+	JSON_F(apbridge_unipro_latency_p999);
+
+	JSON_U(gpbridge_firmware_latency_min);
+	JSON_U(gpbridge_firmware_latency_max);
+	JSON_F(gpbridge_firmware_latency_avg);
+	JSON_U(gpbridge_firmware_latency_jitter);
+	JSON_F(gpbridge_firmware_latency_p50);
+	JSON_F(gpbridge_firmware_latency_p99);
+	JSON_F(gpbridge_firmware_latency_p999);
+
+	len += snprintf(&buf[len], buf_len - len, "\n\t}");
+
+	return len;
+}
+
+static int format_json(struct loopback_test *t, char *buf, int buf_len)
+{
+	time_t local_time = time(NULL);
+	struct tm tm = *localtime(&local_time);
+	const char *sep = "";
+	int len, i;
+
+	len = snprintf(buf, buf_len,
+		"{\n\"date\": \"%u-%02u-%02u %02u:%02u:%02u\",\n"
+		"\"test\": \"%s\",\n\"size\": %u,\n\"iterations\": %u,\n"
+		"\"async\": %s,\n\"epoch_ns\": %lld,\n\"devices\": [\n",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec,
+		t->test_name, t->size, t->iteration_max,
+		t->use_async ? "true" : "false", t->epoch);
+
+	for (i = 0; i < t->device_count && len < buf_len; i++) {
+		if (!device_enabled(t, i))
+			continue;
+
+		len += snprintf(&buf[len], buf_len - len, "%s", sep);
+		len += format_json_results(&t->devices[i].results,
+					   t->devices[i].name,
+					   &buf[len], buf_len - len);
+		sep = ",\n";
+	}
+	len += snprintf(&buf[len], buf_len - len, "\n]");
+
+	if (t->aggregate_output && len < buf_len) {
+		len += snprintf(&buf[len], buf_len - len, ",\n\"aggregate\":\n");
+		len += format_json_results(&t->aggregate_results, "aggregate",
+					   &buf[len], buf_len - len);
+	}
+	len += snprintf(&buf[len], buf_len - len, "\n}\n");
+
+	return len < buf_len ? len : -1;
+}
+
+static int log_json(struct loopback_test *t)
+{
+	char file_name[MAX_SYSFS_PATH];
+	char *buf;
+	FILE *f;
+	int len;
+
+	buf = malloc(JSON_MAX_LEN);
+	if (!buf)
+		return -ENOMEM;
+
+	len = format_json(t, buf, JSON_MAX_LEN);
+	if (len < 0) {
+		fprintf(stderr, "JSON output too large\n");
+		free(buf);
+		return -EINVAL;
+	}
+	fputs(buf, stdout);
+
+	if (t->file_output) {
+		snprintf(file_name, sizeof(file_name), "%s_%d_%d.json",
+			 t->test_name, t->size, t->iteration_max);
+		f = fopen(file_name, "w");
+		if (f) {
+			fputs(buf, f);
+			fclose(f);
+		} else {
+			fprintf(stderr, "unable to open %s\n", file_name);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * Find the value of key in the object of the named device of a JSON file
+ * written by log_json(). Objects are flat, which keeps this simple.
+ */
+static int json_get(const char *json, const char *name, const char *key,
+		    float *val)
+{
+	char pattern[MAX_STR_LEN];
+	const char *obj, *end, *p;
+
+	snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+	obj = strstr(json, pattern);
+	if (!obj)
+		return -ENOENT;
+	end = strchr(obj, '}');
+
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	p = strstr(obj, pattern);
+	if (!p || (end && p > end))
+		return -ENOENT;
+
+	*val = strtof(p + strlen(pattern), NULL);
+	return 0;
+}
+
+static int check_device_baseline(struct loopback_test *t, const char *json,
+				 struct loopback_results *r, const char *name)
+{
+	float throughput, p99;
+	int regressed = 0;
+
+	if (json_get(json, name, "throughput_avg", &throughput) ||
+	    json_get(json, name, "latency_p99", &p99)) {
+		fprintf(stderr, "%s: not in baseline %s\n", name, t->baseline);
+		return 0;
+	}
+
+	if (r->throughput_avg < throughput * (1 - t->tolerance / 100)) {
+		fprintf(stderr, "%s: throughput regressed %f -> %f B/s\n",
+			name, throughput, r->throughput_avg);
+		regressed = 1;
+	}
+	if (r->latency_p99 > p99 * (1 + t->tolerance / 100)) {
+		fprintf(stderr, "%s: p99 latency regressed %f -> %f usec\n",
+			name, p99, r->latency_p99);
+		regressed = 1;
+	}
+
+	return regressed;
+}
+
+/* Returns 1 if any device regressed against the baseline file */
+static int check_baseline(struct loopback_test *t)
+{
+	char *json;
+	FILE *f;
+	size_t len;
+	int regressed = 0;
+	int i;
+
+	f = fopen(t->baseline, "r");
+	if (!f) {
+		fprintf(stderr, "unable to open baseline %s\n", t->baseline);
+		return -ENOENT;
+	}
+	json = calloc(1, JSON_MAX_LEN);
+	if (!json) {
+		fclose(f);
+		return -ENOMEM;
+	}
+	len = fread(json, 1, JSON_MAX_LEN - 1, f);
+	json[len] = '\0';
+	fclose(f);
+
+	for (i = 0; i < t->device_count; i++) {
+		if (!device_enabled(t, i))
+			continue;
+		regressed |= check_device_baseline(t, json,
+						   &t->devices[i].results,
+						   t->devices[i].name);
+	}
+	if (t->aggregate_output)
+		regressed |= check_device_baseline(t, json,
+						   &t->aggregate_results,
+						   "aggregate");
+
+	free(json);
+	return regressed;
+}
+
 int is_loopback_device(const char *path, const char *node)
 {
 	char file[MAX_SYSFS_PATH];
@@ -686,6 +1073,136 @@ static int close_poll_files(struct loopback_test *t)
 
 	return 0;
 }
+static void close_sample_files(struct loopback_test *t);
+
+/*
+ * Map the raw sample ring of every device, the records are streamed to
+ * <test>_<iterations>_<device>_samples.csv while the test runs.
+ */
+static int open_sample_files(struct loopback_test *t)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct loopback_device *d = NULL;
+	struct sample_ring *ring;
+	char path[MAX_SYSFS_PATH];
+	int fds_idx = t->poll_count;
+	size_t size;
+	int i;
+
+	for (i = 0; i < t->device_count; i++) {
+		if (!device_enabled(t, i))
+			continue;
+		d = &t->devices[i];
+
+		if (snprintf(path, sizeof(path), "samples_%s",
+			     d->name) >= (int)sizeof(path))
+			goto err;
+		d->sample_fd = open_sysfs(t->debugfs_prefix, path, O_RDWR);
+
+		/* The header tells the size of the whole ring */
+		ring = mmap(NULL, page_size, PROT_READ, MAP_SHARED,
+			    d->sample_fd, 0);
+		if (ring == MAP_FAILED)
+			goto err;
+		size = ring->size;
+		munmap(ring, page_size);
+
+		ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    d->sample_fd, 0);
+		if (ring == MAP_FAILED)
+			goto err;
+		d->ring = ring;
+
+		if (snprintf(path, sizeof(path), "%s_%d_%s_samples.csv",
+			     t->test_name, t->iteration_max,
+			     d->name) >= (int)sizeof(path))
+			goto err;
+		d->sample_out = fopen(path, "w");
+		if (!d->sample_out)
+			goto err;
+		fprintf(d->sample_out,
+			"start_ns,end_ns,size,type,result,operation_id\n");
+
+		t->fds[fds_idx].fd = d->sample_fd;
+		t->fds[fds_idx].events = POLLIN;
+		t->fds[fds_idx].revents = 0;
+		fds_idx++;
+	}
+
+	t->sample_count = fds_idx - t->poll_count;
+
+	return 0;
+
+err:
+	fprintf(stderr, "unable to record the samples of %s\n", d->name);
+	close_sample_files(t);
+
+	return -1;
+}
+
+/* Write out the complete records and hand their slots back to the driver */
+static void drain_samples(struct loopback_device *d)
+{
+	struct sample_ring *ring = d->ring;
+	struct sample_record *rec;
+	uint32_t tail = ring->tail;
+
+	while (1) {
+		rec = (void *)ring + ring->offset +
+		      (tail & (ring->nr - 1)) * ring->record_size;
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != tail + 1)
+			break;
+
+		fprintf(d->sample_out, "%llu,%llu,%u,%u,%d,%u\n",
+			(unsigned long long)rec->start_ns,
+			(unsigned long long)rec->end_ns, rec->size, rec->type,
+			rec->result, rec->operation_id);
+
+		tail++;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void drain_all_samples(struct loopback_test *t)
+{
+	int i;
+
+	for (i = 0; i < t->device_count; i++) {
+		if (t->devices[i].ring && t->devices[i].sample_out)
+			drain_samples(&t->devices[i]);
+	}
+}
+
+static void close_sample_files(struct loopback_test *t)
+{
+	struct loopback_device *d;
+	int i;
+
+	drain_all_samples(t);
+
+	for (i = 0; i < t->device_count; i++) {
+		d = &t->devices[i];
+
+		if (d->ring) {
+			if (d->ring->lost)
+				fprintf(stderr, "%s: %u samples lost\n",
+					d->name, d->ring->lost);
+			munmap(d->ring, d->ring->size);
+			d->ring = NULL;
+		}
+		if (d->sample_out) {
+			fclose(d->sample_out);
+			d->sample_out = NULL;
+		}
+		if (d->sample_fd > 0) {
+			close(d->sample_fd);
+			d->sample_fd = 0;
+		}
+	}
+
+	t->sample_count = 0;
+}
+
 static int is_complete(struct loopback_test *t)
 {
 	int iteration_count;
@@ -747,7 +1264,8 @@ static int wait_for_complete(struct loopback_test *t)
 
 	while (1) {
 
-		ret = ppoll(t->fds, t->poll_count, ts, &mask_old);
+		ret = ppoll(t->fds, t->poll_count + t->sample_count, ts,
+			    &mask_old);
 		if (ret <= 0) {
 			stop_tests(t);
 			fprintf(stderr, "Poll exit with errno %d\n", errno);
@@ -762,6 +1280,13 @@ static int wait_for_complete(struct loopback_test *t)
 			}
 		}
 
+		for (i = 0; i < t->sample_count; i++) {
+			if (t->fds[t->poll_count + i].revents & POLLIN) {
+				drain_all_samples(t);
+				break;
+			}
+		}
+
 		if (number_of_events == t->poll_count)
 			break;
 	}
@@ -774,6 +1299,41 @@ static int wait_for_complete(struct loopback_test *t)
 	return 0;
 }
 
+/* Copy a workload profile file to the profile debugfs file of a device */
+static int load_profile(struct loopback_test *t, struct loopback_device *d)
+{
+	char path[MAX_SYSFS_PATH];
+	char buf[CSV_MAX_LINE];
+	int in, out;
+	ssize_t len;
+
+	in = open(t->profile, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, "unable to open %s\n", t->profile);
+		return -1;
+	}
+	len = read(in, buf, sizeof(buf));
+	close(in);
+	if (len < 0)
+		return -1;
+
+	if (snprintf(path, sizeof(path), "profile_%s",
+		     d->name) >= (int)sizeof(path)) {
+		fprintf(stderr, "profile path too long for %s\n", d->name);
+		return -1;
+	}
+	out = open_sysfs(t->debugfs_prefix, path, O_WRONLY);
+	if (write(out, buf, len) != len) {
+		fprintf(stderr, "unable to load profile %s on %s %s\n",
+			t->profile, d->name, strerror(errno));
+		close(out);
+		return -1;
+	}
+	close(out);
+
+	return 0;
+}
+
 static void prepare_devices(struct loopback_test *t)
 {
 	int i;
@@ -790,6 +1350,9 @@ static void prepare_devices(struct loopback_test *t)
 		write_sysfs_val(t->devices[i].sysfs_entry, "us_wait",
 				t->us_wait);
 
+		if (t->profile[0] && load_profile(t, &t->devices[i]))
+			abort();
+
 		/* Set operation size */
 		write_sysfs_val(t->devices[i].sysfs_entry, "size", t->size);
 
@@ -797,6 +1360,29 @@ static void prepare_devices(struct loopback_test *t)
 		write_sysfs_val(t->devices[i].sysfs_entry, "iteration_max",
 				t->iteration_max);
 
+		write_sysfs_val(t->devices[i].sysfs_entry, "warmup", t->warmup);
+
+		write_sysfs_val(t->devices[i].sysfs_entry, "verify", t->verify);
+
+		write_sysfs_val(t->devices[i].sysfs_entry, "profile",
+				!!t->profile[0]);
+
+		/* Hold the test until all the devices are started at once */
+		write_sysfs_val(t->devices[i].sysfs_entry, "armed",
+				t->sync_start);
+
+		/* Set the size sweep, a zero maximum disables it */
+		write_sysfs_val(t->devices[i].sysfs_entry, "sweep_max",
+				t->sweep_max);
+		if (t->sweep_max) {
+			write_sysfs_val(t->devices[i].sysfs_entry, "sweep_min",
+					t->sweep_min);
+			write_sysfs_val(t->devices[i].sysfs_entry, "sweep_step",
+					t->sweep_step);
+			write_sysfs_val(t->devices[i].sysfs_entry, "sweep_mode",
+					t->sweep_geometric);
+		}
+
 		if (t->use_async) {
 			write_sysfs_val(t->devices[i].sysfs_entry,
 				"async", 1);
@@ -811,6 +1397,66 @@ static void prepare_devices(struct loopback_test *t)
 	}
 }
 
+/*
+ * Print the per-device debugfs tables named <table>_<device>, such as the
+ * sweep and profile results, and append them to <test>_<iterations>_<table>.csv
+ */
+static void log_device_tables(struct loopback_test *t, const char *table)
+{
+	char path[MAX_SYSFS_PATH];
+	char line[CSV_MAX_LINE];
+	FILE *in, *out = NULL;
+	int header = 0;
+	char *c;
+	int i;
+
+	if (t->file_output && !t->porcelain) {
+		snprintf(path, sizeof(path), "%s_%d_%s.csv", t->test_name,
+			 t->iteration_max, table);
+		out = fopen(path, "a");
+		if (!out)
+			fprintf(stderr, "unable to open %s for appending\n",
+				path);
+	}
+
+	for (i = 0; i < t->device_count; i++) {
+		if (!device_enabled(t, i))
+			continue;
+
+		if (snprintf(path, sizeof(path), "%s%s_%s", t->debugfs_prefix,
+			     table, t->devices[i].name) >= (int)sizeof(path)) {
+			fprintf(stderr, "%s path too long for %s\n", table,
+				t->devices[i].name);
+			continue;
+		}
+		in = fopen(path, "r");
+		if (!in) {
+			fprintf(stderr, "unable to open %s\n", path);
+			continue;
+		}
+
+		while (fgets(line, sizeof(line), in)) {
+			if (line[0] == '#') {
+				if (!header++)
+					printf("# device%s", line + 1);
+				continue;
+			}
+			printf("%s %s", t->devices[i].name, line);
+			if (!out)
+				continue;
+			for (c = line; *c; c++)
+				if (*c == ' ')
+					*c = ',';
+			fprintf(out, "%s,%s,%s", t->test_name,
+				t->devices[i].name, line);
+		}
+		fclose(in);
+	}
+
+	if (out)
+		fclose(out);
+}
+
 static int start(struct loopback_test *t)
 {
 	int i;
@@ -823,12 +1469,19 @@ static int start(struct loopback_test *t)
 		write_sysfs_val(t->devices[i].sysfs_entry, "type", t->test_id);
 	}
 
+	/* armed devices wait for the global start, which sets the epoch */
+	if (t->sync_start) {
+		write_sysfs_val(t->debugfs_prefix, "start", 1);
+		t->epoch = read_sysfs_int64(t->debugfs_prefix, "start");
+	}
+
 	return 0;
 }
 
 
-void loopback_run(struct loopback_test *t)
+int loopback_run(struct loopback_test *t)
 {
+	char start_file[MAX_SYSFS_PATH];
 	int i;
 	int ret;
 
@@ -839,18 +1492,32 @@ void loopback_run(struct loopback_test *t)
 	if (!t->test_id) {
 		fprintf(stderr, "invalid test %s\n", t->test_name);
 		usage();
-		return;
+		return -EINVAL;
 	}
 
+	/* Start all the devices together if the driver supports it */
+	t->sync_start = snprintf(start_file, sizeof(start_file), "%sstart",
+				 t->debugfs_prefix) < (int)sizeof(start_file) &&
+			 !access(start_file, W_OK);
+
 	prepare_devices(t);
 
 	ret = open_poll_files(t);
 	if (ret)
 		goto err;
 
+	if (t->record_samples) {
+		ret = open_sample_files(t);
+		if (ret) {
+			close_poll_files(t);
+			goto err;
+		}
+	}
+
 	start(t);
 
 	ret = wait_for_complete(t);
+	close_sample_files(t);
 	close_poll_files(t);
 	if (ret)
 		goto err;
@@ -858,13 +1525,42 @@ void loopback_run(struct loopback_test *t)
 
 	get_results(t);
 
-	log_results(t);
+	if (t->json_output)
+		log_json(t);
+	else
+		log_results(t);
 
-	return;
+	if (t->sweep_max)
+		log_device_tables(t, "sweep");
+	if (t->profile[0])
+		log_device_tables(t, "profile");
+
+	if (t->baseline[0])
+		return check_baseline(t);
+
+	return 0;
 
 err:
 	printf("Error running test\n");
-	return;
+	return ret;
+}
+
+/* Parse a min:max:step size sweep, "xN" as step for a geometric sweep */
+static int parse_sweep(struct loopback_test *t, const char *arg)
+{
+	char step[MAX_STR_LEN];
+
+	if (sscanf(arg, "%d:%d:%254s", &t->sweep_min, &t->sweep_max,
+		   step) != 3)
+		return -EINVAL;
+
+	t->sweep_geometric = step[0] == 'x';
+	t->sweep_step = atoi(step + t->sweep_geometric);
+	if (t->sweep_min < 0 || t->sweep_max <= 0 || t->sweep_step <= 0 ||
+	    t->sweep_min > t->sweep_max)
+		return -EINVAL;
+
+	return 0;
 }
 
 static int sanity_check(struct loopback_test *t)
@@ -891,6 +1587,13 @@ static int sanity_check(struct loopback_test *t)
 	return 0;
 }
 
+static const struct option long_options[] = {
+	{"json",	no_argument,		NULL, 'j'},
+	{"baseline",	required_argument,	NULL, 'B'},
+	{"tolerance",	required_argument,	NULL, 'T'},
+	{NULL,		0,			NULL, 0}
+};
+
 int main(int argc, char *argv[])
 {
 	int o, ret;
@@ -898,9 +1601,12 @@ int main(int argc, char *argv[])
 	char *debugfs_prefix = "/sys/kernel/debug/gb_loopback/";
 
 	memset(&t, 0, sizeof(t));
+	t.verify = -1;
+	t.tolerance = DEFAULT_TOLERANCE;
 
-	while ((o = getopt(argc, argv,
-			   "t:s:i:S:D:m:v::d::r::p::a::l::x::o:c:w:O:")) != -1) {
+	while ((o = getopt_long(argc, argv,
+			"t:s:i:S:D:m:v::d::r::p::a::l::x::o:c:w:O:u:W:V:jB:T:P:R",
+			long_options, NULL)) != -1) {
 		switch (o) {
 		case 't':
 			snprintf(t.test_name, MAX_STR_LEN, "%s", optarg);
@@ -953,8 +1659,34 @@ int main(int argc, char *argv[])
 		case 'w':
 			t.us_wait = atoi(optarg);
 			break;
+		case 'u':
+			t.warmup = atoi(optarg);
+			break;
+		case 'V':
+			t.verify = atoi(optarg);
+			break;
+		case 'j':
+			t.json_output = 1;
+			break;
+		case 'B':
+			snprintf(t.baseline, MAX_SYSFS_PATH, "%s", optarg);
+			break;
+		case 'P':
+			snprintf(t.profile, MAX_SYSFS_PATH, "%s", optarg);
+			break;
+		case 'T':
+			t.tolerance = atof(optarg);
+			break;
+		case 'R':
+			t.record_samples = 1;
+			break;
+		case 'W':
+			if (parse_sweep(&t, optarg))
+				usage();
+			break;
 		case 'z':
 			t.file_output = 1;
+			break;
 		default:
 			usage();
 			return -EINVAL;
@@ -985,7 +1717,13 @@ int main(int argc, char *argv[])
 	if (t.async_timeout == 0)
 		t.async_timeout = DEFAULT_ASYNC_TIMEOUT;
 
-	loopback_run(&t);
+	if (t.verify < 0)
+		t.verify = DEFAULT_VERIFY;
 
-	return 0;
+	ret = loopback_run(&t);
+	if (ret < 0)
+		return 1;
+
+	/* Tell a regression apart from a failure to run the test */
+	return ret ? 2 : 0;
 }